@@ -0,0 +1,139 @@
+#ifndef _SBC_BENCH_H
+#define _SBC_BENCH_H
+
+/*
+ * Helpers shared by the benchmarks: timing, percentiles and synthetic
+ * images.  Every benchmark prints one JSON document on stdout so results
+ * can be compared between releases.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "vm_sbc.h"
+
+// synthetic images are placed here, far away from anything the kernel
+// hands out by default, BENCH_IMG_STRIDE apart
+#define BENCH_IMG_BASE   0x200000000000UL
+#define BENCH_IMG_STRIDE 0x10000000UL
+
+static inline unsigned long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int bench_cmp_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+/* sorts samples in place */
+static inline unsigned long bench_percentile(unsigned long *samples, size_t n, double pct) {
+    qsort(samples, n, sizeof(*samples), bench_cmp_ulong);
+    size_t idx = (size_t)(pct * (n - 1));
+    return samples[idx];
+}
+
+/* the code a synthetic image's entry points run: a bare return */
+static const unsigned char bench_ret_insn[] = { 0xc3 };
+
+/*
+ * write a synthetic image to path: one executable page whose first byte
+ * is the entry point (a bare ret), followed by num_regions - 1 writable
+ * regions of region_size bytes, each separated by a one-page gap so they
+ * stay separate mappings.
+ */
+static inline int bench_gen_image(const char *path, unsigned long base,
+                                  size_t num_regions, size_t region_size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ImageRegion *regions = calloc(num_regions, sizeof(ImageRegion));
+    if (!regions)
+        return -1;
+
+    regions[0].start = base;
+    regions[0].end = base + page_size;
+    regions[0].src = bench_ret_insn;
+    regions[0].src_len = sizeof(bench_ret_insn);
+    strcpy(regions[0].perms, "r-xp");
+
+    unsigned long addr = regions[0].end + page_size;
+    for (size_t i = 1; i < num_regions; i++) {
+        regions[i].start = addr;
+        regions[i].end = addr + region_size;
+        strcpy(regions[i].perms, "rw-p");
+        addr = regions[i].end + page_size;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(regions);
+        return -1;
+    }
+    void (*entry)(int) = (void (*)(int))base;
+    int ret = sbc_write_image(fd, regions, num_regions, &entry, 1);
+    close(fd);
+    free(regions);
+    return ret;
+}
+
+/*
+ * write a synthetic image whose entry point calls on into another
+ * subcontext: it counts its calls in the second quadword of its data page
+ * and then calls the function whose address is in the first, unless that
+ * is NULL.  The code page is at base and the data page two pages above it.
+ */
+static inline int bench_gen_chain_image(const char *path, unsigned long base) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long data = base + 2 * page_size;
+    int counter_disp = (int)(data + 8 - (base + 7));
+    int next_disp = (int)(data - (base + 14));
+    unsigned char code[] = {
+        0x48, 0xff, 0x05, 0, 0, 0, 0,  // inc qword [rip + counter]
+        0x48, 0x8b, 0x05, 0, 0, 0, 0,  // mov rax, [rip + next]
+        0x48, 0x85, 0xc0,              // test rax, rax
+        0x74, 0x02,                    // jz ret
+        0xff, 0xd0,                    // call rax
+        0xc3,                          // ret
+    };
+    memcpy(code + 3, &counter_disp, 4);
+    memcpy(code + 10, &next_disp, 4);
+
+    ImageRegion regions[2] = {
+        { .start = base, .end = base + page_size, .src = code, .src_len = sizeof(code),
+          .perms = "r-xp" },
+        { .start = data, .end = data + page_size, .perms = "rw-p" },
+    };
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    void (*entry)(int) = (void (*)(int))base;
+    int ret = sbc_write_image(fd, regions, 2, &entry, 1);
+    close(fd);
+    return ret;
+}
+
+/*
+ * the library reports its progress on stdout; benchmarks silence it while
+ * they measure so that only their JSON ends up there
+ */
+static int bench_saved_stdout = -1;
+
+static inline void bench_quiet(int quiet) {
+    fflush(stdout);
+    if (quiet && bench_saved_stdout == -1) {
+        bench_saved_stdout = dup(STDOUT_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    } else if (!quiet && bench_saved_stdout != -1) {
+        dup2(bench_saved_stdout, STDOUT_FILENO);
+        close(bench_saved_stdout);
+        bench_saved_stdout = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include "bench.h"
+
+/*
+ * Allocation throughput of the subcontext arena (sbc_arena.c) against
+ * glibc malloc, for a few size mixes.  Each round allocates a batch of
+ * blocks, touches them and frees them again, so after the first round both
+ * allocators serve requests from their free lists.
+ */
+
+#define BATCH  1024
+#define ROUNDS 2000
+
+typedef void *(*alloc_fn)(size_t);
+typedef void (*free_fn)(void *);
+
+/* allocations plus frees per second, in millions */
+static double throughput(alloc_fn alloc, free_fn release, size_t min_size, size_t max_size) {
+    static void *blocks[BATCH];
+    size_t span = max_size - min_size + 1;
+    unsigned int seed = 1;
+
+    unsigned long t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < BATCH; i++) {
+            seed = seed * 1103515245 + 12345;
+            char *p = alloc(min_size + (seed >> 8) % span);
+            if (!p) {
+                fprintf(stderr, "allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+            p[0] = (char)i;
+            blocks[i] = p;
+        }
+        for (int i = 0; i < BATCH; i++)
+            release(blocks[i]);
+    }
+    unsigned long ns = bench_now_ns() - t0;
+    return 2.0 * BATCH * ROUNDS / (ns / 1e3);
+}
+
+int main(void) {
+    size_t mixes[][2] = { { 16, 16 }, { 16, 256 }, { 256, 4096 }, { 4096, 65536 } };
+
+    if (sbc_arena_init(256UL << 20) != 0)
+        return EXIT_FAILURE;
+
+    printf("{\"benchmark\":\"arena\",\"batch\":%d,\"rounds\":%d,\"mixes\":[", BATCH, ROUNDS);
+    for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+        double arena = throughput(sbc_arena_alloc, sbc_arena_free, mixes[i][0], mixes[i][1]);
+        double libc = throughput(malloc, free, mixes[i][0], mixes[i][1]);
+        printf("%s{\"min_size\":%zu,\"max_size\":%zu,\"arena_mops\":%.1f,\"malloc_mops\":%.1f}",
+               i ? "," : "", mixes[i][0], mixes[i][1], arena, libc);
+    }
+    printf("]}\n");
+    return EXIT_SUCCESS;
+}
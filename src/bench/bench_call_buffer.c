@@ -0,0 +1,76 @@
+#include "bench.h"
+
+/*
+ * Throughput of bulk data exchange with a subcontext by payload size.
+ * "zero_copy" produces the payload straight in the call buffer and lets
+ * the subcontext read it in place; "copied" passes the same payload the
+ * old way, copied in by the client and again by the subcontext into its
+ * own memory.  The subcontext adds up the payload either way, so
+ * both touch every byte at least once.
+ */
+
+#define TARGET_BYTES (128UL << 20)
+#define REPEATS      3
+
+static unsigned char payload[16UL << 20];
+
+/* MB/s moving len bytes per call through function func_idx */
+static double throughput(int fd, char *buf, int func_idx, size_t len, int copy_in) {
+    size_t calls = TARGET_BYTES / len;
+    if (calls < 4)
+        calls = 4;
+    SbcSlice in = { 0, len }, out;
+    unsigned long best = ~0UL;
+
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long t0 = bench_now_ns();
+        for (size_t c = 0; c < calls; c++) {
+            if (copy_in)
+                memcpy(buf, payload, len);
+            if (call_subcontext_slice(func_idx, fd, in, &out) != EXIT_SUCCESS ||
+                out.len != sizeof(unsigned long)) {
+                fprintf(stderr, "call failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        unsigned long ns = bench_now_ns() - t0;
+        if (ns < best)
+            best = ns;
+    }
+    return (double)len * calls / 1e6 / (best / 1e9);
+}
+
+int main(void) {
+    size_t sizes[] = { 4UL << 10, 64UL << 10, 1UL << 20, 4UL << 20, 16UL << 20 };
+
+    if (system("./bench_call_server > /dev/null") != 0) {
+        fprintf(stderr, "bench_call_server failed\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_quiet(1);
+    init();
+    int fd = map_subcontext("img_files/call_server.img");
+    bench_quiet(0);
+    unlink("img_files/call_server.img");
+    size_t size;
+    char *buf = fd < 0 || fd == EXIT_FAILURE ? NULL : sbc_call_buffer(fd, &size);
+    if (!buf) {
+        fprintf(stderr, "failed to map the call server image\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(payload, 0x5a, sizeof(payload));
+    memset(buf, 0x5a, sizeof(payload));
+
+    printf("{\"benchmark\":\"call_buffer\",\"sizes\":[");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double zero_copy = throughput(fd, buf, 0, sizes[i], 0);
+        double copied = throughput(fd, buf, 1, sizes[i], 1);
+        printf("%s{\"payload_bytes\":%zu,\"zero_copy_mb_per_s\":%.1f,\"copied_mb_per_s\":%.1f}",
+               i ? "," : "", sizes[i], zero_copy, copied);
+    }
+    printf("]}\n");
+    finalize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#include "bench.h"
+
+/*
+ * The server side of bench_call_buffer.  Both functions add up the words
+ * of their input; function1 reads it in place in the call buffer, while
+ * function2 first copies it into memory of its own, the way data had to
+ * be passed before call buffers existed.
+ */
+
+#define STAGING_SIZE (16UL << 20)
+
+static unsigned char staging[STAGING_SIZE];
+
+/* a word at a time, so that the copies are not hidden behind the sum */
+static unsigned long sum_bytes(const unsigned char *p, size_t len) {
+    const unsigned long *w = (const unsigned long *)p;
+    unsigned long sum = 0;
+    for (size_t i = 0; i < len / sizeof(*w); i++)
+        sum += w[i];
+    return sum;
+}
+
+/* return the sum in the eight bytes after the input */
+static void return_sum(SbcSlice in, unsigned long sum) {
+    unsigned long *out = sbc_slice((SbcSlice){ in.offset + in.len, sizeof(sum) });
+    if (out) {
+        *out = sum;
+        sbc_return_slice(in.offset + in.len, sizeof(sum));
+    }
+}
+
+void in_place(int arg) {
+    SbcSlice in = sbc_call_args.in;
+    const unsigned char *src = sbc_slice(in);
+    if (src)
+        return_sum(in, sum_bytes(src, in.len));
+}
+
+void copied(int arg) {
+    SbcSlice in = sbc_call_args.in;
+    const unsigned char *src = sbc_slice(in);
+    if (!src || in.len > STAGING_SIZE)
+        return;
+    memcpy(staging, src, in.len);
+    return_sum(in, sum_bytes(staging, in.len));
+}
+
+int main(void) {
+    void (*funcs[2])(int) = { in_place, copied };
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    return create_image_file("bench_call_server.c", funcs, 2);
+}
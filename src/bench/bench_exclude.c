@@ -0,0 +1,85 @@
+#include <malloc.h>
+#include <sys/stat.h>
+#include "bench.h"
+
+/*
+ * Image size and snapshot time of a server with live data, a scratch
+ * buffer its clients never use and a heap that has freed most of what it
+ * once held: snapshotting everything as before, with the heap trimmed, and
+ * with the scratch buffer excluded as well.
+ */
+
+#define IMG_PATH   "img_files/exclude.img"
+#define LIVE_MB    16
+#define SCRATCH_MB 32
+#define FREED_MB   32
+#define CHUNK      (64 << 10)
+#define REPEATS    3
+
+static void entry(int arg) { (void)arg; }
+
+/* best of REPEATS snapshots; stores the allocated size of the image */
+static unsigned long time_snapshot(long *img_kb) {
+    void (*funcs[1])(int) = { entry };
+    unsigned long best = ~0UL;
+    for (int r = 0; r < REPEATS; r++) {
+        bench_quiet(1);
+        unsigned long t0 = bench_now_ns();
+        int ret = create_image_file("bench_exclude.c", funcs, 1);
+        unsigned long t = bench_now_ns() - t0;
+        bench_quiet(0);
+        struct stat st;
+        if (ret != EXIT_SUCCESS || stat(IMG_PATH, &st) != 0) {
+            fprintf(stderr, "create_image_file failed\n");
+            exit(EXIT_FAILURE);
+        }
+        *img_kb = st.st_blocks / 2;
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void print_result(const char *name, unsigned long ns, long img_kb) {
+    printf("\"%s\":{\"image_kb\":%ld,\"ms\":%.2f}", name, img_kb, ns / 1e6);
+}
+
+int main(void) {
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+
+    // chunks below the mmap threshold, so they all come from the heap
+    mallopt(M_MMAP_THRESHOLD, 2 * CHUNK);
+    char *live = malloc(LIVE_MB << 20);
+    memset(live, 0x5a, LIVE_MB << 20);
+    char *scratch = malloc(SCRATCH_MB << 20);
+    memset(scratch, 0x5a, SCRATCH_MB << 20);
+    size_t num_freed = (FREED_MB << 20) / CHUNK;
+    char **freed = malloc(num_freed * sizeof(char *));
+    for (size_t i = 0; i < num_freed; i++) {
+        freed[i] = malloc(CHUNK);
+        memset(freed[i], 0x5a, CHUNK);
+    }
+    // the last chunk stays, so the freed memory is not at the top of the heap
+    for (size_t i = 0; i + 1 < num_freed; i++)
+        free(freed[i]);
+
+    long all_kb, trim_kb, exclude_kb;
+    sbc_trim_heap(0);
+    unsigned long all_ns = time_snapshot(&all_kb);
+    sbc_trim_heap(1);
+    unsigned long trim_ns = time_snapshot(&trim_kb);
+    sbc_exclude(scratch, SCRATCH_MB << 20);
+    unsigned long exclude_ns = time_snapshot(&exclude_kb);
+    unlink(IMG_PATH);
+
+    printf("{\"benchmark\":\"exclude\",\"live_mb\":%d,\"scratch_mb\":%d,\"freed_mb\":%d,",
+           LIVE_MB, SCRATCH_MB, FREED_MB);
+    print_result("everything", all_ns, all_kb);
+    printf(",");
+    print_result("trimmed", trim_ns, trim_kb);
+    printf(",");
+    print_result("trimmed_excluded", exclude_ns, exclude_kb);
+    printf("}\n");
+    return EXIT_SUCCESS;
+}
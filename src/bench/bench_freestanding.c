@@ -0,0 +1,18 @@
+/*
+ * The executable bench_mkimage turns into an image offline: no libc and
+ * no startup code, with some data and .bss to carry along.
+ */
+
+static long counter = 1;
+static char scratch[1 << 20];
+
+void entry(int arg) {
+    counter += arg;
+    scratch[counter & (sizeof(scratch) - 1)]++;
+}
+
+// never runs; the linker wants an entry point
+void _start(void) {
+    for (;;)
+        ;
+}
@@ -0,0 +1,181 @@
+#include "bench.h"
+
+/*
+ * map_subcontext() latency against image size and against the number of
+ * entries in the image, mapped up front or with SBC_MAP_LAZY, the cost of
+ * find_subcontext_by_addr(), the number of mappings an image of many
+ * entries leaves after one call either way, and the startup of a client
+ * that maps many images: one after the other with map_subcontext() or all
+ * at once with map_subcontext_async().
+ */
+
+#define IMG_PATH   "img_files/bench_map.img"
+#define REPEATS    5
+#define LOOKUPS    100000
+#define STARTUP_IMAGES  24
+#define STARTUP_ENTRIES 16
+#define VMA_ENTRIES     512
+
+static unsigned long time_map(size_t num_regions, size_t region_size, int flags) {
+    unsigned long best = ~0UL;
+    bench_quiet(1);
+    if (bench_gen_image(IMG_PATH, BENCH_IMG_BASE, num_regions, region_size) != 0) {
+        bench_quiet(0);
+        fprintf(stderr, "failed to generate image\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long t0 = bench_now_ns();
+        int fd = map_subcontext_ex(IMG_PATH, flags);
+        unsigned long t = bench_now_ns() - t0;
+        if (fd < 0 || fd == EXIT_FAILURE) {
+            bench_quiet(0);
+            fprintf(stderr, "map_subcontext failed\n");
+            exit(EXIT_FAILURE);
+        }
+        unmap_subcontext(fd);
+        if (t < best)
+            best = t;
+    }
+    bench_quiet(0);
+    return best;
+}
+
+/* the number of mappings in this process */
+static int count_vmas(void) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    int n = 0, c;
+    if (!maps)
+        return -1;
+    while ((c = fgetc(maps)) != EOF)
+        n += c == '\n';
+    fclose(maps);
+    return n;
+}
+
+/* mappings added by mapping an image of VMA_ENTRIES entries and calling
+ * its function once, which touches only its code region */
+static int vmas_after_call(int flags) {
+    bench_quiet(1);
+    int before = count_vmas();
+    int fd = map_subcontext_ex(IMG_PATH, flags);
+    int ok = fd >= 0 && fd != EXIT_FAILURE && call_subcontext_function(0, fd) == EXIT_SUCCESS;
+    int added = count_vmas() - before;
+    if (ok)
+        unmap_subcontext(fd);
+    bench_quiet(0);
+    if (!ok) {
+        fprintf(stderr, "calling the image failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return added;
+}
+
+/* map the startup images serially or asynchronously; returns the time
+ * until all of them are mapped */
+static unsigned long time_startup(char paths[][SMLBUFSZ], int async) {
+    int fds[STARTUP_IMAGES];
+    bench_quiet(1);
+    unsigned long t0 = bench_now_ns();
+    for (int i = 0; i < STARTUP_IMAGES; i++)
+        fds[i] = async ? map_subcontext_async(paths[i], 0) : map_subcontext(paths[i]);
+    int ok = 1;
+    for (int i = 0; i < STARTUP_IMAGES; i++)
+        ok &= fds[i] >= 0 && fds[i] != EXIT_FAILURE && sbc_map_wait(fds[i]) == 0;
+    unsigned long t = bench_now_ns() - t0;
+    for (int i = 0; i < STARTUP_IMAGES; i++)
+        unmap_subcontext(fds[i]);
+    bench_quiet(0);
+    if (!ok) {
+        fprintf(stderr, "mapping the startup images failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return t;
+}
+
+int main(void) {
+    size_t sizes_kb[] = { 64, 1024, 16384, 65536 };
+    size_t entry_counts[] = { 2, 8, 32, 128, 512 };
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+
+    printf("{\"benchmark\":\"map\",\"by_size\":[");
+    for (size_t i = 0; i < sizeof(sizes_kb) / sizeof(sizes_kb[0]); i++) {
+        // four data regions sharing the total size
+        size_t region_size = (sizes_kb[i] << 10) / 4;
+        unsigned long ns = time_map(5, region_size, 0);
+        printf("%s{\"image_kb\":%zu,\"entries\":5,\"ns\":%lu}", i ? "," : "", sizes_kb[i], ns);
+    }
+
+    printf("],\"by_entries\":[");
+    for (size_t i = 0; i < sizeof(entry_counts) / sizeof(entry_counts[0]); i++) {
+        unsigned long ns = time_map(entry_counts[i], 4096, 0);
+        unsigned long lazy_ns = time_map(entry_counts[i], 4096, SBC_MAP_LAZY);
+        printf("%s{\"entries\":%zu,\"ns\":%lu,\"ns_per_entry\":%lu,\"lazy_ns\":%lu}",
+               i ? "," : "", entry_counts[i], ns, ns / entry_counts[i], lazy_ns);
+    }
+
+    // time_map left an image of the largest entry count behind
+    int eager_vmas = vmas_after_call(0);
+    int lazy_vmas = vmas_after_call(SBC_MAP_LAZY);
+    printf("],\"vmas_after_call\":{\"entries\":%d,\"eager\":%d,\"lazy\":%d", VMA_ENTRIES,
+           eager_vmas, lazy_vmas);
+
+    // lookup cost: eight images of 64 entries, looking up the last entry of
+    // the last image (the worst case for the linear scan) and a miss
+    printf("},\"lookup\":{");
+    bench_quiet(1);
+    int fds[8];
+    for (int i = 0; i < 8; i++) {
+        char path[SMLBUFSZ];
+        snprintf(path, sizeof(path), "img_files/bench_lookup%d.img", i);
+        bench_gen_image(path, BENCH_IMG_BASE + i * BENCH_IMG_STRIDE, 64, 4096);
+        fds[i] = map_subcontext(path);
+        unlink(path);
+    }
+    bench_quiet(0);
+    MappedSubcontext *last = &mapped_subcontexts[num_mapped_subcontexts - 1];
+    void *hit = (void *)last->entries[last->num_entries - 1].start;
+    void *miss = (void *)0x10;
+    volatile MappedSubcontext *sink;
+
+    unsigned long t0 = bench_now_ns();
+    for (int i = 0; i < LOOKUPS; i++)
+        sink = find_subcontext_by_addr(hit);
+    unsigned long hit_ns = bench_now_ns() - t0;
+    t0 = bench_now_ns();
+    for (int i = 0; i < LOOKUPS; i++)
+        sink = find_subcontext_by_addr(miss);
+    unsigned long miss_ns = bench_now_ns() - t0;
+    (void)sink;
+    printf("\"subcontexts\":8,\"entries_each\":64,\"hit_ns\":%.1f,\"miss_ns\":%.1f}",
+           (double)hit_ns / LOOKUPS, (double)miss_ns / LOOKUPS);
+
+    for (int i = 0; i < 8; i++)
+        unmap_subcontext(fds[i]);
+
+    static char paths[STARTUP_IMAGES][SMLBUFSZ];
+    bench_quiet(1);
+    for (int i = 0; i < STARTUP_IMAGES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "img_files/bench_startup%d.img", i);
+        bench_gen_image(paths[i], BENCH_IMG_BASE + i * BENCH_IMG_STRIDE, STARTUP_ENTRIES, 65536);
+    }
+    bench_quiet(0);
+    unsigned long serial = ~0UL, async = ~0UL;
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long t = time_startup(paths, 0);
+        serial = t < serial ? t : serial;
+        t = time_startup(paths, 1);
+        async = t < async ? t : async;
+    }
+    printf(",\"startup\":{\"images\":%d,\"entries_each\":%d,\"serial_us\":%.1f,"
+           "\"async_us\":%.1f}}\n", STARTUP_IMAGES, STARTUP_ENTRIES, serial / 1e3, async / 1e3);
+    for (int i = 0; i < STARTUP_IMAGES; i++)
+        unlink(paths[i]);
+    unlink(IMG_PATH);
+    return EXIT_SUCCESS;
+}
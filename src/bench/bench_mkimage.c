@@ -0,0 +1,96 @@
+#include <sys/wait.h>
+#include "bench.h"
+
+/*
+ * Making an image offline with sbc_mkimage against the run-and-snapshot
+ * flow, where the server is started so that it can call
+ * create_image_file() on itself.  For each flow: the time to build the
+ * image (a whole process either way), the image size and region count,
+ * and the client's startup work, i.e. mapping the image.
+ */
+
+#define REPEATS 5
+
+/* run a command with its output discarded; returns the time it took */
+static unsigned long run(char *const argv[]) {
+    unsigned long t0 = bench_now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return bench_now_ns() - t0;
+}
+
+/* best time to map and unmap the image, with its size and region count */
+static unsigned long map_cost(const char *path, off_t *size, unsigned long *regions) {
+    int fd = open(path, O_RDONLY);
+    Header header;
+    if (fd == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    *size = lseek(fd, 0, SEEK_END);
+    *regions = header.numEntries;
+    close(fd);
+
+    unsigned long best = ~0UL;
+    for (int r = 0; r < REPEATS; r++) {
+        bench_quiet(1);
+        unsigned long t0 = bench_now_ns();
+        int img = map_subcontext(path);
+        unsigned long t = bench_now_ns() - t0;
+        if (img >= 0 && img != EXIT_FAILURE)
+            unmap_subcontext(img);
+        bench_quiet(0);
+        if (img < 0 || img == EXIT_FAILURE) {
+            fprintf(stderr, "cannot map %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void report(const char *flow, char *const argv[], const char *path, int last) {
+    unsigned long build = ~0UL;
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long t = run(argv);
+        if (t < build)
+            build = t;
+    }
+    off_t size;
+    unsigned long regions;
+    unsigned long map = map_cost(path, &size, &regions);
+    printf("{\"flow\":\"%s\",\"build_ns\":%lu,\"image_bytes\":%ld,\"regions\":%lu,"
+           "\"map_ns\":%lu}%s", flow, build, (long)size, regions, map, last ? "" : ",");
+    unlink(path);
+}
+
+int main(void) {
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+
+    char *offline[] = { "../tools/sbc_mkimage", "./bench_freestanding",
+                        "img_files/offline.img", "entry", NULL };
+    char *snapshot[] = { "./bench_call_server", NULL };
+
+    printf("{\"benchmark\":\"mkimage\",\"flows\":[");
+    report("sbc_mkimage", offline, "img_files/offline.img", 0);
+    report("run_and_snapshot", snapshot, "img_files/call_server.img", 1);
+    printf("]}\n");
+    finalize();
+    return EXIT_SUCCESS;
+}
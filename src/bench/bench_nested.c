@@ -0,0 +1,64 @@
+#include "bench.h"
+
+/*
+ * Round trips through chains of subcontexts calling each other, 1, 2 and
+ * 4 deep: the client calls the first, which calls the second, and so on.
+ * A chain n deep is 2n transitions per call, n - 1 of them returns from
+ * one subcontext into another.
+ */
+
+#define CALLS     2000
+#define MAX_DEPTH 4
+
+typedef void (*entry_fn)(int);
+
+int main(void) {
+    size_t depths[] = { 1, 2, 4 };
+    long page_size = sysconf(_SC_PAGESIZE);
+    entry_fn entries[MAX_DEPTH];
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    for (int i = 0; i < MAX_DEPTH; i++) {
+        char path[SMLBUFSZ];
+        unsigned long base = BENCH_IMG_BASE + i * BENCH_IMG_STRIDE;
+        snprintf(path, sizeof(path), "img_files/bench_nested%d.img", i);
+        int fd = -1;
+        if (bench_gen_chain_image(path, base) == 0)
+            fd = map_subcontext(path);
+        unlink(path);
+        if (fd < 0 || fd == EXIT_FAILURE) {
+            bench_quiet(0);
+            fprintf(stderr, "failed to map generated image %d\n", i);
+            return EXIT_FAILURE;
+        }
+        entries[i] = (entry_fn)base;
+    }
+    bench_quiet(0);
+
+    printf("{\"benchmark\":\"nested\",\"by_depth\":[");
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        // link the first depths[d] images into a chain
+        for (size_t i = 0; i < MAX_DEPTH; i++) {
+            entry_fn *next = (entry_fn *)((unsigned long)entries[i] + 2 * page_size);
+            *next = i + 1 < depths[d] ? entries[i + 1] : NULL;
+        }
+
+        static unsigned long samples[CALLS];
+        for (int i = 0; i < CALLS; i++) {
+            unsigned long t0 = bench_now_ns();
+            entries[0](0);
+            samples[i] = bench_now_ns() - t0;
+        }
+        unsigned long p50 = bench_percentile(samples, CALLS, 0.50);
+        printf("%s{\"depth\":%zu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"ns_per_transition\":%lu}",
+               d ? "," : "", depths[d], p50, bench_percentile(samples, CALLS, 0.99),
+               p50 / (2 * depths[d]));
+    }
+    printf("]}\n");
+
+    finalize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+#include "bench.h"
+#include <sys/mman.h>
+
+/*
+ * What idle reclaim gives back and what it costs to come back: the
+ * subcontext's resident memory warm, after MADV_COLD and after
+ * MADV_PAGEOUT, and the latency of re-entering it and reading all of its
+ * data again after each, with and without prefetching on entry.
+ */
+
+#define IMG_PATH    "img_files/bench_reclaim.img"
+#define REGIONS     4
+#define REGION_SIZE (4UL << 20)
+#define ROUNDS      5
+
+/* resident KB of the image's mappings, from /proc/self/smaps */
+static unsigned long image_rss_kb(void) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return 0;
+    char line[256];
+    int in_image = 0;
+    unsigned long total = 0, kb;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+            in_image = start >= BENCH_IMG_BASE && end <= BENCH_IMG_BASE + BENCH_IMG_STRIDE;
+        else if (in_image && sscanf(line, "Rss: %lu kB", &kb) == 1)
+            total += kb;
+    }
+    fclose(f);
+    return total;
+}
+
+/* enter the subcontext and read every page of its data */
+static unsigned long reenter(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    unsigned long t0 = bench_now_ns();
+    ((void (*)(int))BENCH_IMG_BASE)(0);
+    for (int r = 0; r < REGIONS; r++) {
+        char *region = (char *)BENCH_IMG_BASE + 2 * page_size + r * (REGION_SIZE + page_size);
+        for (size_t off = 0; off < REGION_SIZE; off += page_size)
+            sink += region[off];
+    }
+    return bench_now_ns() - t0;
+}
+
+typedef struct reclaim_result {
+    unsigned long rss_kb;      // after the sweep
+    unsigned long reenter_ns;  // median over the rounds
+} ReclaimResult;
+
+/* sweep with advice (0 for none) and time the re-entry, ROUNDS times */
+static ReclaimResult run(int advice, int prefetch) {
+    ReclaimResult res = { 0, 0 };
+    unsigned long samples[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        reenter();
+        if (advice && sbc_reclaim_idle(0, advice, prefetch) != 1) {
+            fprintf(stderr, "subcontext was not reclaimed\n");
+            exit(EXIT_FAILURE);
+        }
+        res.rss_kb = image_rss_kb();
+        samples[i] = reenter();
+    }
+    res.reenter_ns = bench_percentile(samples, ROUNDS, 0.50);
+    return res;
+}
+
+static void print_result(const char *name, ReclaimResult res) {
+    printf("\"%s\":{\"rss_kb\":%lu,\"reenter_us\":%.1f}", name, res.rss_kb,
+           res.reenter_ns / 1e3);
+}
+
+int main(void) {
+    bench_quiet(1);
+    if (system("mkdir -p img_files") != 0 ||
+        bench_gen_image(IMG_PATH, BENCH_IMG_BASE, REGIONS + 1, REGION_SIZE) != EXIT_SUCCESS) {
+        fprintf(stderr, "failed to write the benchmark image\n");
+        return EXIT_FAILURE;
+    }
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    bench_quiet(0);
+    unlink(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "failed to map the benchmark image\n");
+        return EXIT_FAILURE;
+    }
+
+    ReclaimResult warm = run(0, 0);
+    ReclaimResult cold = run(MADV_COLD, 0);
+    ReclaimResult pageout = run(MADV_PAGEOUT, 0);
+    ReclaimResult prefetch = run(MADV_PAGEOUT, 1);
+
+    printf("{\"benchmark\":\"reclaim\",\"image_kb\":%lu,", REGIONS * REGION_SIZE >> 10);
+    print_result("warm", warm);
+    printf(",");
+    print_result("cold", cold);
+    printf(",");
+    print_result("pageout", pageout);
+    printf(",");
+    print_result("pageout_prefetch", prefetch);
+    printf("}\n");
+    finalize();
+    return EXIT_SUCCESS;
+}
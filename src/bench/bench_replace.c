@@ -0,0 +1,106 @@
+#include <sys/syscall.h>
+#include "bench.h"
+
+/*
+ * sbc_replace() against image size: the pause (transitions held off, as
+ * recorded in the transition trace) and the whole call including staging,
+ * next to what the swap costs without sbc_replace, unmap_subcontext() plus
+ * map_subcontext().
+ */
+
+#define IMG_A   "img_files/bench_replace_a.img"
+#define IMG_B   "img_files/bench_replace_b.img"
+#define REPEATS 5
+
+/* the duration of this thread's most recent replace event */
+static unsigned long last_pause(TraceBuffer *trace) {
+    int tid = syscall(SYS_gettid);
+    for (int r = 0; r < trace->num_rings && r < SBC_TRACE_THREADS; r++) {
+        TraceRing *ring = &trace->rings[r];
+        if (ring->tid != tid)
+            continue;
+        for (ulong seq = ring->head; seq > 0; seq--) {
+            TraceEvent *ev = &ring->events[(seq - 1) & (SBC_TRACE_EVENTS - 1)];
+            if (ev->type == SBC_TRACE_REPLACE && ev->seq == seq)
+                return ev->duration_ns;
+        }
+    }
+    return 0;
+}
+
+static TraceBuffer *open_own_trace(void) {
+    char name[SMLBUFSZ];
+    sbc_trace_name(getpid(), name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+    TraceBuffer *trace = mmap(NULL, sizeof(TraceBuffer), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return trace == MAP_FAILED ? NULL : trace;
+}
+
+int main(void) {
+    size_t sizes_kb[] = { 64, 4096, 65536, 262144 };
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+    sbc_trace_enable(1);
+    TraceBuffer *trace = open_own_trace();
+    if (!trace) {
+        fprintf(stderr, "the client library was built without tracing\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"benchmark\":\"replace\",\"by_size\":[");
+    for (size_t i = 0; i < sizeof(sizes_kb) / sizeof(sizes_kb[0]); i++) {
+        // four data regions sharing the total size, in two versions
+        size_t region_size = (sizes_kb[i] << 10) / 4;
+        bench_quiet(1);
+        if (bench_gen_image(IMG_A, BENCH_IMG_BASE, 5, region_size) != 0 ||
+            bench_gen_image(IMG_B, BENCH_IMG_BASE, 5, region_size) != 0) {
+            bench_quiet(0);
+            fprintf(stderr, "failed to generate images\n");
+            return EXIT_FAILURE;
+        }
+
+        int fd = map_subcontext(IMG_A);
+        unsigned long pause[REPEATS], total[REPEATS], remap[REPEATS];
+        for (int r = 0; r < REPEATS; r++) {
+            unsigned long t0 = bench_now_ns();
+            int ret = sbc_replace(fd, r % 2 ? IMG_A : IMG_B);
+            total[r] = bench_now_ns() - t0;
+            pause[r] = last_pause(trace);
+            if (fd < 0 || fd == EXIT_FAILURE || ret != EXIT_SUCCESS) {
+                bench_quiet(0);
+                fprintf(stderr, "sbc_replace failed\n");
+                return EXIT_FAILURE;
+            }
+        }
+        unmap_subcontext(fd);
+
+        for (int r = 0; r < REPEATS; r++) {
+            fd = map_subcontext(IMG_A);
+            unsigned long t0 = bench_now_ns();
+            unmap_subcontext(fd);
+            fd = map_subcontext(IMG_B);
+            remap[r] = bench_now_ns() - t0;
+            unmap_subcontext(fd);
+        }
+        bench_quiet(0);
+
+        printf("%s{\"image_kb\":%zu,\"entries\":5,\"pause_ns\":%lu,\"replace_ns\":%lu,"
+               "\"unmap_map_ns\":%lu}", i ? "," : "", sizes_kb[i],
+               bench_percentile(pause, REPEATS, 0.5), bench_percentile(total, REPEATS, 0.5),
+               bench_percentile(remap, REPEATS, 0.5));
+        fflush(stdout);
+    }
+    printf("]}\n");
+
+    unlink(IMG_A);
+    unlink(IMG_B);
+    finalize();
+    return EXIT_SUCCESS;
+}
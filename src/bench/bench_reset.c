@@ -0,0 +1,86 @@
+#include "bench.h"
+
+/*
+ * sbc_reset latency by image size and by the number of pages dirtied
+ * since the last reset, next to the only way to get a pristine
+ * subcontext before it existed: unmapping and mapping the image again.
+ * The dirty pages are either scattered evenly over the data or contiguous;
+ * every scattered page costs the reset a run of its own.
+ */
+
+#define IMG_PATH "img_files/bench_reset.img"
+#define ROUNDS   20
+
+static unsigned long time_reset(int fd, char *data, size_t stride, size_t dirty) {
+    unsigned long samples[ROUNDS];
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t i = 0; i < dirty; i++)
+            data[i * stride] = 1;
+        unsigned long t0 = bench_now_ns();
+        if (sbc_reset(fd) != 0) {
+            fprintf(stderr, "sbc_reset failed\n");
+            exit(EXIT_FAILURE);
+        }
+        samples[r] = bench_now_ns() - t0;
+    }
+    return bench_percentile(samples, ROUNDS, 0.50);
+}
+
+static unsigned long time_remap(int *fd) {
+    unsigned long samples[ROUNDS / 4];
+    for (int r = 0; r < ROUNDS / 4; r++) {
+        bench_quiet(1);
+        unsigned long t0 = bench_now_ns();
+        unmap_subcontext(*fd);
+        *fd = map_subcontext(IMG_PATH);
+        samples[r] = bench_now_ns() - t0;
+        bench_quiet(0);
+        if (*fd < 0 || *fd == EXIT_FAILURE) {
+            fprintf(stderr, "map_subcontext failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return bench_percentile(samples, ROUNDS / 4, 0.50);
+}
+
+int main(void) {
+    size_t sizes[] = { 4UL << 20, 64UL << 20, 256UL << 20 };
+    size_t dirty[] = { 1, 16, 256 };
+    long page_size = sysconf(_SC_PAGESIZE);
+    char *data = (char *)BENCH_IMG_BASE + 2 * page_size;
+
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+    printf("{\"benchmark\":\"reset\",\"images\":[");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        bench_quiet(1);
+        if (system("mkdir -p img_files") != 0 ||
+            bench_gen_image(IMG_PATH, BENCH_IMG_BASE, 2, sizes[s]) != EXIT_SUCCESS) {
+            fprintf(stderr, "failed to write the benchmark image\n");
+            return EXIT_FAILURE;
+        }
+        int fd = map_subcontext(IMG_PATH);
+        bench_quiet(0);
+        if (fd < 0 || fd == EXIT_FAILURE || sbc_reset(fd) != 0) {
+            fprintf(stderr, "failed to map the benchmark image\n");
+            return EXIT_FAILURE;
+        }
+
+        printf("%s{\"image_kb\":%zu,\"reset_us\":[", s ? "," : "", sizes[s] >> 10);
+        for (size_t d = 0; d < sizeof(dirty) / sizeof(dirty[0]); d++)
+            printf("%s{\"dirty_pages\":%zu,\"scattered_p50\":%.1f,\"contiguous_p50\":%.1f}",
+                   d ? "," : "", dirty[d],
+                   time_reset(fd, data, sizes[s] / page_size / dirty[d] * page_size, dirty[d]) / 1e3,
+                   time_reset(fd, data, page_size, dirty[d]) / 1e3);
+        printf("],\"remap_us\":%.1f}", time_remap(&fd) / 1e3);
+
+        bench_quiet(1);
+        unmap_subcontext(fd);
+        bench_quiet(0);
+        unlink(IMG_PATH);
+    }
+    printf("]}\n");
+    finalize();
+    return EXIT_SUCCESS;
+}
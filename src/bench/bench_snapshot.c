@@ -0,0 +1,82 @@
+#include <sys/mman.h>
+#include "bench.h"
+
+/*
+ * create_image_file() throughput against heap size and against the number
+ * of memory regions in the process.
+ */
+
+#define REPEATS 3
+
+static void entry(int arg) { (void)arg; }
+
+/* time one snapshot; returns ns and stores the image size */
+static unsigned long time_snapshot(off_t *img_size) {
+    void (*funcs[1])(int) = { entry };
+    bench_quiet(1);
+    unsigned long t0 = bench_now_ns();
+    int ret = create_image_file("bench_snapshot.c", funcs, 1);
+    unsigned long t = bench_now_ns() - t0;
+    bench_quiet(0);
+    if (ret != EXIT_SUCCESS) {
+        fprintf(stderr, "create_image_file failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open("img_files/snapshot.img", O_RDONLY);
+    *img_size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return t;
+}
+
+static unsigned long best_of(off_t *img_size) {
+    unsigned long best = ~0UL;
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long t = time_snapshot(img_size);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(void) {
+    size_t heap_mb[] = { 8, 32, 128 };
+    size_t region_counts[] = { 8, 32, 128 };
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+
+    printf("{\"benchmark\":\"snapshot\",\"heap\":[");
+    for (size_t i = 0; i < sizeof(heap_mb) / sizeof(heap_mb[0]); i++) {
+        size_t size = heap_mb[i] << 20;
+        char *heap = malloc(size);
+        memset(heap, 0x5a, size);
+        off_t img_size;
+        unsigned long ns = best_of(&img_size);
+        printf("%s{\"heap_mb\":%zu,\"image_bytes\":%ld,\"ns\":%lu,\"mb_per_s\":%.1f}",
+               i ? "," : "", heap_mb[i], (long)img_size, ns, img_size / 1e6 / (ns / 1e9));
+        free(heap);
+    }
+
+    printf("],\"regions\":[");
+    for (size_t i = 0; i < sizeof(region_counts) / sizeof(region_counts[0]); i++) {
+        // one-page mappings with alternating permissions, so each one is
+        // a separate region in /proc/self/maps
+        size_t n = region_counts[i];
+        char *area = mmap(NULL, n * page_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        memset(area, 0x5a, n * page_size);
+        for (size_t r = 1; r < n; r += 2)
+            mprotect(area + r * page_size, page_size, PROT_READ);
+
+        off_t img_size;
+        unsigned long ns = best_of(&img_size);
+        printf("%s{\"extra_regions\":%zu,\"image_bytes\":%ld,\"ns\":%lu,\"mb_per_s\":%.1f}",
+               i ? "," : "", n, (long)img_size, ns, img_size / 1e6 / (ns / 1e9));
+        munmap(area, n * page_size);
+    }
+    printf("]}\n");
+
+    unlink("img_files/snapshot.img");
+    return EXIT_SUCCESS;
+}
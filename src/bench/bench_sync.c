@@ -0,0 +1,117 @@
+#include <sys/wait.h>
+#include "bench.h"
+
+/*
+ * Throughput of the shared-region synchronization primitives as more
+ * client processes use them at once.  Every client maps the image of
+ * bench_sync_server, waits for the others and then makes one call that
+ * runs 200000 operations on the state shared by all of them.  One process
+ * shows the uncontended cost, which makes no system calls.
+ */
+
+#define IMG_PATH "img_files/sync_server.img"
+#define SYNC_OPS 200000
+
+typedef struct shared {
+    SbcMutex   mutex;
+    ulong      locked_count;
+    SbcCounter counter;
+    SbcSeqlock seq;
+    ulong      a, b;
+} Shared;
+
+static const char *names[] = { "mutex", "counter", "seqlock" };
+
+/* a client: map the image, report ready, wait for go, make the call and
+ * report that it is done */
+static int client(int func, int ready, int go, int result) {
+    bench_quiet(1);
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    char c = 1;
+    if (fd < 0 || fd == EXIT_FAILURE || write(ready, &c, 1) != 1 || read(go, &c, 1) != 1)
+        return EXIT_FAILURE;
+    c = call_subcontext_function(func, fd) == EXIT_SUCCESS;
+    return write(result, &c, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* run procs clients of func at once; returns the time from letting them
+ * go until the last one is done */
+static unsigned long run(int func, int procs) {
+    int ready[2], go[2], result[2];
+    if (pipe(ready) || pipe(go) || pipe(result))
+        exit(EXIT_FAILURE);
+    fflush(stdout);
+    for (int p = 0; p < procs; p++) {
+        if (fork() == 0)
+            _exit(client(func, ready[1], go[0], result[1]));
+    }
+    char c;
+    for (int p = 0; p < procs; p++) {
+        if (read(ready[0], &c, 1) != 1)
+            exit(EXIT_FAILURE);
+    }
+    unsigned long t0 = bench_now_ns();
+    for (int p = 0; p < procs; p++) {
+        if (write(go[1], &c, 1) != 1)
+            exit(EXIT_FAILURE);
+    }
+    for (int p = 0; p < procs; p++) {
+        if (read(result[0], &c, 1) != 1 || !c) {
+            fprintf(stderr, "%s client failed\n", names[func]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long ns = bench_now_ns() - t0;
+    while (wait(NULL) > 0)
+        ;
+    close(ready[0]); close(ready[1]);
+    close(go[0]); close(go[1]);
+    close(result[0]); close(result[1]);
+    return ns;
+}
+
+int main(void) {
+    int procs[] = { 1, 2, 4, 8 };
+    size_t num_procs = sizeof(procs) / sizeof(procs[0]);
+    if (system("./bench_sync_server > /dev/null") != 0) {
+        fprintf(stderr, "bench_sync_server failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"benchmark\":\"sync\",\"ops_per_call\":%d,\"cpus\":%ld", SYNC_OPS,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    ulong total[3] = { 0, 0, 0 };
+    for (int f = 0; f < 3; f++) {
+        printf(",\"%s\":[", names[f]);
+        for (size_t i = 0; i < num_procs; i++) {
+            unsigned long ns = run(f, procs[i]);
+            total[f] += (ulong)procs[i] * SYNC_OPS;
+            printf("%s{\"procs\":%d,\"mops_per_s\":%.1f,\"ns_per_op\":%.1f}", i ? "," : "",
+                   procs[i], procs[i] * SYNC_OPS / (ns / 1e3), ns / (double)(procs[i] * SYNC_OPS));
+        }
+        printf("]");
+    }
+
+    // every client's operations landed in the same shared state; check
+    // that, and remove the object behind it
+    bench_quiet(1);
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    bench_quiet(0);
+    const Shared *sh = NULL;
+    char name[SMLBUFSZ];
+    for (size_t i = 0; fd >= 0 && i < mapped_subcontexts[0].num_entries; i++) {
+        const Entry *e = &mapped_subcontexts[0].entries[i];
+        if (e->sharing == SBC_SHARE_ANONYMOUS) {
+            sh = (const Shared *)e->start;
+            if (sbc_share_name(fd, i, name, sizeof(name)) == 0)
+                shm_unlink(name);
+        }
+    }
+    printf(",\"consistent\":%s}\n", sh && sh->locked_count == total[0] &&
+           sbc_counter_read(&sh->counter) == total[1] && sh->a == sh->b ? "true" : "false");
+    finalize();
+    unlink(IMG_PATH);
+    return EXIT_SUCCESS;
+}
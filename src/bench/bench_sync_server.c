@@ -0,0 +1,69 @@
+#include <sys/mman.h>
+#include "bench.h"
+
+/*
+ * The server side of bench_sync.  Its state sits in a shared-anonymous
+ * region, so every client that maps the image works on the same copy;
+ * each function runs SYNC_OPS operations of one primitive on it.
+ */
+
+#define SYNC_OPS 200000
+
+typedef struct shared {
+    SbcMutex   mutex;
+    ulong      locked_count;  // only changed with mutex held
+    SbcCounter counter;
+    SbcSeqlock seq;
+    ulong      a, b;
+} Shared;
+
+static Shared *shared;
+
+void mutex_ops(int arg) {
+    for (int i = 0; i < SYNC_OPS; i++) {
+        sbc_mutex_lock(&shared->mutex);
+        shared->locked_count++;
+        sbc_mutex_unlock(&shared->mutex);
+    }
+}
+
+void counter_ops(int arg) {
+    for (int i = 0; i < SYNC_OPS; i++)
+        sbc_counter_add(&shared->counter, 1);
+}
+
+/* one write in every 64 operations, reads otherwise */
+void seqlock_ops(int arg) {
+    for (int i = 0; i < SYNC_OPS; i++) {
+        if (i % 64 == 0) {
+            sbc_seq_write_begin(&shared->seq);
+            shared->a++;
+            shared->b++;
+            sbc_seq_write_end(&shared->seq);
+            continue;
+        }
+        unsigned int seq;
+        ulong a, b;
+        do {
+            seq = sbc_seq_read_begin(&shared->seq);
+            a = *(volatile ulong *)&shared->a;
+            b = *(volatile ulong *)&shared->b;
+        } while (sbc_seq_read_retry(&shared->seq, seq) || a != b);
+    }
+}
+
+int main(void) {
+    void (*funcs[3])(int) = { mutex_ops, counter_ops, seqlock_ops };
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+
+    // between guard pages, so the policy does not spill over to neighbours
+    char *area = mmap(NULL, 3 * 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return EXIT_FAILURE;
+    shared = (Shared *)(area + 4096);
+    mprotect(shared, 4096, PROT_READ | PROT_WRITE);
+    if (sbc_set_sharing(shared, 4096, SBC_SHARE_ANONYMOUS) != 0)
+        return EXIT_FAILURE;
+    return create_image_file("bench_sync_server.c", funcs, 3);
+}
@@ -0,0 +1,134 @@
+#include "bench.h"
+
+/*
+ * Round-trip latency of fault-driven calls into a subcontext (p50/p99),
+ * with tracing disabled, enabled and compiled out (TRACE=0, measured by a
+ * second build of this benchmark, bench_transition_notrace), and the cost
+ * of a round trip as the number of mapped subcontexts grows.  A round trip is two transitions: the call
+ * faults into the subcontext and the return faults back into the client.
+ * A subcontext mapped SBC_MAP_RELAXED is measured through the call API,
+ * which closes it off after the call since its return does not fault.
+ */
+
+#define CALLS 2000
+
+typedef void (*entry_fn)(int);
+
+static entry_fn entry_of(int fd) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        if (mapped_subcontexts[i].fd == fd)
+            return mapped_subcontexts[i].header->func_ptr[0];
+    }
+    return NULL;
+}
+
+static int map_generated(int idx, size_t num_regions, int flags) {
+    char path[SMLBUFSZ];
+    snprintf(path, sizeof(path), "img_files/bench_transition%d.img", idx);
+    bench_quiet(1);
+    bench_gen_image(path, BENCH_IMG_BASE + idx * BENCH_IMG_STRIDE, num_regions, 4096);
+    int fd = request_map_ex(path, flags);
+    bench_quiet(0);
+    unlink(path);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "failed to map generated image %d\n", idx);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* p50/p99 of CALLS fault-driven round trips into fn */
+static void round_trips(entry_fn fn, unsigned long *p50, unsigned long *p99) {
+    static unsigned long samples[CALLS];
+    for (int i = 0; i < CALLS; i++) {
+        unsigned long t0 = bench_now_ns();
+        fn(0);
+        samples[i] = bench_now_ns() - t0;
+    }
+    *p50 = bench_percentile(samples, CALLS, 0.50);
+    *p99 = bench_percentile(samples, CALLS, 0.99);
+}
+
+/* p50/p99 of CALLS round trips through call_subcontext_function */
+static void call_api_round_trips(int fd, unsigned long *p50, unsigned long *p99) {
+    static unsigned long samples[CALLS];
+    bench_quiet(1);
+    for (int i = 0; i < CALLS; i++) {
+        unsigned long t0 = bench_now_ns();
+        call_subcontext_function(0, fd);
+        samples[i] = bench_now_ns() - t0;
+    }
+    bench_quiet(0);
+    *p50 = bench_percentile(samples, CALLS, 0.50);
+    *p99 = bench_percentile(samples, CALLS, 0.99);
+}
+
+/* p50/p99 of the round trip as bench_transition_notrace measures it */
+static int notrace_round_trips(unsigned long *p50, unsigned long *p99) {
+    FILE *p = popen("./bench_transition_notrace", "r");
+    if (!p)
+        return -1;
+    int n = fscanf(p, "%lu %lu", p50, p99);
+    return pclose(p) == 0 && n == 2 ? 0 : -1;
+}
+
+int main(void) {
+    size_t counts[] = { 1, 2, 4, 8, 16, 32 };
+    unsigned long p50, p99;
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+
+    int fd = map_generated(0, 4, 0);
+    entry_fn fn = entry_of(fd);
+
+#ifdef BENCH_ROUND_TRIP_ONLY
+    round_trips(fn, &p50, &p99);
+    printf("%lu %lu\n", p50, p99);
+    finalize();
+    return EXIT_SUCCESS;
+#endif
+
+    printf("{\"benchmark\":\"transition\",\"round_trip\":{");
+    round_trips(fn, &p50, &p99);
+    printf("\"p50_ns\":%lu,\"p99_ns\":%lu", p50, p99);
+
+    sbc_trace_enable(1);
+    round_trips(fn, &p50, &p99);
+    sbc_trace_enable(0);
+    printf(",\"traced_p50_ns\":%lu,\"traced_p99_ns\":%lu", p50, p99);
+
+    // without the trace's load and branch: what having it compiled in costs
+    fflush(stdout);
+    if (notrace_round_trips(&p50, &p99) == 0)
+        printf(",\"untraced_build_p50_ns\":%lu,\"untraced_build_p99_ns\":%lu", p50, p99);
+
+    // the same round trip through the public call API
+    call_api_round_trips(fd, &p50, &p99);
+    printf(",\"call_api_p50_ns\":%lu,\"call_api_p99_ns\":%lu}", p50, p99);
+
+    // and into a relaxed subcontext, next to the one above
+    int relaxed = map_generated(1, 4, SBC_MAP_RELAXED);
+    call_api_round_trips(relaxed, &p50, &p99);
+    printf(",\"relaxed\":{\"call_api_p50_ns\":%lu,\"call_api_p99_ns\":%lu}", p50, p99);
+    bench_quiet(1);
+    unmap_subcontext(relaxed);
+    bench_quiet(0);
+
+    printf(",\"by_mapped_subcontexts\":[");
+    size_t mapped = 1;
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        while (mapped < counts[i])
+            map_generated(mapped++, 4, 0);
+        round_trips(fn, &p50, &p99);
+        printf("%s{\"subcontexts\":%zu,\"p50_ns\":%lu,\"p99_ns\":%lu}",
+               i ? "," : "", counts[i], p50, p99);
+    }
+    printf("]}\n");
+
+    finalize();
+    return EXIT_SUCCESS;
+}
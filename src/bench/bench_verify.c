@@ -0,0 +1,93 @@
+#include "bench.h"
+
+/*
+ * Cost of verifying images against their checksums, with verification on
+ * and off: map_subcontext() latency, the first touch of every page (which
+ * is when a page is verified), and round trips into the subcontext once
+ * every page has been touched.
+ */
+
+#define IMG_PATH "img_files/bench_verify.img"
+#define CALLS    2000
+
+typedef struct verify_result {
+    unsigned long map_ns;
+    unsigned long touch_ns_per_page;
+    unsigned long round_trip_ns;
+} VerifyResult;
+
+static VerifyResult run(int verify, size_t region_size) {
+    VerifyResult res;
+    long page_size = sysconf(_SC_PAGESIZE);
+    sbc_verify_enable(verify);
+
+    bench_quiet(1);
+    unsigned long t0 = bench_now_ns();
+    int fd = map_subcontext(IMG_PATH);
+    res.map_ns = bench_now_ns() - t0;
+    bench_quiet(0);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "map_subcontext failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the four data regions follow the code page, a page apart
+    size_t pages = 0;
+    volatile char sink = 0;
+    t0 = bench_now_ns();
+    for (int r = 0; r < 4; r++) {
+        char *region = (char *)BENCH_IMG_BASE + 2 * page_size + r * (region_size + page_size);
+        for (size_t off = 0; off < region_size; off += page_size, pages++)
+            sink += region[off];
+    }
+    res.touch_ns_per_page = (bench_now_ns() - t0) / pages;
+
+    static unsigned long samples[CALLS];
+    void (*fn)(int) = (void (*)(int))BENCH_IMG_BASE;
+    for (int i = 0; i < CALLS; i++) {
+        t0 = bench_now_ns();
+        fn(0);
+        samples[i] = bench_now_ns() - t0;
+    }
+    res.round_trip_ns = bench_percentile(samples, CALLS, 0.50);
+
+    bench_quiet(1);
+    unmap_subcontext(fd);
+    bench_quiet(0);
+    return res;
+}
+
+int main(void) {
+    size_t sizes_kb[] = { 1024, 16384, 65536 };
+
+    if (system("mkdir -p img_files") != 0)
+        return EXIT_FAILURE;
+    bench_quiet(1);
+    init();
+    bench_quiet(0);
+
+    printf("{\"benchmark\":\"verify\",\"by_size\":[");
+    for (size_t i = 0; i < sizeof(sizes_kb) / sizeof(sizes_kb[0]); i++) {
+        size_t region_size = (sizes_kb[i] << 10) / 4;
+        bench_quiet(1);
+        int ret = bench_gen_image(IMG_PATH, BENCH_IMG_BASE, 5, region_size);
+        bench_quiet(0);
+        if (ret != 0) {
+            fprintf(stderr, "failed to generate image\n");
+            return EXIT_FAILURE;
+        }
+        VerifyResult off = run(0, region_size);
+        VerifyResult on = run(1, region_size);
+        printf("%s{\"image_kb\":%zu,\"map_ns\":%lu,\"verified_map_ns\":%lu,"
+               "\"touch_ns_per_page\":%lu,\"verified_touch_ns_per_page\":%lu,"
+               "\"round_trip_ns\":%lu,\"verified_round_trip_ns\":%lu}",
+               i ? "," : "", sizes_kb[i], off.map_ns, on.map_ns, off.touch_ns_per_page,
+               on.touch_ns_per_page, off.round_trip_ns, on.round_trip_ns);
+        fflush(stdout);
+    }
+    printf("]}\n");
+
+    unlink(IMG_PATH);
+    finalize();
+    return EXIT_SUCCESS;
+}
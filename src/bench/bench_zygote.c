@@ -0,0 +1,123 @@
+#include "bench.h"
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Spawn-to-first-call latency of a worker process: from asking for a new
+ * worker until its first call into a subcontext has returned.  "cold"
+ * starts each worker from scratch (exec, init(), map_subcontext(), first
+ * call faulting the image in); "zygote" gets it forked from an
+ * sbc_zygote_run process that mapped and prefaulted the image once.
+ * The image is a snapshot of bench_call_server, libc and all.
+ */
+
+#define RUNS      50
+#define IMG_PATH  "img_files/call_server.img"
+#define SOCK_PATH "/tmp/sbc_bench_zygote.sock"
+
+/* the first call, summing an empty slice */
+static int first_call(int fd) {
+    SbcSlice out;
+    return call_subcontext_slice(0, fd, (SbcSlice){ 0, 0 }, &out);
+}
+
+static int worker(int conn, const int *fds, size_t num_fds, void *arg) {
+    char c;
+    if (read(conn, &c, 1) != 1)
+        return EXIT_FAILURE;
+    // the zygote's output is silenced already
+    c = first_call(fds[0]) == EXIT_SUCCESS;
+    return write(conn, &c, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* what a cold worker runs after exec: report the first call on fd 3 */
+static int cold_worker(void) {
+    bench_quiet(1);
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    char c = fd >= 0 && fd != EXIT_FAILURE && first_call(fd) == EXIT_SUCCESS;
+    bench_quiet(0);
+    return write(3, &c, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static unsigned long cold_start(const char *self) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return 0;
+    unsigned long t0 = bench_now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], 3);
+        execl(self, self, "cold", (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    char c = 0;
+    ssize_t n = read(fds[0], &c, 1);
+    unsigned long ns = bench_now_ns() - t0;
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return n == 1 && c ? ns : 0;
+}
+
+static unsigned long zygote_start(void) {
+    unsigned long t0 = bench_now_ns();
+    int conn = sbc_zygote_spawn(SOCK_PATH, NULL);
+    char c = 0;
+    if (conn == -1 || write(conn, &c, 1) != 1 || read(conn, &c, 1) != 1)
+        c = 0;
+    unsigned long ns = bench_now_ns() - t0;
+    close(conn);
+    return c ? ns : 0;
+}
+
+static void print_latency(const char *name, unsigned long *ns, size_t n) {
+    printf("\"%s\":{\"p50_us\":%.1f,\"p99_us\":%.1f}", name,
+           bench_percentile(ns, n, 0.50) / 1e3, bench_percentile(ns, n, 0.99) / 1e3);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "cold") == 0)
+        return cold_worker();
+
+    if (system("./bench_call_server > /dev/null") != 0) {
+        fprintf(stderr, "bench_call_server failed\n");
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    stat(IMG_PATH, &st);
+
+    static unsigned long cold[RUNS], zygote[RUNS];
+    for (int i = 0; i < RUNS; i++) {
+        if ((cold[i] = cold_start("/proc/self/exe")) == 0) {
+            fprintf(stderr, "cold worker failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    fflush(stdout);
+    pid_t zpid = fork();
+    if (zpid == 0) {
+        const char *images[1] = { IMG_PATH };
+        bench_quiet(1);
+        exit(sbc_zygote_run(SOCK_PATH, images, 1, worker, NULL) == 0 ? EXIT_SUCCESS
+                                                                     : EXIT_FAILURE);
+    }
+    for (int i = 0; i < RUNS; i++) {
+        if ((zygote[i] = zygote_start()) == 0) {
+            fprintf(stderr, "zygote worker failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    sbc_zygote_stop(SOCK_PATH);
+    waitpid(zpid, NULL, 0);
+    unlink(IMG_PATH);
+
+    printf("{\"benchmark\":\"zygote\",\"image_kb\":%ld,\"runs\":%d,", (long)(st.st_size >> 10),
+           RUNS);
+    print_latency("cold", cold, RUNS);
+    printf(",");
+    print_latency("zygote", zygote, RUNS);
+    printf("}\n");
+    return EXIT_SUCCESS;
+}
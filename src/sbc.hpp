@@ -0,0 +1,128 @@
+#ifndef _SBC_HPP
+#define _SBC_HPP
+
+/*
+ * Typed calls into subcontexts for C++ clients, header-only.
+ *
+ * An export is declared once, with its C++ type and index, in a header
+ * shared by the server and its clients:
+ *
+ *   constexpr sbc::Export<long(const char *, long)> kv_get{0};
+ *
+ * The server gives it its signature before snapshotting, which checks at
+ * compile time that the function it exports has that type:
+ *
+ *   sbc::export_signature(kv_get, &kv_get_impl);
+ *
+ * and clients bind it once and call it like a native function, the
+ * arguments checked by the compiler and passed in registers:
+ *
+ *   auto get = sbc::bind(fd, kv_get);
+ *   long n = get("key", 3);
+ *
+ * The signature string is computed at compile time from the type (see
+ * SBC_SIG_LEN), so binding compares it with the image's once and the call
+ * itself is an indirect call through the export's address.  Only
+ * parameter and return types that travel in a single register are
+ * supported; anything else fails to compile.
+ */
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+
+extern "C" {
+#include "vm_sbc.h"
+}
+
+namespace sbc {
+
+namespace detail {
+
+template <typename T>
+struct unsupported : std::false_type {};
+
+// the signature character for a parameter or return type
+template <typename T>
+constexpr char sig_char() {
+    using U = std::remove_cv_t<T>;
+    if constexpr (std::is_void_v<U>)
+        return 'v';
+    else if constexpr (std::is_pointer_v<U> || std::is_null_pointer_v<U>)
+        return 'p';
+    else if constexpr (std::is_same_v<U, float>)
+        return 'f';
+    else if constexpr (std::is_same_v<U, double>)
+        return 'd';
+    else if constexpr ((std::is_integral_v<U> || std::is_enum_v<U>) && sizeof(U) <= 4)
+        return 'i';
+    else if constexpr ((std::is_integral_v<U> || std::is_enum_v<U>) && sizeof(U) == 8)
+        return 'l';
+    else
+        static_assert(unsupported<T>::value,
+                      "exports take and return integers, pointers, float and double only");
+}
+
+}  // namespace detail
+
+template <typename F>
+struct Signature;
+
+// the signature string of a function type, e.g. "lpl" for long(const char *, long)
+template <typename R, typename... A>
+struct Signature<R(A...)> {
+    static_assert(sizeof...(A) + 2 <= SBC_SIG_LEN, "too many parameters for a signature");
+    static constexpr std::array<char, sizeof...(A) + 2> value = {
+        detail::sig_char<R>(), detail::sig_char<A>()..., '\0'
+    };
+    static constexpr const char *c_str() { return value.data(); }
+};
+
+// export index of an image, of function type F
+template <typename F>
+struct Export {
+    int index;
+};
+
+template <typename F>
+class Function;
+
+// a bound export: calling it calls into the subcontext directly
+template <typename R, typename... A>
+class Function<R(A...)> {
+public:
+    Function() = default;
+    explicit Function(void *address) : fn_(reinterpret_cast<R (*)(A...)>(address)) {}
+
+    // false if the image has no such export or it has a different signature
+    explicit operator bool() const { return fn_ != nullptr; }
+
+    R operator()(A... args) const { return fn_(args...); }
+
+private:
+    R (*fn_)(A...) = nullptr;
+};
+
+// look up export e of the subcontext open as fd and check its signature
+template <typename F>
+inline Function<F> bind(int fd, Export<F> e) {
+    return Function<F>(sbc_export_address(fd, e.index, Signature<F>::c_str()));
+}
+
+// server side: record e's signature for the images written from now on;
+// fn must be the function exported at e.index
+template <typename F>
+inline int export_signature(Export<F> e, F *fn) {
+    (void)fn;
+    return sbc_export_signature(e.index, Signature<F>::c_str());
+}
+
+// the entry to put in the function list passed to create_image_file
+template <typename F>
+inline void (*entry(F *fn))(int) {
+    return reinterpret_cast<void (*)(int)>(fn);
+}
+
+}  // namespace sbc
+
+#endif
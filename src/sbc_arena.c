@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * An allocator for subcontext code.  Images are fixed once written, so a
+ * subcontext function cannot use malloc after mapping: it would either
+ * allocate from the client's heap or corrupt the heap state captured in the
+ * snapshot.  Instead the server reserves an arena with sbc_arena_init()
+ * before taking its snapshot.  The reservation becomes part of the image,
+ * including the allocator state at its start, and only the part that was
+ * handed out is copied; the rest is left as a hole in the image and is
+ * committed lazily wherever it is mapped.
+ *
+ * Blocks come in power-of-two size classes with a free list per class.
+ * Freed blocks are reused for their class only, and new blocks are carved
+ * off the top of the arena, so neither path makes a system call.  Like the
+ * rest of the library, the arena is not thread safe.
+ */
+
+// precedes every block; keeps payloads 16-byte aligned
+typedef struct arena_block {
+    ulong size_class;
+    ulong magic;
+} ArenaBlock;
+
+static SbcArena *arena;
+
+static int size_class(size_t size) {
+    size_t block = size + sizeof(ArenaBlock);
+    if (block <= SBC_ARENA_MIN)
+        return 0;
+    // log2 of the block size rounded up to a power of two, relative to
+    // the smallest class
+    int cls = 64 - __builtin_clzl(block - 1) - __builtin_ctz(SBC_ARENA_MIN);
+    return cls < SBC_ARENA_CLASSES ? cls : -1;
+}
+
+/*
+ * Reserve an arena of reserve bytes (SBC_ARENA_RESERVE if 0) for the
+ * subcontext allocator.  It is placed SBC_ARENA_GAP past the program break
+ * so that it ends up next to the rest of the server's memory in the image.
+ * Must be called before the snapshot; calling it again does nothing.
+ * Returns 0 on success, -1 on failure.
+ */
+int sbc_arena_init(size_t reserve) {
+    if (arena)
+        return 0;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (reserve == 0)
+        reserve = SBC_ARENA_RESERVE;
+    reserve = (reserve + page_size - 1) & ~(page_size - 1);
+
+    ulong hint = (((ulong)sbrk(0) + page_size - 1) & ~(page_size - 1)) + SBC_ARENA_GAP;
+    void *area = mmap((void *)hint, reserve, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (area == MAP_FAILED) {
+        // something already lives there; take whatever the kernel offers
+        area = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (area == MAP_FAILED) {
+            perror("Error reserving arena");
+            return -1;
+        }
+    }
+
+    arena = area;
+    arena->magic = SBC_ARENA_MAGIC;
+    arena->base = (char *)area + ((sizeof(SbcArena) + 15) & ~15UL);
+    arena->top = arena->base;
+    arena->end = (char *)area + reserve;
+    return 0;
+}
+
+/*
+ * Allocate size bytes from the arena.  Returns NULL if the arena was not
+ * initialised or is exhausted.
+ */
+void *sbc_arena_alloc(size_t size) {
+    if (!arena)
+        return NULL;
+    int cls = size_class(size);
+    if (cls == -1)
+        return NULL;
+
+    ArenaBlock *block = arena->free_lists[cls];
+    if (block) {
+        arena->free_lists[cls] = *(void **)(block + 1);
+    } else {
+        size_t block_size = (size_t)SBC_ARENA_MIN << cls;
+        if (block_size > (size_t)(arena->end - arena->top))
+            return NULL;
+        block = (ArenaBlock *)arena->top;
+        arena->top += block_size;
+        block->size_class = cls;
+    }
+    block->magic = SBC_ARENA_MAGIC;
+    return block + 1;
+}
+
+/*
+ * Return a block obtained from sbc_arena_alloc() to the arena.
+ */
+void sbc_arena_free(void *ptr) {
+    if (!ptr)
+        return;
+    ArenaBlock *block = (ArenaBlock *)ptr - 1;
+    if (block->magic != SBC_ARENA_MAGIC || block->size_class >= SBC_ARENA_CLASSES) {
+        fprintf(stderr, "sbc_arena_free: %p was not allocated from the arena\n", ptr);
+        abort();
+    }
+    block->magic = 0;
+    *(void **)ptr = arena->free_lists[block->size_class];
+    arena->free_lists[block->size_class] = block;
+}
+
+/*
+ * If [start, end) is the arena's reservation, return how many bytes of it
+ * have been used, so a snapshot only needs to copy those.  Otherwise
+ * return the size of the range.
+ */
+size_t sbc_arena_used(ulong start, ulong end) {
+    if (!arena || (ulong)arena != start || (ulong)arena->end != end)
+        return end - start;
+    long page_size = sysconf(_SC_PAGESIZE);
+    return ((ulong)arena->top - start + page_size - 1) & ~(page_size - 1);
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Eager binding of PLT slots before a snapshot.
+ *
+ * Objects linked without -z now leave their GOT slots pointing back at the
+ * PLT until the first call goes through _dl_runtime_resolve.  A snapshot
+ * taken in that state carries the unresolved slots into the image, so the
+ * first call of each function in the client runs the server's dynamic
+ * linker inside the subcontext (slow, and it touches ld.so state that was
+ * never meant to be replayed elsewhere), and functions that were never
+ * called in the server can fail to resolve at all.  sbc_bind_now() resolves
+ * every slot up front, the way LD_BIND_NOW would have.
+ */
+
+#if defined(__x86_64__)
+
+typedef struct bind_state {
+    int bound;  // slots written
+    int failed; // slots that could not be resolved
+} BindState;
+
+/* dynamic section pointers are relocated by ld.so in writable .dynamic
+ * sections but not in read-only ones, so rebase only the latter */
+static const void *dyn_ptr(const struct dl_phdr_info *info, ElfW(Addr) ptr) {
+    return (const void *)(ptr < info->dlpi_addr ? ptr + info->dlpi_addr : ptr);
+}
+
+/* the version a symbol was linked against, from DT_VERSYM/DT_VERNEED */
+static const char *symbol_version(const struct dl_phdr_info *info, const ElfW(Half) *versym,
+                                  const ElfW(Verneed) *verneed, const char *strtab,
+                                  size_t sym_idx) {
+    if (!versym || !verneed)
+        return NULL;
+    ElfW(Half) ver = versym[sym_idx] & 0x7fff;
+    if (ver < 2)
+        return NULL;
+
+    const ElfW(Verneed) *vn = verneed;
+    for (;;) {
+        const ElfW(Vernaux) *aux = (const ElfW(Vernaux) *)((const char *)vn + vn->vn_aux);
+        for (int i = 0; i < vn->vn_cnt; i++) {
+            if (aux->vna_other == ver)
+                return strtab + aux->vna_name;
+            aux = (const ElfW(Vernaux) *)((const char *)aux + aux->vna_next);
+        }
+        if (!vn->vn_next)
+            return NULL;
+        vn = (const ElfW(Verneed) *)((const char *)vn + vn->vn_next);
+    }
+}
+
+/* the address a lazily bound slot would be resolved to: ld.so looks in the
+ * global scope first and then in the object's own, which for an object
+ * opened with RTLD_LOCAL is the only place its dependencies are found */
+static void *resolve(void *scope, const char *name, const char *version) {
+    void *addr = version ? dlvsym(RTLD_DEFAULT, name, version) : dlsym(RTLD_DEFAULT, name);
+    if (!addr && scope)
+        addr = version ? dlvsym(scope, name, version) : dlsym(scope, name);
+    return addr;
+}
+
+/* make the pages that hold nothing but GOT slots read-only, as RELRO would */
+static void protect_got(ElfW(Addr) start, ElfW(Addr) end) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ElfW(Addr) first = (start + page_size - 1) & ~(page_size - 1);
+    ElfW(Addr) last = end & ~(page_size - 1);
+    if (first < last && mprotect((void *)first, last - first, PROT_READ) == -1)
+        perror("Error protecting GOT pages");
+}
+
+static int bind_object(struct dl_phdr_info *info, size_t size, void *data) {
+    BindState *state = data;
+    (void)size;
+
+    // the object's dynamic section and executable segment. lazily bound
+    // slots point back into the object's own PLT, in the executable segment
+    const ElfW(Dyn) *dyn = NULL;
+    ElfW(Addr) text_start = 0, text_end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_DYNAMIC)
+            dyn = (const ElfW(Dyn) *)(info->dlpi_addr + ph->p_vaddr);
+        else if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X)) {
+            text_start = info->dlpi_addr + ph->p_vaddr;
+            text_end = text_start + ph->p_memsz;
+        }
+    }
+    if (!dyn)
+        return 0;
+
+    const ElfW(Rela) *jmprel = NULL;
+    size_t pltrelsz = 0;
+    const ElfW(Sym) *symtab = NULL;
+    const char *strtab = NULL;
+    const ElfW(Half) *versym = NULL;
+    const ElfW(Verneed) *verneed = NULL;
+    for (; dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+        case DT_JMPREL:  jmprel = dyn_ptr(info, dyn->d_un.d_ptr); break;
+        case DT_PLTRELSZ: pltrelsz = dyn->d_un.d_val; break;
+        case DT_SYMTAB:  symtab = dyn_ptr(info, dyn->d_un.d_ptr); break;
+        case DT_STRTAB:  strtab = dyn_ptr(info, dyn->d_un.d_ptr); break;
+        case DT_VERSYM:  versym = dyn_ptr(info, dyn->d_un.d_ptr); break;
+        case DT_VERNEED: verneed = dyn_ptr(info, dyn->d_un.d_ptr); break;
+        case DT_PLTREL:
+            if (dyn->d_un.d_val != DT_RELA)
+                return 0;
+            break;
+        // already bound at load time, and its GOT is read-only
+        case DT_BIND_NOW: return 0;
+        case DT_FLAGS:
+            if (dyn->d_un.d_val & DF_BIND_NOW)
+                return 0;
+            break;
+        case DT_FLAGS_1:
+            if (dyn->d_un.d_val & DF_1_NOW)
+                return 0;
+            break;
+        }
+    }
+    if (!jmprel || !symtab || !strtab)
+        return 0;
+
+    // the object's own scope; the program's is the global one
+    void *scope = info->dlpi_name[0] ? dlopen(info->dlpi_name, RTLD_LAZY | RTLD_NOLOAD) : NULL;
+    ElfW(Addr) got_start = UINTPTR_MAX, got_end = 0;
+    int failed = 0, unbound = 0;
+    for (size_t i = 0; i < pltrelsz / sizeof(ElfW(Rela)); i++) {
+        const ElfW(Rela) *rel = &jmprel[i];
+        ElfW(Addr) *slot = (ElfW(Addr) *)(info->dlpi_addr + rel->r_offset);
+        if ((ElfW(Addr))slot < got_start)
+            got_start = (ElfW(Addr))slot;
+        if ((ElfW(Addr))(slot + 1) > got_end)
+            got_end = (ElfW(Addr))(slot + 1);
+
+        // IRELATIVE slots are resolved at load time
+        if (ELF64_R_TYPE(rel->r_info) != R_X86_64_JUMP_SLOT)
+            continue;
+        if (*slot < text_start || *slot >= text_end)
+            continue;
+
+        size_t sym_idx = ELF64_R_SYM(rel->r_info);
+        const char *name = strtab + symtab[sym_idx].st_name;
+        const char *version = symbol_version(info, versym, verneed, strtab, sym_idx);
+        void *addr = resolve(scope, name, version);
+        if (!addr) {
+            // undefined weak symbols legitimately stay unresolved
+            if (ELF64_ST_BIND(symtab[sym_idx].st_info) != STB_WEAK)
+                failed++;
+            unbound++;
+            continue;
+        }
+        if (*slot != (ElfW(Addr))addr) {
+            *slot = (ElfW(Addr))addr;
+            state->bound++;
+        }
+    }
+
+    if (scope)
+        dlclose(scope);
+    // a slot left to the lazy resolver is written on its first call
+    state->failed += failed;
+    if (!unbound && got_start < got_end)
+        protect_got(got_start, got_end);
+    return 0;
+}
+
+#endif
+
+/*
+ * Resolve every lazily bound PLT slot of the program and its loaded objects,
+ * and make GOT pages that hold nothing else read-only in the objects whose
+ * slots were all bound.  Snapshots call this
+ * before copying memory, so images never reach the lazy resolver.
+ * Returns the number of slots bound, or -1 if some could not be resolved.
+ */
+int sbc_bind_now(void) {
+#if defined(__x86_64__)
+    BindState state = {0};
+    dl_iterate_phdr(bind_object, &state);
+    if (state.failed) {
+        fprintf(stderr, "Could not bind %d PLT slots\n", state.failed);
+        return -1;
+    }
+    return state.bound;
+#else
+    // only x86-64 PLT relocations are understood
+    fprintf(stderr, "Binding PLT slots is not supported on this architecture\n");
+    return -1;
+#endif
+}
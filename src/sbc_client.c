@@ -1,10 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stddef.h>
 #include <assert.h>
+#include <pthread.h>
 #include "vm_sbc.h"
 
 /*
@@ -14,6 +20,9 @@
  * that image.
  */
 
+static int map_fd(int fd, const char *name, int flags);
+static int wait_pending(int fd);
+
 /* extern globals defined in sbc_mm.c */
 extern MappedSubcontext mapped_subcontexts[MAX_IMG_FILES];
 extern size_t          num_mapped_subcontexts;
@@ -23,142 +32,720 @@ extern size_t          num_mapped_subcontexts;
  * permissions are managed by the matchmaker's segfault handler.
  */
 int map_subcontext(const char *img_file) {
-    printf("Mapping subcontext from file: %s\n", img_file);
+    return map_subcontext_ex(img_file, 0);
+}
 
-    // error check number of mapped subcontexts
-    if (num_mapped_subcontexts >= MAX_IMG_FILES) {
-        fprintf(stderr, "Error: Maximum number of subcontexts already mapped\n");
-        return EXIT_FAILURE;
-    }
+/* map_subcontext with SBC_MAP_* flags */
+int map_subcontext_ex(const char *img_file, int flags) {
+    printf("Mapping subcontext from file: %s\n", img_file);
 
-    // open the image file that we want to map
-    int fd = open(img_file, O_RDWR);
+    // open the image file that we want to map. it is only reopened for
+    // writing if it has shared-persistent regions
+    int fd = open(img_file, O_RDONLY);
     if (fd == -1) {
         perror("Error opening image file");
         return EXIT_FAILURE;
     }
 
+    int ret = map_fd(fd, img_file, flags);
+    if (ret != fd)
+        close(fd);
+    return ret;
+}
+
+/* Name of the POSIX shared memory object that backs the shared-anonymous
+ * region entry_idx of the image open as fd.  The name is derived from the
+ * image's device and inode and the time it was written, so every client of
+ * the same image on this host shares the object, and rewriting the image
+ * starts over with fresh objects.  The objects outlive the clients until
+ * they are removed with shm_unlink or the host reboots.
+ */
+SBC_MM_TEXT int sbc_share_name(int fd, size_t entry_idx, char *buf, size_t len) {
+    struct stat st;
+    ulong snapshot_id;
+    if (fstat(fd, &st) == -1 ||
+        pread(fd, &snapshot_id, sizeof(snapshot_id), offsetof(Header, snapshotId)) !=
+            sizeof(snapshot_id))
+        return -1;
+    return snprintf(buf, len, "/sbcshare.%lx.%lx.%lx.%zu", (ulong)st.st_dev,
+                    (ulong)st.st_ino, snapshot_id, entry_idx) < (int)len ? 0 : -1;
+}
+
+/* open the shared memory object of a shared-anonymous region, filling it
+ * from the image if this is the first client to use it */
+static SBC_MM_TEXT int open_shared_region(int fd, size_t entry_idx, const Entry *entry) {
+    char name[SMLBUFSZ];
+    if (sbc_share_name(fd, entry_idx, name, sizeof(name)) != 0)
+        return -1;
+    int shm_fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (shm_fd == -1) {
+        perror("Error opening shared region");
+        return -1;
+    }
+
+    // whoever finds the object empty initialises it; the lock keeps the
+    // other clients out until it is done
+    size_t size = entry->end - entry->start;
+    struct stat st;
+    flock(shm_fd, LOCK_EX);
+    if (fstat(shm_fd, &st) == 0 && st.st_size == 0) {
+        void *init = MAP_FAILED;
+        if (ftruncate(shm_fd, size) == 0)
+            init = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (init == MAP_FAILED) {
+            perror("Error initialising shared region");
+            ftruncate(shm_fd, 0);
+            flock(shm_fd, LOCK_UN);
+            close(shm_fd);
+            return -1;
+        }
+        ssize_t n;
+        size_t done = 0;
+        while (done < size &&
+               (n = pread(fd, (char *)init + done, size - done, entry->offsetIntoFile + done)) > 0)
+            done += n;
+        munmap(init, size);
+    }
+    flock(shm_fd, LOCK_UN);
+    return shm_fd;
+}
+
+/* map one region of an image according to its sharing policy at address
+ * at, with fixed being MAP_FIXED to replace what is there or
+ * MAP_FIXED_NOREPLACE to fail if anything is. writable says whether fd was
+ * opened for writing.  The matchmaker calls this for lazily mapped images */
+SBC_MM_TEXT void *map_image_entry(int fd, size_t entry_idx, const Entry *entry, int writable,
+                                  void *at, int fixed) {
+    size_t region_size = entry->end - entry->start;
+
+    // the regions start out the way the matchmaker leaves them while the
+    // client runs: readable and writable but not executable, so that the
+    // first call into the subcontext faults and is routed through the
+    // matchmaker
+    switch (entry->sharing) {
+    case SBC_SHARE_PERSISTENT:
+        if (writable)
+            return mmap(at, region_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | fixed, fd, entry->offsetIntoFile);
+        fprintf(stderr, "Warning: image is not writable, mapping shared region %zu privately\n",
+                entry_idx);
+        break;
+    case SBC_SHARE_ANONYMOUS: {
+        int shm_fd = open_shared_region(fd, entry_idx, entry);
+        if (shm_fd == -1)
+            return MAP_FAILED;
+        void *map = mmap(at, region_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | fixed, shm_fd, 0);
+        close(shm_fd);
+        return map;
+    }
+    }
+    return mmap(at, region_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | fixed, fd, entry->offsetIntoFile);
+}
+
+/* Only shared-persistent regions write to the image.  If the image open
+ * as fd has any, make sure the descriptor is writable, reopening it in
+ * place if it is not.  A write-sealed memfd cannot be written at all.
+ * Returns whether fd is writable.
+ */
+static int image_writable(int fd, const Header *header) {
+    int writable = (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals != -1 && (seals & F_SEAL_WRITE))
+        return 0;
+    if (writable)
+        return 1;
+    for (unsigned long i = 0; i < header->numEntries; i++) {
+        if (header->entries[i].sharing != SBC_SHARE_PERSISTENT)
+            continue;
+        char path[SMLBUFSZ];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        int rw_fd = open(path, O_RDWR);
+        if (rw_fd != -1) {
+            writable = dup2(rw_fd, fd) == fd;
+            close(rw_fd);
+        }
+        break;
+    }
+    return writable;
+}
+
+static void release_call_buffer(MappedSubcontext *subctx) {
+    if (subctx->call_buf)
+        munmap(subctx->call_buf, subctx->call_buf_size);
+    subctx->call_buf = NULL;
+    subctx->call_buf_size = 0;
+}
+
+/* Give the subcontext a call buffer if its image has a call argument
+ * slot.  The buffer is a mapping of its own, outside the client's and the
+ * subcontext's regions, so both can read and write it while the
+ * matchmaker switches between them.  A subcontext that already has one
+ * (after sbc_replace) keeps it.
+ */
+static int setup_call_buffer(MappedSubcontext *subctx) {
+    SbcCallArgs *args = subctx->header->callArgs;
+    if (!args) {
+        release_call_buffer(subctx);
+        return 0;
+    }
+
+    // the slot must be in a writable region of the image
+    int in_image = 0;
+    for (size_t i = 0; i < subctx->num_entries; i++) {
+        Entry *entry = &subctx->entries[i];
+        if (entry->start <= (ulong)args && (ulong)(args + 1) <= entry->end &&
+            entry->perms[1] == 'w')
+            in_image = 1;
+    }
+    if (!in_image) {
+        fprintf(stderr, "Warning: call argument slot %p is not in the image, ignoring it\n",
+                (void *)args);
+        release_call_buffer(subctx);
+        return 0;
+    }
+
+    if (!subctx->call_buf) {
+        void *buf = mmap(NULL, SBC_CALL_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buf == MAP_FAILED) {
+            perror("Error mapping call buffer");
+            return -1;
+        }
+        subctx->call_buf = buf;
+        subctx->call_buf_size = SBC_CALL_BUFFER_SIZE;
+    }
+    memset(args, 0, sizeof(*args));
+    args->buffer = subctx->call_buf;
+    args->size = subctx->call_buf_size;
+    return 0;
+}
+
+/* Check that header describes an image this library can map, of
+ * file_size bytes: the right magic and version, and regions and a
+ * checksum table that lie within the file. */
+static int check_header(const Header *header, off_t file_size, const char *name) {
+    if (file_size < (off_t)sizeof(Header) || header->magic != SBC_IMAGE_MAGIC) {
+        fprintf(stderr, "%s is not an image\n", name);
+        return -1;
+    }
+    if (header->version != SBC_IMAGE_VERSION) {
+        fprintf(stderr, "%s is an image of version %u, this library maps version %u\n",
+                name, header->version, SBC_IMAGE_VERSION);
+        return -1;
+    }
+    if (header->numEntries > MAX_ENTRIES) {
+        fprintf(stderr, "%s claims %lu regions\n", name, header->numEntries);
+        return -1;
+    }
+    size_t blocks = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned long i = 0; i < header->numEntries; i++) {
+        const Entry *entry = &header->entries[i];
+        if (entry->start >= entry->end || entry->offsetIntoFile > (ulong)file_size ||
+            entry->end - entry->start > file_size - entry->offsetIntoFile) {
+            fprintf(stderr, "Region %lu of %s lies outside the file\n", i, name);
+            return -1;
+        }
+        blocks += (entry->end - entry->start + page_size - 1) / page_size;
+    }
+    if (header->checksumOffset &&
+        (header->checksumOffset > (ulong)file_size ||
+         blocks > (file_size - header->checksumOffset) / sizeof(ulong))) {
+        fprintf(stderr, "The checksum table of %s lies outside the file\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void release_checks(MappedSubcontext *subctx) {
+    if (subctx->checks) {
+        for (size_t i = 0; i < subctx->num_entries; i++)
+            free(subctx->checks[i].pending);
+        free(subctx->checks);
+    }
+    if (subctx->checksums)
+        munmap((void *)subctx->checksums, subctx->checksums_len);
+    subctx->checks = NULL;
+    subctx->checksums = NULL;
+    subctx->checksums_len = 0;
+    subctx->pages_pending = 0;
+}
+
+/* Arrange for the private regions of a freshly mapped subcontext to be
+ * verified against the image's checksum table as they are first touched:
+ * the regions are made inaccessible, and the matchmaker checks each page
+ * on its first fault (see verify_page in sbc_mm.c).  Shared regions are
+ * written by other clients, so they cannot be checked against the table.
+ * Images without a table are not verified.
+ */
+static int setup_checks(MappedSubcontext *subctx, const Header *header) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    subctx->checks = NULL;
+    subctx->checksums = NULL;
+    subctx->checksums_len = 0;
+    subctx->pages_pending = 0;
+    if (!mm_verify_enabled() || !header->checksumOffset ||
+        header->checksumBlock != (ulong)page_size)
+        return 0;
+
+    size_t blocks = 0;
+    for (size_t i = 0; i < subctx->num_entries; i++)
+        blocks += (subctx->entries[i].end - subctx->entries[i].start) / page_size;
+    // the table starts on a page boundary
+    subctx->checksums_len = blocks * sizeof(ulong);
+    void *table = mmap(NULL, subctx->checksums_len, PROT_READ, MAP_PRIVATE, subctx->fd,
+                       header->checksumOffset);
+    subctx->checks = calloc(subctx->num_entries, sizeof(RegionCheck));
+    if (table == MAP_FAILED || !subctx->checks) {
+        perror("Error setting up image verification");
+        if (table != MAP_FAILED)
+            munmap(table, subctx->checksums_len);
+        free(subctx->checks);
+        subctx->checks = NULL;
+        return -1;
+    }
+    subctx->checksums = table;
+
+    size_t block = 0;
+    for (size_t i = 0; i < subctx->num_entries; i++) {
+        Entry *entry = &subctx->entries[i];
+        RegionCheck *check = &subctx->checks[i];
+        size_t pages = (entry->end - entry->start) / page_size;
+        check->first_block = block;
+        block += pages;
+        if (entry->sharing != SBC_SHARE_PRIVATE)
+            continue;
+        // a region that is only reserved is inaccessible already, and gets
+        // mapped that way while it has pages pending
+        int reserved = subctx->lazy && subctx->lazy->state[i] != SBC_LAZY_MAPPED;
+        check->pending = malloc((pages + 7) / 8);
+        if (!check->pending || (!reserved && mprotect((void *)entry->start,
+                                                      entry->end - entry->start, PROT_NONE) == -1)) {
+            perror("Error setting up image verification");
+            free(check->pending);
+            check->pending = NULL;
+            // leave it unverified rather than inaccessible
+            if (!reserved)
+                mprotect((void *)entry->start, entry->end - entry->start, PROT_READ | PROT_WRITE);
+            continue;
+        }
+        memset(check->pending, 0xff, (pages + 7) / 8);
+        check->num_pending = pages;
+        subctx->pages_pending += pages;
+    }
+    return 0;
+}
+
+static MappedSubcontext *find_subcontext_by_fd(int fd) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        if (mapped_subcontexts[i].fd == fd)
+            return &mapped_subcontexts[i];
+    }
+    return NULL;
+}
+
+/* unmap the first n regions of an image */
+static void unmap_regions(const Entry *entries, size_t n) {
+    for (size_t j = 0; j < n; j++)
+        munmap((void *)entries[j].start, entries[j].end - entries[j].start);
+}
+
+/* unmap the n regions of an image, along with the reservation around
+ * them if it was mapped lazily, and free its lazy state */
+static void release_regions(const Entry *entries, size_t n, LazyMap *lazy) {
+    if (lazy && lazy->span_end)
+        munmap((void *)lazy->span_start, lazy->span_end - lazy->span_start);
+    else
+        unmap_regions(entries, n);
+    if (lazy)
+        free(lazy->state);
+    free(lazy);
+}
+
+/* reserve [start, start + len) as inaccessible memory, failing with EEXIST
+ * if anything is mapped there */
+static int reserve_range(ulong start, size_t len) {
+    void *map = mmap((void *)start, len, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (map != MAP_FAILED && map != (void *)start) {
+        munmap(map, len);
+        map = MAP_FAILED;
+        errno = EEXIST;
+    }
+    return map == MAP_FAILED ? -1 : 0;
+}
+
+/* SBC_MAP_LAZY: reserve the addresses of an image's regions instead of
+ * mapping them, so that mapping costs the same however many regions the
+ * image has.  One reservation covers the regions and the gaps between
+ * them, unless something else lives in a gap, in which case each region
+ * is reserved on its own.  The matchmaker maps a region over its
+ * reservation on the first fault in it (see map_lazy in sbc_mm.c). */
+static LazyMap *reserve_regions(const Header *header, int writable) {
+    size_t n = header->numEntries;
+    const Entry *entries = header->entries;
+    LazyMap *lazy = calloc(1, sizeof(LazyMap));
+    if (lazy)
+        lazy->state = malloc(n ? n : 1);
+    if (!lazy || !lazy->state) {
+        perror("Error allocating lazy mapping state");
+        free(lazy);
+        return NULL;
+    }
+    memset(lazy->state, SBC_LAZY_RESERVED, n);
+    lazy->num_reserved = n;
+    lazy->writable = writable;
+    if (n == 0)
+        return lazy;
+
+    ulong start = entries[0].start, end = entries[n - 1].end;
+    if (start < end && reserve_range(start, end - start) == 0) {
+        lazy->span_start = start;
+        lazy->span_end = end;
+        return lazy;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (reserve_range(entries[i].start, entries[i].end - entries[i].start) == 0)
+            continue;
+        if (errno == EEXIST)
+            fprintf(stderr,
+                    "Fatal error: Region %zu (%016lx-%016lx) overlaps with existing process memory.\n",
+                    i, entries[i].start, entries[i].end);
+        else
+            perror("Error reserving memory region");
+        unmap_regions(entries, i);
+        free(lazy->state);
+        free(lazy);
+        return NULL;
+    }
+    return lazy;
+}
+
+/* The part of mapping an image that needs no lock: read and check its
+ * header and map its regions where they belong, or with SBC_MAP_LAZY in
+ * flags only reserve them and return their lazy state in *lazy.
+ * MAP_FIXED_NOREPLACE refuses to map over anything already there, which
+ * stands in for a scan of the process's mappings and also keeps images
+ * mapped concurrently from landing on each other.  Returns the image's
+ * metadata mapping, of *file_size bytes, or NULL. */
+static Header *map_regions(int fd, const char *name, int flags, off_t *file_size,
+                           LazyMap **lazy) {
+    *lazy = NULL;
     // seek to end of file to determine filesize
-    off_t file_size = lseek(fd, 0, SEEK_END);
-    if (file_size == -1) {
+    *file_size = lseek(fd, 0, SEEK_END);
+    if (*file_size == -1) {
         perror("Error determining file size");
-        close(fd);
-        return EXIT_FAILURE;
+        return NULL;
     }
 
     // seek to the beginning of the file
     if (lseek(fd, 0, SEEK_SET) == -1) {
         perror("Error resetting file position");
-        close(fd);
-        return EXIT_FAILURE;
+        return NULL;
     }
 
     // map the image file's metadata into our virtual memory
-    void *metadata_map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    void *metadata_map = mmap(NULL, *file_size, PROT_READ, MAP_PRIVATE, fd, 0);
     if (metadata_map == MAP_FAILED) {
         perror("Error mapping file for metadata");
-        close(fd);
-        return EXIT_FAILURE;
+        return NULL;
     }
 
     // extract number of memory regions from image file's metadata
     Header *header = (Header *)metadata_map;
+    if (check_header(header, *file_size, name) != 0) {
+        munmap(metadata_map, *file_size);
+        return NULL;
+    }
     unsigned long num_entries = header->numEntries;
     printf("Image contains %lu memory regions\n", num_entries);
 
-    // map each memory region into our virtual memory
+    int writable = image_writable(fd, header);
+    if (flags & SBC_MAP_LAZY) {
+        *lazy = reserve_regions(header, writable);
+        if (!*lazy) {
+            munmap(metadata_map, *file_size);
+            return NULL;
+        }
+        printf("Reserved %lu memory regions, to be mapped on first access\n", num_entries);
+        return header;
+    }
+
     for (unsigned long i = 0; i < num_entries; i++) {
         Entry *entry = &header->entries[i];
-        if (check_for_overlap(entry->start, entry->end)) {
-            fprintf(stderr,
-                    "Fatal error: Region %lu (%016lx-%016lx) overlaps with existing process memory.\n",
-                    i, entry->start, entry->end);
-            munmap(metadata_map, file_size);
-            close(fd);
-            return EXIT_FAILURE;
+        size_t region_size = entry->end - entry->start;
+
+        printf("Mapping region %lu: %016lx-%016lx; Size: %zu bytes; Offset: %lu (NO EXECUTE)\n",
+               i, entry->start, entry->end, region_size, entry->offsetIntoFile);
+
+        // map the previously recorded memory regions
+        void *region_map = map_image_entry(fd, i, entry, writable, (void *)entry->start,
+                                           MAP_FIXED_NOREPLACE);
+        if (region_map != MAP_FAILED && region_map != (void *)entry->start) {
+            // a kernel without MAP_FIXED_NOREPLACE took the address as a hint
+            munmap(region_map, region_size);
+            region_map = MAP_FAILED;
+            errno = EEXIST;
         }
+        if (region_map == MAP_FAILED) {
+            if (errno == EEXIST)
+                fprintf(stderr,
+                        "Fatal error: Region %lu (%016lx-%016lx) overlaps with existing process memory.\n",
+                        i, entry->start, entry->end);
+            else
+                perror("Error mapping memory region");
+            fprintf(stderr, "Failed to map region %lu at address %016lx\n", i, entry->start);
+            unmap_regions(header->entries, i);
+            munmap(metadata_map, *file_size);
+            return NULL;
+        }
+        printf("Successfully mapped region %lu at address %016lx (no execute)\n",
+               i, entry->start);
+    }
+    return header;
+}
+
+/* Make an image whose regions map_regions has mapped (or reserved, with
+ * lazy state lazy) known to the matchmaker.  The metadata mapping is
+ * released either way, and the regions too on failure. */
+static int register_locked(int fd, const char *name, Header *header, off_t file_size,
+                           LazyMap *lazy, int flags, unsigned long trace_start) {
+    unsigned long num_entries = header->numEntries;
+
+    // error check number of mapped subcontexts
+    if (num_mapped_subcontexts >= MAX_IMG_FILES) {
+        fprintf(stderr, "Error: Maximum number of subcontexts already mapped\n");
+        release_regions(header->entries, num_entries, lazy);
+        munmap(header, file_size);
+        return EXIT_FAILURE;
     }
 
     // store information about the subcontext into global data structure
     MappedSubcontext *subctx = &mapped_subcontexts[num_mapped_subcontexts];
-    strncpy(subctx->img_file, img_file, sizeof(subctx->img_file) - 1);
+    strncpy(subctx->img_file, name, sizeof(subctx->img_file) - 1);
     subctx->img_file[sizeof(subctx->img_file) - 1] = '\0';
     subctx->fd = fd;
     subctx->num_entries = num_entries;
     subctx->is_active = 0;
+    subctx->on_stack = 0;
+    subctx->call_buf = NULL;
+    subctx->call_buf_size = 0;
+    subctx->last_transition_ns = mm_coarse_clock();
+    subctx->reclaimed = 0;
+    subctx->prefetch_on_entry = 0;
+    subctx->dirty = NULL;
+    subctx->num_untracked = 0;
+    subctx->relaxed = (flags & SBC_MAP_RELAXED) != 0;
+    subctx->lazy = lazy;
 
+    // copy the entries and the header out of the metadata mapping
     subctx->entries = malloc(num_entries * sizeof(Entry));
-    // unmap the metadata
-    if (!subctx->entries) {
-        perror("Error allocating memory for entries");
-        munmap(metadata_map, file_size);
-        close(fd);
+    subctx->header = malloc(sizeof(Header));
+    if (!subctx->entries || !subctx->header) {
+        perror("Error allocating memory for subcontext");
+        free(subctx->entries);
+        free(subctx->header);
+        release_regions(header->entries, num_entries, lazy);
+        munmap(header, file_size);
         return EXIT_FAILURE;
     }
-    // copy over the entries pointer to the global data structure
     memcpy(subctx->entries, header->entries, num_entries * sizeof(Entry));
+    memcpy(subctx->header, header, sizeof(Header));
+    munmap(header, file_size);
 
-    // allocate memory for the header. copy pointer from previous header
-    subctx->header = malloc(sizeof(Header));
-    if (!subctx->header) {
-        perror("Error allocating memory for header");
+    // record the base address and total size of the mapped memory regions in the data structure
+    if (num_entries > 0) {
+        subctx->base_addr = (void *)subctx->entries[0].start;
+        subctx->total_size = subctx->entries[num_entries - 1].end - subctx->entries[0].start;
+    }
+    subctx->stats_idx = mm_stats_attach(name, fd);
+
+    // the matchmaker has to know the subcontext before anything touches
+    // its pages, as that is when they are verified
+    setup_checks(subctx, subctx->header);
+    num_mapped_subcontexts++;
+    if (setup_call_buffer(subctx) != 0) {
+        num_mapped_subcontexts--;
+        release_regions(subctx->entries, num_entries, lazy);
+        release_checks(subctx);
+        mm_stats_detach(subctx->stats_idx);
         free(subctx->entries);
-        munmap(metadata_map, file_size);
-        close(fd);
+        free(subctx->header);
         return EXIT_FAILURE;
     }
-    memcpy(subctx->header, header, sizeof(Header));
+    mm_trace(SBC_TRACE_MAP, SBC_CTX_CLIENT, mm_trace_ctx(subctx), subctx->base_addr,
+             trace_start);
+    printf("Successfully mapped subcontext from %s (index %zu)\n", name, num_mapped_subcontexts - 1);
 
-    for (unsigned long i = 0; i < num_entries; i++) {
-        Entry *entry = &subctx->entries[i];
-        size_t region_size = entry->end - entry->start;
-        off_t  file_offset = entry->offsetIntoFile;
+    return fd;
+}
 
-        printf("Mapping region %lu: %016lx-%016lx; Size: %zu bytes; Offset: %lu (NO PERMISSIONS)\n",
-               i, entry->start, entry->end, region_size, file_offset);
+/* map_subcontext_fd with SBC_MAP_* flags.  Only registering the mapped
+ * image takes the mappings lock, so images can be mapped concurrently */
+static int map_fd(int fd, const char *name, int flags) {
+    unsigned long trace_start = mm_trace_clock();
+    off_t file_size;
+    LazyMap *lazy;
+    Header *header = map_regions(fd, name, flags, &file_size, &lazy);
+    if (!header)
+        return EXIT_FAILURE;
+    mm_lock_mappings();
+    int ret = register_locked(fd, name, header, file_size, lazy, flags, trace_start);
+    mm_unlock_mappings();
+    return ret;
+}
 
-        // map the previously recorded memory regions
-        void *region_map = mmap((void *)entry->start, region_size,
-                               PROT_READ | PROT_WRITE | PROT_EXEC,
-                               MAP_SHARED | MAP_FIXED, fd, file_offset);
-        mprotect((void *)entry->start, region_size, PROT_READ | PROT_WRITE | PROT_EXEC);
+/* Map a server image that is already open, e.g. a sealed memfd received
+ * from the broker.  On success the subcontext takes ownership of fd and
+ * it is returned as the subcontext handle; on failure fd is left open.
+ * The name is only used to identify the subcontext.
+ */
+int map_subcontext_fd(int fd, const char *name) {
+    return map_fd(fd, name, 0);
+}
 
-        if (region_map == MAP_FAILED) {
-            perror("Error mapping memory region");
-            fprintf(stderr, "Failed to map region %lu at address %016lx\n", i, entry->start);
-            for (unsigned long j = 0; j < i; j++) {
-                Entry *prev = &subctx->entries[j];
-                munmap((void *)prev->start, prev->end - prev->start);
-            }
-            free(subctx->entries);
-            free(subctx->header);
-            munmap(metadata_map, file_size);
-            close(fd);
-            return EXIT_FAILURE;
-        }
-        if (region_map != (void *)entry->start) {
-            fprintf(stderr,
-                    "Warning: Region %lu mapped at %p instead of requested %016lx\n",
-                    i, region_map, entry->start);
-        } else {
-            printf("Successfully mapped region %lu at address %016lx (no permissions)\n",
-                   i, entry->start);
-        }
+/* an image being mapped in the background.  A successful mapping gives
+ * its slot back as soon as it is registered; a failed one keeps it until
+ * someone waits for the handle, to be told */
+typedef struct pending_map {
+    int  in_use;
+    int  fd;
+    int  flags;
+    int  done;
+    int  status;  // what map_fd returned, once done
+    char name[256];
+} PendingMap;
+
+static PendingMap      pending_maps[MAX_IMG_FILES];
+static int             num_pending = 0;  // mappings still in flight
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pending_done = PTHREAD_COND_INITIALIZER;
+
+/* The mapping thread may start while another thread is inside a
+ * subcontext, with the client's code not executable, so it starts in
+ * SBC_MM_TEXT and becomes a bystander before running any of it */
+static SBC_MM_TEXT void *map_in_background(void *arg) {
+    mm_mark_bystander();
+    PendingMap *pending = arg;
+    int status = map_fd(pending->fd, pending->name, pending->flags);
+    pthread_mutex_lock(&pending_lock);
+    if (status == pending->fd) {
+        pending->in_use = 0;
+    } else {
+        pending->status = status;
+        pending->done = 1;
     }
+    __atomic_sub_fetch(&num_pending, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pending_done);
+    pthread_mutex_unlock(&pending_lock);
+    return NULL;
+}
 
-    // record the base address and total size of the mapped memory regions in the data structure
-    if (num_entries > 0) {
-        subctx->base_addr = (void *)subctx->entries[0].start;
-        subctx->total_size = subctx->entries[num_entries - 1].end - subctx->entries[0].start;
+/* Start mapping a server image on a thread of its own and return its
+ * handle straight away; only opening the file happens before that.  Up to
+ * MAX_IMG_FILES images can be mapping at once, failed mappings counting
+ * until sbc_map_wait has reported them.  The call API, and everything
+ * else that takes the handle, waits for the mapping to finish first, as
+ * does sbc_map_wait.  Returns EXIT_FAILURE if the mapping could not be
+ * started. */
+int map_subcontext_async(const char *img_file, int flags) {
+    int fd = open(img_file, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening image file");
+        return EXIT_FAILURE;
     }
 
-    munmap(metadata_map, file_size);
-    num_mapped_subcontexts++;
-    printf("Successfully mapped subcontext from %s (index %zu)\n", img_file, num_mapped_subcontexts - 1);
+    pthread_mutex_lock(&pending_lock);
+    PendingMap *pending = NULL;
+    for (size_t i = 0; !pending && i < MAX_IMG_FILES; i++) {
+        if (!pending_maps[i].in_use)
+            pending = &pending_maps[i];
+    }
+    if (!pending) {
+        pthread_mutex_unlock(&pending_lock);
+        fprintf(stderr, "Error: Too many images already being mapped\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    pending->in_use = 1;
+    pending->fd = fd;
+    pending->flags = flags;
+    pending->done = 0;
+    strncpy(pending->name, img_file, sizeof(pending->name) - 1);
+    pending->name[sizeof(pending->name) - 1] = '\0';
 
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, map_in_background, pending);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        pending->in_use = 0;
+        pthread_mutex_unlock(&pending_lock);
+        fprintf(stderr, "Error starting mapping thread: %s\n", strerror(err));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    __atomic_add_fetch(&num_pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pending_lock);
     return fd;
 }
 
+/* Wait for the image started with map_subcontext_async as fd to be mapped.
+ * Returns 0 once it is, or -1 if it could not be mapped, in which case fd
+ * is closed and no longer a handle.  Handles that were never pending
+ * return 0 if they are mapped. */
+int sbc_map_wait(int fd) {
+    pthread_mutex_lock(&pending_lock);
+    PendingMap *pending = NULL;
+    for (size_t i = 0; !pending && i < MAX_IMG_FILES; i++) {
+        if (pending_maps[i].in_use && pending_maps[i].fd == fd)
+            pending = &pending_maps[i];
+    }
+    while (pending && pending->in_use && pending->fd == fd && !pending->done)
+        pthread_cond_wait(&pending_done, &pending_lock);
+    // a successful mapping has given its slot back
+    if (!pending || !pending->in_use || pending->fd != fd) {
+        pthread_mutex_unlock(&pending_lock);
+        return find_subcontext_by_fd(fd) ? 0 : -1;
+    }
+    pending->in_use = 0;
+    pthread_mutex_unlock(&pending_lock);
+    close(fd);
+    return -1;
+}
+
+/* In a child created with fork() the threads mapping images in the
+ * background are gone.  A mapping that had been registered before the fork
+ * succeeded; any other has failed, and what it had mapped so far stays
+ * mapped in the child. */
+void mm_pending_after_fork(void) {
+    pending_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    pending_done = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    for (size_t i = 0; i < MAX_IMG_FILES; i++) {
+        PendingMap *pending = &pending_maps[i];
+        if (!pending->in_use || pending->done)
+            continue;
+        if (find_subcontext_by_fd(pending->fd)) {
+            pending->in_use = 0;
+        } else {
+            pending->status = EXIT_FAILURE;
+            pending->done = 1;
+        }
+    }
+    num_pending = 0;
+}
+
+/* wait for fd if it is still being mapped; one load when nothing is */
+static int wait_pending(int fd) {
+    if (!__atomic_load_n(&num_pending, __ATOMIC_ACQUIRE))
+        return 0;
+    return sbc_map_wait(fd);
+}
+
 /*
  * Basic helpers used by both the server and client libraries
  */
@@ -186,7 +773,7 @@ int check_for_overlap(unsigned long start, unsigned long end) {
     return has_overlap;
 }
 
-int perms_to_prot(const char *perm) {
+SBC_MM_TEXT int perms_to_prot(const char *perm) {
     int prot = 0;
     if (perm[0] == 'r') prot |= PROT_READ;
     if (perm[1] == 'w') prot |= PROT_WRITE;
@@ -200,41 +787,202 @@ int perms_to_prot(const char *perm) {
  * header.
  */
 int call_subcontext_function(int func_idx, int fd) {
-    Header *header;
-    void *header_map = mmap(NULL, sizeof(Header), PROT_READ, MAP_PRIVATE, fd, 0);
-    if (header_map == MAP_FAILED) {
-        perror("Error mapping header for function call");
+    wait_pending(fd);
+    // the header copied when the image was mapped, which sbc_replace keeps
+    // in step with the mappings
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx) {
+        fprintf(stderr, "No subcontext is mapped from descriptor %d\n", fd);
         return EXIT_FAILURE;
     }
-
-    header = (Header *)header_map;
+    Header *header = subctx->header;
 
     if (func_idx < 0 || func_idx >= MAX_FUNC_PTRS || header->func_ptr[func_idx] == NULL) {
         fprintf(stderr, "Invalid function index or NULL function pointer\n");
-        munmap(header_map, sizeof(Header));
         return EXIT_FAILURE;
     }
 
     void (*func)(int) = header->func_ptr[func_idx];
     printf("Calling function at address: %p\n", func);
     func(0);
+    mm_leave_relaxed();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * The address of export func_idx of the subcontext open as fd, if the
+ * image records signature sig for it (see sbc_export_signature), for the
+ * client to cast to the function's real type and call directly.  The call
+ * enters the subcontext through the matchmaker like any other, but its
+ * arguments and return value travel in registers instead of through the
+ * call buffer or globals.  A relaxed subcontext called this way stays open
+ * until the next transition (see mm_leave_relaxed), and the address is
+ * stale once sbc_replace has swapped the image.  Returns NULL if there is
+ * no such export or its signature is a different one.
+ */
+void *sbc_export_address(int fd, int func_idx, const char *sig) {
+    wait_pending(fd);
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx || func_idx < 0 || func_idx >= MAX_FUNC_PTRS ||
+        !subctx->header->func_ptr[func_idx]) {
+        fprintf(stderr, "No function %d in subcontext %d\n", func_idx, fd);
+        return NULL;
+    }
+    const char *image_sig = subctx->header->funcSig[func_idx];
+    if (strncmp(image_sig, sig, SBC_SIG_LEN) != 0) {
+        fprintf(stderr, "Function %d of %s has signature \"%.*s\", not \"%s\"\n", func_idx,
+                subctx->img_file, SBC_SIG_LEN, image_sig, sig);
+        return NULL;
+    }
+    return (void *)subctx->header->func_ptr[func_idx];
+}
+
+/*
+ * Fault in all of the subcontext open as fd ahead of its first call:
+ * pages still waiting for verification are verified now, and every region
+ * is populated from the page cache.  Processes forked afterwards share the
+ * result instead of each paying for it on first touch.
+ * Returns 0, or -1 if a page fails verification or cannot be populated.
+ */
+int sbc_prefault(int fd) {
+    wait_pending(fd);
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx)
+        return -1;
+    if (mm_map_reserved(subctx) != 0 || mm_verify_now(subctx) != 0)
+        return -1;
+    for (size_t i = 0; i < subctx->num_entries; i++) {
+        Entry *entry = &subctx->entries[i];
+        if (madvise((void *)entry->start, entry->end - entry->start, MADV_POPULATE_READ) == -1) {
+            perror("Error prefaulting subcontext");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    munmap(header_map, sizeof(Header));
+/*
+ * Put the subcontext open as fd back into the state its image was
+ * snapshotted in, e.g. between requests that must not see each other's
+ * data.  Only its writable private regions are reset: shared regions keep
+ * their contents by design, and the client's own writes to read-only
+ * regions are not undone.  The first reset of a subcontext discards its
+ * writable regions whole; later ones only the pages written since (see
+ * mm_reset).  Waits for threads running in the subcontext to leave it.
+ * Returns 0, or -1 if fd is not a subcontext or the reset failed.
+ *
+ * Between resets the pages not yet written are read-only, so system calls
+ * cannot write into them (read(2) fails with EFAULT); buffers the
+ * subcontext reads into have to be given to sbc_reset_untracked.
+ */
+int sbc_reset(int fd) {
+    wait_pending(fd);
+    mm_lock_mappings();
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    int ret = subctx ? mm_reset(subctx) : -1;
+    // the call argument slot is part of the image and was reset with it
+    if (ret == 0 && setup_call_buffer(subctx) != 0)
+        ret = -1;
+    mm_unlock_mappings();
+    return ret;
+}
+
+/*
+ * Leave the pages of [addr, addr + len) in the subcontext open as fd
+ * writable between resets, for buffers system calls write into, and have
+ * every sbc_reset discard them whether they were written or not.  The
+ * pages around the range are included whole.  Returns 0, or -1 if fd is
+ * not a subcontext or it has SBC_UNTRACKED_MAX ranges already.
+ */
+int sbc_reset_untracked(int fd, void *addr, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong start = (ulong)addr & ~(page_size - 1);
+    ulong end = ((ulong)addr + len + page_size - 1) & ~(page_size - 1);
+    wait_pending(fd);
+    mm_lock_mappings();
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    int ret = subctx ? mm_reset_untracked(subctx, start, end) : -1;
+    mm_unlock_mappings();
+    return ret;
+}
+
+/*
+ * Return the buffer shared with the subcontext open as fd for passing data
+ * to call_subcontext_slice, and store its size in *size.  Returns NULL if
+ * the subcontext's image has no call argument slot.
+ */
+void *sbc_call_buffer(int fd, size_t *size) {
+    wait_pending(fd);
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx || !subctx->call_buf)
+        return NULL;
+    if (size)
+        *size = subctx->call_buf_size;
+    return subctx->call_buf;
+}
+
+/*
+ * Call a function of the subcontext open as fd, handing it the slice in of
+ * the call buffer.  The subcontext reads the slice in place and may hand a
+ * slice back with sbc_return_slice, which is stored in *out (an empty
+ * slice if it returned nothing).  Nothing is copied either way.
+ */
+int call_subcontext_slice(int func_idx, int fd, SbcSlice in, SbcSlice *out) {
+    wait_pending(fd);
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx || !subctx->call_buf) {
+        fprintf(stderr, "Subcontext has no call buffer\n");
+        return EXIT_FAILURE;
+    }
+    if (in.offset > subctx->call_buf_size || in.len > subctx->call_buf_size - in.offset) {
+        fprintf(stderr, "Slice does not fit in the call buffer\n");
+        return EXIT_FAILURE;
+    }
+    if (func_idx < 0 || func_idx >= MAX_FUNC_PTRS || subctx->header->func_ptr[func_idx] == NULL) {
+        fprintf(stderr, "Invalid function index or NULL function pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    SbcCallArgs *args = subctx->header->callArgs;
+    args->in = in;
+    args->out.offset = 0;
+    args->out.len = 0;
+    subctx->header->func_ptr[func_idx](0);
+    mm_leave_relaxed();
+
+    // the subcontext checks the result slice, but it is trusted no further
+    // than the client's own bounds
+    SbcSlice result = args->out;
+    if (result.offset > subctx->call_buf_size ||
+        result.len > subctx->call_buf_size - result.offset) {
+        fprintf(stderr, "Subcontext returned a slice outside the call buffer\n");
+        return EXIT_FAILURE;
+    }
+    if (out)
+        *out = result;
     return EXIT_SUCCESS;
 }
 
 /*
  * Unmap a previously mapped subcontext given the file descriptor returned
- * by map_subcontext -- currently not tested.
+ * by map_subcontext, closing it.
  */
 int unmap_subcontext(int fd) {
+    wait_pending(fd);
+    mm_leave_relaxed();
+    mm_lock_mappings();
     for (size_t i = 0; i < num_mapped_subcontexts; i++) {
         MappedSubcontext *subctx = &mapped_subcontexts[i];
         if (subctx->fd == fd) {
-            for (size_t j = 0; j < subctx->num_entries; j++) {
-                Entry *entry = &subctx->entries[j];
-                munmap((void *)entry->start, entry->end - entry->start);
-            }
+            unsigned long trace_start = mm_trace_clock();
+            release_regions(subctx->entries, subctx->num_entries, subctx->lazy);
+            subctx->lazy = NULL;
+            mm_trace(SBC_TRACE_UNMAP, SBC_CTX_CLIENT, mm_trace_ctx(subctx),
+                     subctx->base_addr, trace_start);
+            mm_stats_detach(subctx->stats_idx);
+            release_call_buffer(subctx);
+            release_checks(subctx);
+            mm_reset_release(subctx);
             free(subctx->entries);
             free(subctx->header);
             close(subctx->fd);
@@ -242,8 +990,292 @@ int unmap_subcontext(int fd) {
                 mapped_subcontexts[k] = mapped_subcontexts[k + 1];
             }
             num_mapped_subcontexts--;
+            mm_unlock_mappings();
             return 0;
         }
     }
+    mm_unlock_mappings();
     return -1;
 }
+
+/* whether [start, end) overlaps memory of this process other than the
+ * regions of subctx, which a replacement may reuse */
+static int overlaps_other_memory(ulong start, ulong end, const MappedSubcontext *subctx) {
+    FILE *maps_file = fopen("/proc/self/maps", "r");
+    if (!maps_file) {
+        perror("Error opening /proc/self/maps");
+        return -1;
+    }
+
+    char line[256];
+    int has_overlap = 0;
+    while (!has_overlap && fgets(line, sizeof(line), maps_file) != NULL) {
+        unsigned long map_start, map_end;
+        if (sscanf(line, "%lx-%lx", &map_start, &map_end) != 2 ||
+            map_end <= start || map_start >= end)
+            continue;
+        // adjacent regions can show up as one mapping, so the mapping is
+        // ours if the (sorted) regions cover all of it
+        ulong addr = map_start;
+        for (size_t i = 0; i < subctx->num_entries; i++) {
+            if (subctx->entries[i].start <= addr && addr < subctx->entries[i].end)
+                addr = subctx->entries[i].end;
+        }
+        has_overlap = addr < map_end;
+        if (has_overlap)
+            printf("Overlap detected: %016lx-%016lx overlaps with %016lx-%016lx\n",
+                   start, end, map_start, map_end);
+    }
+    fclose(maps_file);
+    return has_overlap;
+}
+
+// mremap moves whole page tables instead of single entries when the source
+// and destination are equally aligned within this
+#define SBC_PMD_SIZE (2UL << 20)
+
+/* reserve size bytes anywhere, at an address that lies like `like` within
+ * a page table */
+static void *reserve_like(ulong like, size_t size) {
+    char *map = mmap(NULL, size + SBC_PMD_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *addr = map + ((like - (ulong)map) & (SBC_PMD_SIZE - 1));
+    if (addr > map)
+        munmap(map, addr - map);
+    munmap(addr + size, map + size + SBC_PMD_SIZE - (addr + size));
+    return addr;
+}
+
+/* move [from, from + size) to to, which replaces whatever is there */
+static int move_region(void *from, size_t size, void *to) {
+    return mremap(from, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, to) == MAP_FAILED ? -1 : 0;
+}
+
+/* check the private regions of an image staged at the given addresses
+ * against its checksum table */
+static int verify_staged(int fd, const Header *header, void **staged) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (!mm_verify_enabled() || !header->checksumOffset ||
+        header->checksumBlock != (ulong)page_size)
+        return 0;
+
+    size_t block = 0;
+    ulong sums[512];
+    for (size_t i = 0; i < header->numEntries; i++) {
+        const Entry *entry = &header->entries[i];
+        size_t pages = (entry->end - entry->start) / page_size;
+        for (size_t p = 0; entry->sharing == SBC_SHARE_PRIVATE && p < pages; p++) {
+            if (p % 512 == 0) {
+                size_t n = pages - p < 512 ? pages - p : 512;
+                if (pread(fd, sums, n * sizeof(ulong),
+                          header->checksumOffset + (block + p) * sizeof(ulong)) !=
+                    (ssize_t)(n * sizeof(ulong)))
+                    return -1;
+            }
+            if (sbc_page_hash((char *)staged[i] + p * page_size, page_size) != sums[p % 512])
+                return -1;
+        }
+        block += pages;
+    }
+    return 0;
+}
+
+/* sbc_replace, with the mappings locked */
+static int replace_locked(int fd, const char *new_img) {
+    MappedSubcontext *subctx = find_subcontext_by_fd(fd);
+    if (!subctx) {
+        fprintf(stderr, "No subcontext is mapped from descriptor %d\n", fd);
+        return EXIT_FAILURE;
+    }
+    printf("Replacing subcontext %s with %s\n", subctx->img_file, new_img);
+    // a lazily mapped image is mapped in full first, so that nothing but
+    // its regions is in the way of the new one
+    if (mm_map_reserved(subctx) != 0)
+        return EXIT_FAILURE;
+
+    int new_fd = open(new_img, O_RDONLY);
+    if (new_fd == -1) {
+        perror("Error opening image file");
+        return EXIT_FAILURE;
+    }
+    Header *header = malloc(sizeof(Header));
+    off_t file_size = lseek(new_fd, 0, SEEK_END);
+    if (!header || pread(new_fd, header, sizeof(Header), 0) != sizeof(Header) ||
+        check_header(header, file_size, new_img) != 0 || header->numEntries == 0) {
+        free(header);
+        close(new_fd);
+        return EXIT_FAILURE;
+    }
+    size_t num_entries = header->numEntries;
+    Entry *entries = header->entries;
+    for (size_t i = 0; i < num_entries; i++) {
+        if ((i > 0 && entries[i].start < entries[i - 1].end) ||
+            overlaps_other_memory(entries[i].start, entries[i].end, subctx)) {
+            fprintf(stderr, "Region %zu (%016lx-%016lx) of %s cannot be placed\n",
+                    i, entries[i].start, entries[i].end, new_img);
+            free(header);
+            close(new_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t num_old = subctx->num_entries;
+    Entry *old_entries = subctx->entries;
+    Entry *new_entries = malloc(num_entries * sizeof(Entry));
+    void **staged = calloc(num_entries, sizeof(void *));
+    void **retired = calloc(num_old, sizeof(void *));
+    int writable = image_writable(new_fd, header);
+    int ok = new_entries && staged && retired;
+    if (ok)
+        memcpy(new_entries, entries, num_entries * sizeof(Entry));
+
+    // stage the new regions off to the side and fault them in, so that
+    // the pause does not depend on the size of the image. the old regions
+    // get somewhere to go too: they are moved out of the way during the
+    // pause and only torn down after it
+    for (size_t i = 0; ok && i < num_entries; i++) {
+        size_t size = entries[i].end - entries[i].start;
+        void *at = reserve_like(entries[i].start, size);
+        staged[i] = at ? map_image_entry(new_fd, i, &entries[i], writable, at, MAP_FIXED)
+                         : MAP_FAILED;
+        if (staged[i] == MAP_FAILED) {
+            perror("Error mapping memory region");
+            if (at)
+                munmap(at, size);
+            staged[i] = NULL;
+            ok = 0;
+            break;
+        }
+        if (madvise(staged[i], size, MADV_POPULATE_READ) == -1)
+            madvise(staged[i], size, MADV_WILLNEED);
+    }
+    // every page is being read in anyway, so the new image is verified in
+    // full while it is staged rather than lazily
+    if (ok && verify_staged(new_fd, header, staged) != 0) {
+        fprintf(stderr, "%s failed its integrity check\n", new_img);
+        ok = 0;
+    }
+    for (size_t i = 0; ok && i < num_old; i++) {
+        retired[i] = reserve_like(old_entries[i].start, old_entries[i].end - old_entries[i].start);
+        ok = retired[i] != NULL;
+    }
+    unsigned long pause_start = mm_trace_clock();
+    if (ok && mm_replace_begin(subctx) != 0) {
+        fprintf(stderr, "%s cannot be replaced from a call it is still to return from\n",
+                subctx->img_file);
+        ok = 0;
+    }
+    if (!ok) {
+        for (size_t i = 0; staged && i < num_entries && staged[i]; i++)
+            munmap(staged[i], entries[i].end - entries[i].start);
+        for (size_t i = 0; retired && i < num_old && retired[i]; i++)
+            munmap(retired[i], old_entries[i].end - old_entries[i].start);
+        free(staged);
+        free(retired);
+        free(new_entries);
+        free(header);
+        close(new_fd);
+        return EXIT_FAILURE;
+    }
+
+    size_t moved = 0;
+    while (moved < num_old &&
+           move_region((void *)old_entries[moved].start,
+                       old_entries[moved].end - old_entries[moved].start, retired[moved]) == 0)
+        moved++;
+    if (moved < num_old) {
+        // nothing of the new image is in place yet: put the old one back
+        perror("Error moving region out of the way");
+        for (size_t i = 0; i < moved; i++)
+            move_region(retired[i], old_entries[i].end - old_entries[i].start,
+                        (void *)old_entries[i].start);
+        mm_replace_end();
+        for (size_t i = moved; i < num_old; i++)
+            munmap(retired[i], old_entries[i].end - old_entries[i].start);
+        for (size_t i = 0; i < num_entries; i++)
+            munmap(staged[i], entries[i].end - entries[i].start);
+        free(staged);
+        free(retired);
+        free(new_entries);
+        free(header);
+        close(new_fd);
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < num_entries; i++) {
+        size_t size = entries[i].end - entries[i].start;
+        if (move_region(staged[i], size, (void *)entries[i].start) != 0) {
+            // the old image is gone and the new one is incomplete
+            perror("Error moving region into place");
+            mm_replace_end();
+            fprintf(stderr, "Fatal error: subcontext %s is half replaced, unmapping it\n",
+                    subctx->img_file);
+            for (size_t j = 0; j < num_entries; j++)
+                munmap(j < i ? (void *)entries[j].start : staged[j],
+                       entries[j].end - entries[j].start);
+            for (size_t j = 0; j < num_old; j++)
+                munmap(retired[j], old_entries[j].end - old_entries[j].start);
+            // the old image's addresses are not ours any more
+            subctx->num_entries = 0;
+            unmap_subcontext(fd);
+            free(staged);
+            free(retired);
+            free(new_entries);
+            free(header);
+            close(new_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // per-entry state belongs to the old entries
+    release_checks(subctx);
+    mm_reset_release(subctx);
+    if (subctx->lazy)
+        free(subctx->lazy->state);
+    free(subctx->lazy);
+    subctx->lazy = NULL;
+    free(subctx->header);
+    subctx->entries = new_entries;
+    subctx->num_entries = num_entries;
+    subctx->header = header;
+    subctx->base_addr = (void *)new_entries[0].start;
+    subctx->total_size = new_entries[num_entries - 1].end - new_entries[0].start;
+    if (setup_call_buffer(subctx) != 0)
+        fprintf(stderr, "Warning: %s has no call buffer\n", new_img);
+    dup2(new_fd, fd);
+    mm_trace(SBC_TRACE_REPLACE, SBC_CTX_CLIENT, mm_trace_ctx(subctx), subctx->base_addr,
+             pause_start);
+    mm_replace_end();
+
+    for (size_t i = 0; i < num_old; i++)
+        munmap(retired[i], old_entries[i].end - old_entries[i].start);
+    free(old_entries);
+    close(new_fd);
+    free(staged);
+    free(retired);
+    printf("Replaced subcontext %s (%zu regions)\n", subctx->img_file, num_entries);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Replace the image of the subcontext open as fd with new_img while the
+ * client keeps running.  The new image is mapped and prefaulted at
+ * temporary addresses first; only then are transitions held off, and once
+ * no thread is inside the subcontext its regions are moved into place with
+ * mremap, which replaces the old mappings in one step each.  The pause is
+ * a handful of system calls per region, however large the image.
+ *
+ * fd stays the subcontext's handle (it refers to new_img afterwards), the
+ * subcontext keeps its name, counters and call buffer, and the new image's
+ * state is the one it was snapshotted with: nothing carries over from the
+ * old image.  Returns EXIT_SUCCESS, or EXIT_FAILURE with the old image
+ * still mapped.
+ */
+int sbc_replace(int fd, const char *new_img) {
+    wait_pending(fd);
+    mm_lock_mappings();
+    int ret = replace_locked(fd, new_img);
+    mm_unlock_mappings();
+    return ret;
+}
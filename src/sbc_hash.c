@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "vm_sbc.h"
+
+/*
+ * The page hash behind image checksums (see sbc_write_image and the lazy
+ * verification in sbc_mm.c).  It is built like the XXH3 long-input loop:
+ * eight 64-bit lanes, each taking a 32x32->64 bit product of its input
+ * word mixed with a key and the input word of its neighbour, which maps
+ * directly onto SSE2 (two lanes per instruction) and wider vector units.
+ * The client runs it inside the SIGSEGV handler, so it lives with the
+ * matchmaker's code.  Not a cryptographic hash: it catches corrupt and
+ * truncated images, not a deliberate forgery.
+ */
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+
+static const uint64_t hash_keys[8] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL,
+    0x1f67b3b7a4a44072ULL, 0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+    0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static SBC_MM_TEXT uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+/* hash len bytes at data; len must be a multiple of 64, as pages are */
+SBC_MM_TEXT ulong sbc_page_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t acc[8] = { PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_1 ^ PRIME64_2,
+                        PRIME64_2 ^ PRIME64_3, PRIME64_1 ^ PRIME64_3, PRIME64_1, PRIME64_2 };
+
+#if defined(__SSE2__)
+    __m128i a[4], k[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *)&acc[2 * i]);
+        k[i] = _mm_loadu_si128((const __m128i *)&hash_keys[2 * i]);
+    }
+    for (size_t off = 0; off + 64 <= len; off += 64) {
+        for (int i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(p + off + 16 * i));
+            __m128i x = _mm_xor_si128(d, k[i]);
+            __m128i prod = _mm_mul_epu32(x, _mm_srli_epi64(x, 32));
+            // every lane also takes the input word of its neighbour
+            a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            a[i] = _mm_add_epi64(a[i], prod);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)&acc[2 * i], a[i]);
+#else
+    for (size_t off = 0; off + 64 <= len; off += 64) {
+        uint64_t w[8];
+        memcpy(w, p + off, sizeof(w));
+        for (int i = 0; i < 8; i++) {
+            uint64_t x = w[i] ^ hash_keys[i];
+            acc[i ^ 1] += w[i];
+            acc[i] += (x & 0xffffffffULL) * (x >> 32);
+        }
+    }
+#endif
+
+    uint64_t h = len * PRIME64_1;
+    for (int i = 0; i < 8; i += 2) {
+        __uint128_t m = (__uint128_t)(acc[i] ^ hash_keys[i]) * (acc[i + 1] ^ hash_keys[i + 1]);
+        h += (uint64_t)m ^ (uint64_t)(m >> 64);
+    }
+    return avalanche(h);
+}
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "vm_sbc.h"
+
+/*
+ * Descriptor passing over AF_UNIX sockets.  Servers use this to hand
+ * in-memory images (see create_image_memfd) to a local broker, and clients
+ * use it to fetch them again, so a snapshot never has to touch the disk.
+ */
+
+/* broker protocol operations */
+#define BROKER_PUBLISH 1
+#define BROKER_FETCH   2
+#define BROKER_STOP    3
+#define BROKER_OK      4
+#define BROKER_ERR     5
+
+typedef struct broker_msg {
+    int  op;
+    char name[SBC_NAME_LEN];
+} BrokerMsg;
+
+/* the image descriptors a broker currently holds */
+typedef struct broker_entry {
+    char name[SBC_NAME_LEN];
+    int  fd;
+} BrokerEntry;
+
+static int send_msg(int sock, const BrokerMsg *msg, int fd) {
+    struct iovec iov = { .iov_base = (void *)msg, .iov_len = sizeof(*msg) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    // attach the descriptor as SCM_RIGHTS ancillary data
+    if (fd >= 0) {
+        memset(&ctrl, 0, sizeof(ctrl));
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)sizeof(*msg)) {
+        perror("Error sending message");
+        return -1;
+    }
+    return 0;
+}
+
+/* receive a message; *fd is set to the passed descriptor or -1 */
+static int recv_msg(int sock, BrokerMsg *msg, int *fd) {
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    *fd = -1;
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)sizeof(*msg)) {
+        if (n == -1)
+            perror("Error receiving message");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    msg->name[SBC_NAME_LEN - 1] = '\0';
+    return 0;
+}
+
+/*
+ * Send fd over a connected AF_UNIX socket together with a name.
+ */
+int sbc_send_fd(int sock, int fd, const char *name) {
+    BrokerMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = BROKER_PUBLISH;
+    strncpy(msg.name, name, SBC_NAME_LEN - 1);
+    return send_msg(sock, &msg, fd);
+}
+
+/*
+ * Receive a descriptor sent with sbc_send_fd().  The name it was sent
+ * with is copied into name if that is non-NULL.
+ * Returns the received descriptor or -1.
+ */
+int sbc_recv_fd(int sock, char *name, size_t name_len) {
+    BrokerMsg msg;
+    int fd;
+    if (recv_msg(sock, &msg, &fd) != 0)
+        return -1;
+    if (name && name_len > 0) {
+        strncpy(name, msg.name, name_len - 1);
+        name[name_len - 1] = '\0';
+    }
+    return fd;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * Connect to the AF_UNIX stream socket at path, as served by a broker or
+ * a zygote.  Returns the connected socket or -1.
+ */
+int sbc_ipc_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) != 0)
+        return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    // the server may still be starting up, so retry briefly before giving up
+    for (int attempt = 0; ; attempt++) {
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return sock;
+        if ((errno != ENOENT && errno != ECONNREFUSED) || attempt >= 100) {
+            close(sock);
+            return -1;
+        }
+        usleep(10000);
+    }
+}
+
+/*
+ * Create an AF_UNIX stream socket listening at path, replacing whatever
+ * socket was left there.  Returns the listening socket or -1.
+ */
+int sbc_ipc_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) != 0)
+        return -1;
+
+    int lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lsock == -1) {
+        perror("Error creating socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(lsock, 16) == -1) {
+        perror("Error binding socket");
+        close(lsock);
+        return -1;
+    }
+    return lsock;
+}
+
+/* send a single request to the broker and wait for its reply */
+static int broker_request(const char *path, int op, const char *name,
+                          int send_fd, int *reply_fd) {
+    int sock = sbc_ipc_connect(path);
+    if (sock == -1) {
+        perror("Error connecting to broker");
+        return -1;
+    }
+
+    BrokerMsg msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op = op;
+    if (name)
+        strncpy(msg.name, name, SBC_NAME_LEN - 1);
+
+    int fd = -1;
+    if (send_msg(sock, &msg, send_fd) != 0 || recv_msg(sock, &msg, &fd) != 0) {
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    if (msg.op != BROKER_OK) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (reply_fd)
+        *reply_fd = fd;
+    else if (fd != -1)
+        close(fd);
+    return 0;
+}
+
+/*
+ * Hand an image descriptor to the broker listening on path under the given
+ * name.  The broker keeps its own reference, so the caller may close fd.
+ */
+int sbc_broker_publish(const char *path, const char *name, int fd) {
+    return broker_request(path, BROKER_PUBLISH, name, fd, NULL);
+}
+
+/*
+ * Fetch the image published under name from the broker listening on path.
+ * Returns a new descriptor for the image (suitable for map_subcontext_fd)
+ * or -1 if the broker does not know the name.
+ */
+int sbc_broker_fetch(const char *path, const char *name) {
+    int fd = -1;
+    if (broker_request(path, BROKER_FETCH, name, -1, &fd) != 0)
+        return -1;
+    return fd;
+}
+
+/*
+ * Ask the broker listening on path to exit.
+ */
+int sbc_broker_stop(const char *path) {
+    return broker_request(path, BROKER_STOP, NULL, -1, NULL);
+}
+
+/*
+ * Run a broker on the AF_UNIX socket path until it receives a stop
+ * request.  Published descriptors are kept by name; republishing a name
+ * replaces the previous image.  Requests are served one at a time.
+ */
+int sbc_broker_run(const char *path) {
+    int lsock = sbc_ipc_listen(path);
+    if (lsock == -1)
+        return -1;
+
+    BrokerEntry entries[MAX_IMG_FILES];
+    size_t num_entries = 0;
+    int running = 1;
+
+    while (running) {
+        int conn = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error accepting broker connection");
+            break;
+        }
+
+        BrokerMsg msg;
+        int fd;
+        if (recv_msg(conn, &msg, &fd) != 0) {
+            close(conn);
+            continue;
+        }
+
+        // look up the name in the table
+        size_t idx = num_entries;
+        for (size_t i = 0; i < num_entries; i++) {
+            if (strcmp(entries[i].name, msg.name) == 0) {
+                idx = i;
+                break;
+            }
+        }
+
+        int reply_fd = -1;
+        int op = msg.op;
+        msg.op = BROKER_ERR;
+        switch (op) {
+        case BROKER_PUBLISH:
+            if (fd == -1)
+                break;
+            if (idx < num_entries) {
+                close(entries[idx].fd);
+            } else if (num_entries < MAX_IMG_FILES) {
+                strcpy(entries[num_entries].name, msg.name);
+                idx = num_entries++;
+            } else {
+                fprintf(stderr, "Broker is full, dropping image %s\n", msg.name);
+                close(fd);
+                break;
+            }
+            entries[idx].fd = fd;
+            fd = -1;
+            msg.op = BROKER_OK;
+            break;
+        case BROKER_FETCH:
+            if (idx < num_entries) {
+                reply_fd = entries[idx].fd;
+                msg.op = BROKER_OK;
+            }
+            break;
+        case BROKER_STOP:
+            running = 0;
+            msg.op = BROKER_OK;
+            break;
+        }
+        if (fd != -1)
+            close(fd);
+
+        send_msg(conn, &msg, reply_fd);
+        close(conn);
+    }
+
+    for (size_t i = 0; i < num_entries; i++)
+        close(entries[i].fd);
+    close(lsock);
+    unlink(path);
+    return 0;
+}
@@ -1,12 +1,34 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <link.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "vm_sbc.h"
 
+#if SBC_VERBOSE
+#define mm_log(...) printf(__VA_ARGS__)
+#else
+#define mm_log(...) ((void)0)
+#endif
+
+#if SBC_TRACE
+#define mm_tracing() __builtin_expect(*trace_enabled, 0)
+#else
+#define mm_tracing() 0
+#endif
+
 /* Global state for mapped subcontexts and client executable regions.  These
  * are used by the permission switching code in the segfault handler. */
 MappedSubcontext mapped_subcontexts[MAX_IMG_FILES];
@@ -15,9 +37,85 @@ ClientRegion    client_regions[MAX_ENTRIES];
 size_t          num_client_regions = 0;
 static int      segv_handler_installed = 0;
 static int      mm_initialized = 0;
+static int      client_exec_enabled = 1;
+static long     mm_page_size = 4096;
+
+/* whether newly mapped images are verified against their checksums, as
+ * their pages are first touched; SBC_VERIFY=0 in the environment turns it
+ * off */
+static int      verify_images = 1;
+
+/* sbc_replace swaps a subcontext's mappings while other threads may be
+ * faulting: mm_replacing holds new transitions off for the duration and
+ * mm_in_handler counts the handlers that got past that check. */
+static volatile int mm_replacing = 0;
+static volatile int mm_in_handler = 0;
+
+/* Each thread's transition stack: the context it is running in and the
+ * callers it will return to, most recent on top, NULL standing for the
+ * client.  A fault on the caller on top is a return and goes straight
+ * back to it; anything else is a call and pushes the current context. */
+static __thread MappedSubcontext *mm_current = NULL;
+static __thread MappedSubcontext *mm_stack[SBC_MM_STACK_DEPTH];
+static __thread int               mm_depth = 0;
+
+/* Every caller on a transition stack is counted in its on_stack, so that a
+ * subcontext is not replaced while some thread is still to return into it */
+static SBC_MM_TEXT void stack_push(MappedSubcontext *caller) {
+    if (caller)
+        __atomic_fetch_add(&caller->on_stack, 1, __ATOMIC_RELAXED);
+    mm_stack[mm_depth++] = caller;
+}
+
+static SBC_MM_TEXT void stack_forget(MappedSubcontext *caller) {
+    if (caller)
+        __atomic_fetch_sub(&caller->on_stack, 1, __ATOMIC_RELAXED);
+}
+
+static SBC_MM_TEXT void stack_clear(void) {
+    while (mm_depth > 0)
+        stack_forget(mm_stack[--mm_depth]);
+}
+
+/* Threads that run client code alongside subcontext calls without ever
+ * calling into a subcontext, like the one mapping an image in the
+ * background.  Their faults on the client's disabled code are not returns
+ * to it: they wait for the code to be executable again. */
+static __thread int mm_bystander = 0;
+
+/* Matchmaker counters.  They live in a shared memory object so sbcstat can
+ * read them from outside; if that cannot be created they are kept in
+ * local_stats instead so the handler never has to check. */
+static StatsPage  local_stats;
+static StatsPage *stats = &local_stats;
+
+/* The transition trace.  trace_enabled points at the enabled flag of the
+ * shared trace buffer once it exists, so that sbctrace can switch tracing
+ * on and off in a running process; until then it points at a constant 0. */
+static TraceBuffer  *trace = NULL;
+static int           trace_never = 0;
+static volatile int *trace_enabled = &trace_never;
+static __thread int  trace_ring_idx = -1;
+
+/* Idle reclaim.  The sweep walks the mapped subcontexts from a thread of
+ * its own, so mapping, unmapping and replacing take mm_mappings_lock to
+ * keep their metadata from changing under it (recursively: a failed
+ * replacement unmaps).  The handler never does: what it races with is
+ * only advice to the kernel. */
+#define MM_LOCK_INITIALIZER PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+static pthread_mutex_t mm_mappings_lock = MM_LOCK_INITIALIZER;
+static SbcReclaimConfig reclaim_config;
+static pthread_t        reclaim_thread;
+static pid_t            reclaim_pid = 0;  // the process the sweeper runs in
+static volatile int     reclaim_running = 0;
+
+/* the pages holding the matchmaker's own code (see SBC_MM_TEXT) */
+extern char __start_sbc_mm_text[], __stop_sbc_mm_text[];
 
 /* Forward declarations */
 static void segv_handler(int sig, siginfo_t *info, void *context);
+static void stats_page_init(void);
+static void trace_buffer_init(void);
 
 /* Initialize the client library and install the segfault handler
  * (i.e., the Matchmaker) automatically
@@ -28,6 +126,13 @@ void sbc_client_init() {
     memset(client_regions, 0, sizeof(client_regions));
     num_mapped_subcontexts = 0;
     num_client_regions = 0;
+    mm_page_size = sysconf(_SC_PAGESIZE);
+    const char *verify = getenv("SBC_VERIFY");
+    if (verify)
+        verify_images = atoi(verify) != 0;
+
+    stats_page_init();
+    trace_buffer_init();
 
     if (record_client_memory_regions() != 0) {
         fprintf(stderr, "Warning: Failed to record client memory regions\n");
@@ -56,6 +161,84 @@ int request_map(const char *img_fname) {
     return map_subcontext(img_fname);
 }
 
+/* Request mapping of a server image with SBC_MAP_* flags.  A subcontext
+ * mapped SBC_MAP_RELAXED is trusted not to call back into client code, so
+ * the client's code is left executable while it runs and its transitions
+ * only change the subcontext's own protections.  With SBC_MAP_LAZY only the
+ * addresses of the image's regions are reserved at first, and each region
+ * is mapped from the image when it is first touched, so that images with
+ * many regions map in constant time and only cost the mappings they use. */
+int request_map_ex(const char *img_fname, int flags) {
+    if (!mm_initialized) {
+        init();
+    }
+    return map_subcontext_ex(img_fname, flags);
+}
+
+/* Request mapping of a server image in the background; the returned
+ * handle can be used right away.  See map_subcontext_async */
+int request_map_async(const char *img_fname, int flags) {
+    if (!mm_initialized) {
+        init();
+    }
+    return map_subcontext_async(img_fname, flags);
+}
+
+/* dl_iterate_phdr's counts of objects loaded and unloaded, as of the last
+ * time the client regions were brought up to date with them */
+static unsigned long loaded_adds = 0;
+static unsigned long loaded_subs = 0;
+
+/* whether a line of /proc/self/maps names one of the shared libraries
+ * the subcontexts run as well, whose code is left executable */
+static int is_library_line(const char *line) {
+    return strstr(line, ".so") || strstr(line, "libc") || strstr(line, "ld-") ||
+           strstr(line, "[vdso]") || strstr(line, "[vvar]") || strstr(line, "[vsyscall]");
+}
+
+/* insert a region into the table, keeping it sorted */
+static int add_client_region(unsigned long start, unsigned long end, int prot, int is_library,
+                             int origin) {
+    if (num_client_regions >= MAX_ENTRIES)
+        return -1;
+    size_t i = num_client_regions;
+    while (i > 0 && (unsigned long)client_regions[i - 1].start > start)
+        i--;
+    memmove(&client_regions[i + 1], &client_regions[i],
+            (num_client_regions - i) * sizeof(ClientRegion));
+    client_regions[i].start = (void *)start;
+    client_regions[i].end   = (void *)end;
+    client_regions[i].original_prot = prot;
+    client_regions[i].is_library = is_library;
+    client_regions[i].origin = origin;
+    num_client_regions++;
+    return 0;
+}
+
+static void remove_client_region(size_t idx) {
+    memmove(&client_regions[idx], &client_regions[idx + 1],
+            (num_client_regions - idx - 1) * sizeof(ClientRegion));
+    num_client_regions--;
+}
+
+/* whether [start, end) overlaps a region in the table */
+static int overlaps_client_region(unsigned long start, unsigned long end) {
+    for (size_t i = 0; i < num_client_regions; i++) {
+        if ((unsigned long)client_regions[i].start < end &&
+            (unsigned long)client_regions[i].end > start)
+            return 1;
+    }
+    return 0;
+}
+
+/* a dl_iterate_phdr callback that only reads the load and unload counts */
+static int read_load_counts(struct dl_phdr_info *info, size_t size, void *arg) {
+    unsigned long *counts = arg;
+    counts[0] = info->dlpi_adds;
+    counts[1] = info->dlpi_subs;
+    return 1;
+}
+
 /* these functions help to manage permissions */
 int record_client_memory_regions(void) {
     FILE *maps_file = fopen("/proc/self/maps", "r");
@@ -71,6 +254,7 @@ int record_client_memory_regions(void) {
         unsigned long start, end;
         char perms[5];
         if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3) {
+            int prot = perms_to_prot(perms), is_library = is_library_line(line);
             if (perms[2] == 'x') {
                 /* when enabling or disabling executable permissions, we skip [vdso]
                  * and [vsyscall] to avoid errors. specifically, changing
@@ -82,72 +266,178 @@ int record_client_memory_regions(void) {
                     continue;
                 }
 
-                client_regions[num_client_regions].start = (void *)start;
-                client_regions[num_client_regions].end   = (void *)end;
-                client_regions[num_client_regions].original_prot =
-                    perms_to_prot(perms);
-                num_client_regions++;
+                /* the pages holding the matchmaker itself must stay
+                 * executable, otherwise the handler could not run once
+                 * client code has been disabled. split them out.
+                 */
+                long page_size = sysconf(_SC_PAGESIZE);
+                unsigned long mm_start = (unsigned long)__start_sbc_mm_text & ~(page_size - 1);
+                unsigned long mm_end = ((unsigned long)__stop_sbc_mm_text + page_size - 1) &
+                                       ~(page_size - 1);
+                if (mm_start < end && mm_end > start) {
+                    if (start < mm_start)
+                        add_client_region(start, mm_start, prot, is_library, SBC_REGION_INITIAL);
+                    if (mm_end < end)
+                        add_client_region(mm_end, end, prot, is_library, SBC_REGION_INITIAL);
+                    continue;
+                }
+                add_client_region(start, end, prot, is_library, SBC_REGION_INITIAL);
             }
         }
     }
     fclose(maps_file);
+
+    // objects loaded from here on are picked up by sbc_sync_client_regions
+    unsigned long counts[2] = { 0, 0 };
+    dl_iterate_phdr(read_load_counts, counts);
+    loaded_adds = counts[0];
+    loaded_subs = counts[1];
     printf("Recorded %zu client executable regions\n", num_client_regions);
     return 0;
 }
 
-int disable_client_execute_permissions(void) {
+/* read the cycle counter used for the transition histograms */
+static inline SBC_MM_TEXT unsigned long mm_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+static inline SBC_MM_TEXT void stats_add(ulong *counter, ulong n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* the stats slot of subctx, or NULL if none was free when it was mapped */
+static inline SBC_MM_TEXT SubcontextStats *subctx_stats(const MappedSubcontext *subctx) {
+    return subctx->stats_idx < 0 ? NULL : &stats->subctx[subctx->stats_idx];
+}
+
+/* add n to a counter of subctx's stats slot, if it has one */
+#define subctx_stats_add(subctx, counter, n) do {          \
+        SubcontextStats *st_ = subctx_stats(subctx);       \
+        if (st_)                                           \
+            stats_add(&st_->counter, n);                   \
+    } while (0)
+
+/* the clock idle times are measured with.  Coarse is plenty and cheap
+ * enough to read on every transition */
+SBC_MM_TEXT unsigned long mm_coarse_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static SBC_MM_TEXT void stats_record_transition(MappedSubcontext *subctx, unsigned long cycles) {
+    int bucket = 63 - __builtin_clzl(cycles | 1);
+    if (bucket >= SBC_HIST_BUCKETS)
+        bucket = SBC_HIST_BUCKETS - 1;
+    subctx_stats_add(subctx, cycles_hist[bucket], 1);
+}
+
+SBC_MM_TEXT int disable_client_execute_permissions(void) {
     for (size_t i = 0; i < num_client_regions; i++) {
         ClientRegion *region = &client_regions[i];
-        if (is_library_address(region->start))
+        if (region->is_library)
             continue;
         size_t size = (char*)region->end - (char*)region->start;
         int new_prot = region->original_prot & ~PROT_EXEC;
+        stats_add(&stats->client_mprotect_calls, 1);
         if (mprotect(region->start, size, new_prot) == -1) {
             perror("Error disabling client execute permissions");
             return -1;
         }
     }
+    client_exec_enabled = 0;
     return 0;
 }
 
-int enable_client_execute_permissions(void) {
+SBC_MM_TEXT int enable_client_execute_permissions(void) {
     for (size_t i = 0; i < num_client_regions; i++) {
         ClientRegion *region = &client_regions[i];
-        if (is_library_address(region->start))
+        if (region->is_library)
             continue;
         size_t size = (char*)region->end - (char*)region->start;
+        stats_add(&stats->client_mprotect_calls, 1);
         if (mprotect(region->start, size, region->original_prot) == -1) {
             perror("Error re-enabling client execute permissions");
             return -1;
         }
     }
+    client_exec_enabled = 1;
     return 0;
 }
 
-int enable_subcontext_execute_permissions(void *fault_addr) {
-    MappedSubcontext *subctx = find_subcontext_by_addr(fault_addr);
-    if (!subctx)
-        return -1;
+static inline SBC_MM_TEXT int page_pending(const RegionCheck *check, size_t page) {
+    return __atomic_load_n(&check->pending[page / 8], __ATOMIC_ACQUIRE) & (1 << (page % 8));
+}
+
+static inline SBC_MM_TEXT int page_dirty(const DirtyMap *map, size_t page) {
+    return map->bits[page / 8] & (1 << (page % 8));
+}
+
+/* change the protection of one entry of a subcontext. pages that have not
+ * been verified yet stay inaccessible, so only the verified runs between
+ * them are changed.  Plain read-write entries are readable and writable
+ * whether their subcontext runs or not, so switching one to read-write
+ * leaves it (and any write tracking in it) alone */
+static SBC_MM_TEXT int protect_entry(MappedSubcontext *subctx, size_t idx, int prot) {
+    Entry *entry = &subctx->entries[idx];
+    size_t region_size = entry->end - entry->start;
+    // a region that is only reserved gets its protection once it is mapped
+    if (subctx->lazy &&
+        __atomic_load_n(&subctx->lazy->state[idx], __ATOMIC_ACQUIRE) != SBC_LAZY_MAPPED)
+        return 0;
+    if (prot == (PROT_READ | PROT_WRITE) && perms_to_prot(entry->perms) == prot)
+        return 0;
+    subctx_stats_add(subctx, mprotect_calls, 1);
+    if (!subctx->checks || subctx->checks[idx].num_pending == 0)
+        return mprotect((void*)entry->start, region_size, prot);
+
+    const RegionCheck *check = &subctx->checks[idx];
+    size_t pages = region_size / mm_page_size;
+    size_t run = 0;
+    for (size_t p = 0; p <= pages; p++) {
+        if (p < pages && !page_pending(check, p))
+            continue;
+        if (run < p && mprotect((char *)entry->start + run * mm_page_size,
+                                (p - run) * mm_page_size, prot) == -1)
+            return -1;
+        run = p + 1;
+    }
+    return 0;
+}
+
+/* give one subcontext its recorded permissions, or take execute away */
+static SBC_MM_TEXT int protect_subcontext(MappedSubcontext *subctx, int executable) {
     for (size_t i = 0; i < subctx->num_entries; i++) {
         Entry *entry = &subctx->entries[i];
-        size_t region_size = entry->end - entry->start;
-        int prot = perms_to_prot(entry->perms);
-        if (mprotect((void*)entry->start, region_size, prot) == -1) {
-            perror("Error enabling subcontext permissions");
+        int prot = executable ? perms_to_prot(entry->perms) : PROT_READ | PROT_WRITE;
+        if (protect_entry(subctx, i, prot) == -1) {
+            perror(executable ? "Error enabling subcontext permissions"
+                              : "Error disabling subcontext permissions");
             return -1;
         }
     }
-    subctx->is_active = 1;
+    subctx->is_active = executable;
     return 0;
 }
 
-int disable_all_subcontext_execute_permissions(void) {
+SBC_MM_TEXT int enable_subcontext_execute_permissions(void *fault_addr) {
+    MappedSubcontext *subctx = find_subcontext_by_addr(fault_addr);
+    if (!subctx)
+        return -1;
+    return protect_subcontext(subctx, 1);
+}
+
+SBC_MM_TEXT int disable_all_subcontext_execute_permissions(void) {
     for (size_t i = 0; i < num_mapped_subcontexts; i++) {
         MappedSubcontext *subctx = &mapped_subcontexts[i];
         for (size_t j = 0; j < subctx->num_entries; j++) {
-            Entry *entry = &subctx->entries[j];
-            size_t region_size = entry->end - entry->start;
-            if (mprotect((void*)entry->start, region_size, PROT_READ | PROT_WRITE) == -1) {
+            if (protect_entry(subctx, j, PROT_READ | PROT_WRITE) == -1) {
                 perror("Error disabling subcontext permissions");
                 return -1;
             }
@@ -157,7 +447,16 @@ int disable_all_subcontext_execute_permissions(void) {
     return 0;
 }
 
-MappedSubcontext* find_subcontext_by_addr(void *addr) {
+static SBC_MM_TEXT int subcontext_contains(const MappedSubcontext *subctx, void *addr) {
+    for (size_t j = 0; j < subctx->num_entries; j++) {
+        const Entry *entry = &subctx->entries[j];
+        if ((unsigned long)addr >= entry->start && (unsigned long)addr < entry->end)
+            return 1;
+    }
+    return 0;
+}
+
+SBC_MM_TEXT MappedSubcontext* find_subcontext_by_addr(void *addr) {
     for (size_t i = 0; i < num_mapped_subcontexts; i++) {
         MappedSubcontext *subctx = &mapped_subcontexts[i];
         for (size_t j = 0; j < subctx->num_entries; j++) {
@@ -169,40 +468,42 @@ MappedSubcontext* find_subcontext_by_addr(void *addr) {
     return NULL;
 }
 
-int is_library_address(void *addr) {
-    FILE *maps_file = fopen("/proc/self/maps", "r");
-    if (!maps_file)
-        return 0;
-    char line[256];
-    int is_lib = 0;
-    while (fgets(line, sizeof(line), maps_file) != NULL) {
-        unsigned long start, end;
-        if (sscanf(line, "%lx-%lx", &start, &end) == 2) {
-            if ((unsigned long)addr >= start && (unsigned long)addr < end) {
-                if (strstr(line, ".so") || strstr(line, "libc") ||
-                    strstr(line, "ld-") || strstr(line, "[vdso]") ||
-                    strstr(line, "[vvar]") || strstr(line, "[vsyscall]")) {
-                    is_lib = 1;
-                }
-                break;
-            }
-        }
+/* the client region containing addr, found by binary search of the table */
+static SBC_MM_TEXT ClientRegion *find_client_region(void *addr) {
+    size_t lo = 0, hi = num_client_regions;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (addr < client_regions[mid].start)
+            hi = mid;
+        else if (addr >= client_regions[mid].end)
+            lo = mid + 1;
+        else
+            return &client_regions[mid];
     }
-    fclose(maps_file);
-    return is_lib;
+    return NULL;
+}
+
+static SBC_MM_TEXT int is_client_address(void *addr) {
+    return find_client_region(addr) != NULL;
+}
+
+/* whether addr is in the code of a shared library the subcontexts run
+ * too.  Regions are classified once, when they join the table, so this
+ * never has to look at /proc/self/maps */
+SBC_MM_TEXT int is_library_address(void *addr) {
+    ClientRegion *region = find_client_region(addr);
+    return region && region->is_library;
 }
 
 /* the actual segmentation fault handler */
-static void segv_handler(int sig, siginfo_t *info, void *context) {
+static SBC_MM_TEXT void segv_handler(int sig, siginfo_t *info, void *context) {
     void *fault_addr = info->si_addr;
-    printf("SEGV handler triggered at address: %p\n", fault_addr);
-    mm_handle_segv(fault_addr);
+    mm_log("SEGV handler triggered at address: %p\n", fault_addr);
 
-    /* if the address does not belong to any mapped subcontext, this handler
-     * cannot resolve the fault so we re-raise SIGSEGV with the default so
-     * that the process does not endlessly loop in the handler.
+    /* if this handler cannot resolve the fault, re-raise SIGSEGV with the
+     * default so that the process does not endlessly loop in the handler.
      */
-    if (!find_subcontext_by_addr(fault_addr)) {
+    if (!mm_handle_segv(fault_addr)) {
         struct sigaction sa = {0};
         sa.sa_handler = SIG_DFL;
         sigaction(SIGSEGV, &sa, NULL);
@@ -227,24 +528,1158 @@ int setup_segv_handler(void) {
     return 0;
 }
 
-/* logic for permission switching--used by the SEGV handler */
-void mm_handle_segv(void *fault_addr) {
-    if (is_library_address(fault_addr))
-        return;
+static SBC_MM_TEXT int mm_transition(void *fault_addr);
+static SBC_MM_TEXT int is_client_return(void *fault_addr);
+
+/* logic for permission switching--used by the SEGV handler.
+ * returns 1 if the fault was a transition and has been resolved, 0 if it is
+ * a genuine fault the handler should not swallow.
+ */
+SBC_MM_TEXT int mm_handle_segv(void *fault_addr) {
+    // a bystander is never a party to a transition
+    if (mm_bystander && is_client_return(fault_addr)) {
+        while (!__atomic_load_n(&client_exec_enabled, __ATOMIC_ACQUIRE))
+            sched_yield();
+        return 1;
+    }
+    // wait out a replacement in progress; the fault is then looked up
+    // against the new mappings
+    for (;;) {
+        __atomic_fetch_add(&mm_in_handler, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&mm_replacing, __ATOMIC_SEQ_CST))
+            break;
+        __atomic_fetch_sub(&mm_in_handler, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&mm_replacing, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+    int ret = mm_transition(fault_addr);
+    __atomic_fetch_sub(&mm_in_handler, 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/* take execute away from one context and give it to another; NULL is the
+ * client */
+static SBC_MM_TEXT void switch_context(MappedSubcontext *from, MappedSubcontext *to) {
+    if (from)
+        protect_subcontext(from, 0);
+    // a relaxed subcontext runs with the client's code left executable
+    if (to && !to->relaxed && client_exec_enabled)
+        disable_client_execute_permissions();
+    if (to)
+        protect_subcontext(to, 1);
+    else if (!client_exec_enabled)
+        enable_client_execute_permissions();
+    mm_current = to;
+
+    // coming back after an idle sweep: start reading back what it paged
+    // out, without waiting for it
+    if (to && __atomic_exchange_n(&to->reclaimed, 0, __ATOMIC_RELAXED) && to->prefetch_on_entry) {
+        for (size_t i = 0; i < to->num_entries; i++)
+            madvise((void *)to->entries[i].start, to->entries[i].end - to->entries[i].start,
+                    MADV_WILLNEED);
+    }
+}
+
+static SBC_MM_TEXT void count_transition(MappedSubcontext *from, MappedSubcontext *to,
+                                         void *fault_addr, unsigned long start,
+                                         unsigned long trace_start) {
+    unsigned long now = mm_coarse_clock();
+    if (to) {
+        to->last_transition_ns = now;
+        subctx_stats_add(to, transitions_in, 1);
+        subctx_stats_add(to, faults_resolved, 1);
+    }
+    if (from) {
+        from->last_transition_ns = now;
+        subctx_stats_add(from, transitions_out, 1);
+        if (!to)
+            subctx_stats_add(from, faults_resolved, 1);
+    }
+    if (to || from)
+        stats_record_transition(to ? to : from, mm_cycles() - start);
+    if (trace_start)
+        mm_trace(SBC_TRACE_TRANSITION, mm_trace_ctx(from), mm_trace_ctx(to), fault_addr,
+                 trace_start);
+}
+
+/* a fault on disabled client code */
+static SBC_MM_TEXT int is_client_return(void *fault_addr) {
+    return !client_exec_enabled && is_client_address(fault_addr) &&
+           !is_library_address(fault_addr);
+}
+
+static SBC_MM_TEXT void verify_failed(const MappedSubcontext *subctx, void *page) {
+    char msg[SMLBUFSZ];
+    int len = snprintf(msg, sizeof(msg), "Integrity check failed for page %p of subcontext %s\n",
+                       page, subctx->img_file);
+    if (len > 0)
+        write(STDERR_FILENO, msg, len < (int)sizeof(msg) ? len : (int)sizeof(msg) - 1);
+}
+
+/* map region idx of a lazily mapped subcontext over its reservation, with
+ * the protection it would have had all along: inaccessible while it has
+ * pages to verify, read-only while sbc_reset tracks writes to it.  A
+ * region another thread is mapping is waited for.  Returns 1 once the
+ * region is mapped, 0 if it already was, and -1 if it cannot be */
+static SBC_MM_TEXT int map_reserved_entry(MappedSubcontext *subctx, size_t idx) {
+    LazyMap *lazy = subctx->lazy;
+    unsigned char state = SBC_LAZY_RESERVED;
+    if (!__atomic_compare_exchange_n(&lazy->state[idx], &state, SBC_LAZY_MAPPING, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        if (state == SBC_LAZY_MAPPED)
+            return 0;
+        while (__atomic_load_n(&lazy->state[idx], __ATOMIC_ACQUIRE) == SBC_LAZY_MAPPING)
+            sched_yield();
+        return 1;
+    }
+
+    Entry *entry = &subctx->entries[idx];
+    if (map_image_entry(subctx->fd, idx, entry, lazy->writable, (void *)entry->start,
+                        MAP_FIXED) == MAP_FAILED) {
+        char msg[SMLBUFSZ];
+        int len = snprintf(msg, sizeof(msg), "Could not map region %zu of subcontext %s\n",
+                           idx, subctx->img_file);
+        if (len > 0)
+            write(STDERR_FILENO, msg, len < (int)sizeof(msg) ? len : (int)sizeof(msg) - 1);
+        __atomic_store_n(&lazy->state[idx], SBC_LAZY_RESERVED, __ATOMIC_RELEASE);
+        return -1;
+    }
+    int prot = subctx->is_active ? perms_to_prot(entry->perms) : PROT_READ | PROT_WRITE;
+    if (subctx->dirty && subctx->dirty[idx].bits)
+        prot &= ~PROT_WRITE;
+    if (subctx->checks && subctx->checks[idx].num_pending)
+        prot = PROT_NONE;
+    if (prot != (PROT_READ | PROT_WRITE))
+        mprotect((void *)entry->start, entry->end - entry->start, prot);
+    __atomic_store_n(&lazy->state[idx], SBC_LAZY_MAPPED, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&lazy->num_reserved, 1, __ATOMIC_RELAXED);
+    subctx_stats_add(subctx, regions_mapped, 1);
+    return 1;
+}
+
+/* the first touch of a region of a lazily mapped subcontext: map it.
+ * Returns 1 if the fault was in such a region and it is mapped now, -1 if
+ * it could not be mapped, and 0 if the fault is not in one */
+static SBC_MM_TEXT int map_lazy(void *fault_addr) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        MappedSubcontext *subctx = &mapped_subcontexts[i];
+        if (!subctx->lazy || !__atomic_load_n(&subctx->lazy->num_reserved, __ATOMIC_RELAXED))
+            continue;
+        for (size_t j = 0; j < subctx->num_entries; j++) {
+            Entry *entry = &subctx->entries[j];
+            if ((ulong)fault_addr >= entry->start && (ulong)fault_addr < entry->end)
+                return map_reserved_entry(subctx, j);
+        }
+    }
+    return 0;
+}
+
+/* map the regions of a lazily mapped subctx that have not been touched
+ * yet and give back the reservation between them, leaving it as if it had
+ * been mapped up front.  Returns -1 if a region cannot be mapped */
+int mm_map_reserved(MappedSubcontext *subctx) {
+    LazyMap *lazy = subctx->lazy;
+    if (!lazy)
+        return 0;
+    for (size_t j = 0; lazy->num_reserved && j < subctx->num_entries; j++) {
+        if (map_reserved_entry(subctx, j) < 0)
+            return -1;
+    }
+    if (lazy->span_end) {
+        ulong addr = lazy->span_start;
+        for (size_t j = 0; j < subctx->num_entries; j++) {
+            if (addr < subctx->entries[j].start)
+                munmap((void *)addr, subctx->entries[j].start - addr);
+            addr = subctx->entries[j].end;
+        }
+        lazy->span_start = lazy->span_end = 0;
+    }
+    return 0;
+}
+
+/* wait for the page of check being verified by another thread; the
+ * access that faulted is then retried */
+static SBC_MM_TEXT int wait_verified(RegionCheck *check) {
+    while (__atomic_load_n(&check->verifying, __ATOMIC_ACQUIRE))
+        sched_yield();
+    return 1;
+}
+
+/* the first touch of a page that has not been verified yet: check it
+ * against the image's checksum and then give it the protection the rest
+ * of its entry has.  The page stays inaccessible and pending until it has
+ * passed, as it is hashed through a mapping of its own from the image, and
+ * pages of a region are verified one at a time.  Returns 1 if the page was
+ * verified, -1 if it does not match, and 0 if the fault is not on such a
+ * page */
+static SBC_MM_TEXT int verify_page(void *fault_addr) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        MappedSubcontext *subctx = &mapped_subcontexts[i];
+        if (__atomic_load_n(&subctx->pages_pending, __ATOMIC_ACQUIRE) == 0)
+            continue;
+        for (size_t j = 0; j < subctx->num_entries; j++) {
+            Entry *entry = &subctx->entries[j];
+            RegionCheck *check = &subctx->checks[j];
+            if ((ulong)fault_addr < entry->start || (ulong)fault_addr >= entry->end)
+                continue;
+            size_t page = ((ulong)fault_addr - entry->start) / mm_page_size;
+            unsigned char bit = 1 << (page % 8);
+            if (__atomic_load_n(&check->num_pending, __ATOMIC_ACQUIRE) == 0 ||
+                !(__atomic_load_n(&check->pending[page / 8], __ATOMIC_ACQUIRE) & bit)) {
+                // the fault may have been on a page verified meanwhile
+                return __atomic_load_n(&check->verifying, __ATOMIC_ACQUIRE) ?
+                       wait_verified(check) : 0;
+            }
+            int unlocked = 0;
+            if (!__atomic_compare_exchange_n(&check->verifying, &unlocked, 1, 0,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return wait_verified(check);
+            if (!(__atomic_load_n(&check->pending[page / 8], __ATOMIC_ACQUIRE) & bit)) {
+                __atomic_store_n(&check->verifying, 0, __ATOMIC_RELEASE);
+                return 1;
+            }
+
+            char *addr = (char *)entry->start + page * mm_page_size;
+            void *alias = mmap(NULL, mm_page_size, PROT_READ, MAP_PRIVATE, subctx->fd,
+                               entry->offsetIntoFile + page * mm_page_size);
+            int ok = alias != MAP_FAILED &&
+                     sbc_page_hash(alias, mm_page_size) ==
+                     subctx->checksums[check->first_block + page];
+            if (alias != MAP_FAILED)
+                munmap(alias, mm_page_size);
+            if (!ok) {
+                __atomic_store_n(&check->verifying, 0, __ATOMIC_RELEASE);
+                verify_failed(subctx, addr);
+                return -1;
+            }
+            int prot = subctx->is_active ? perms_to_prot(entry->perms) : PROT_READ | PROT_WRITE;
+            if (subctx->dirty && subctx->dirty[j].bits && !page_dirty(&subctx->dirty[j], page))
+                prot &= ~PROT_WRITE;
+            mprotect(addr, mm_page_size, prot);
+            __atomic_fetch_and(&check->pending[page / 8], ~bit, __ATOMIC_RELEASE);
+            __atomic_fetch_sub(&check->num_pending, 1, __ATOMIC_RELEASE);
+            __atomic_fetch_sub(&subctx->pages_pending, 1, __ATOMIC_RELEASE);
+            subctx_stats_add(subctx, pages_verified, 1);
+            __atomic_store_n(&check->verifying, 0, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* verify every page of subctx that has not been yet, up front rather than
+ * at first touch.  Returns -1 if one does not match */
+int mm_verify_now(MappedSubcontext *subctx) {
+    for (size_t j = 0; subctx->pages_pending && j < subctx->num_entries; j++) {
+        Entry *entry = &subctx->entries[j];
+        RegionCheck *check = &subctx->checks[j];
+        for (ulong addr = entry->start; check->num_pending && addr < entry->end;
+             addr += mm_page_size) {
+            if (verify_page((void *)addr) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* the first write to a clean page of a region tracked for sbc_reset: note
+ * the page and let the write through.  Returns whether the fault was one */
+static SBC_MM_TEXT int mark_dirty(void *fault_addr) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        MappedSubcontext *subctx = &mapped_subcontexts[i];
+        if (!subctx->dirty)
+            continue;
+        for (size_t j = 0; j < subctx->num_entries; j++) {
+            Entry *entry = &subctx->entries[j];
+            DirtyMap *map = &subctx->dirty[j];
+            if (!map->bits || (ulong)fault_addr < entry->start || (ulong)fault_addr >= entry->end)
+                continue;
+            size_t page = ((ulong)fault_addr - entry->start) / mm_page_size;
+            unsigned char bit = 1 << (page % 8);
+            if (__atomic_fetch_or(&map->bits[page / 8], bit, __ATOMIC_RELAXED) & bit)
+                return 0;  // already writable, so something else
+            __atomic_fetch_add(&map->num_dirty, 1, __ATOMIC_RELAXED);
+            mprotect((char *)entry->start + page * mm_page_size, mm_page_size,
+                     PROT_READ | PROT_WRITE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static SBC_MM_TEXT int mm_transition(void *fault_addr) {
+    unsigned long start = mm_cycles();
+    unsigned long trace_start = mm_tracing() ? mm_trace_clock() : 0;
+    MappedSubcontext *current = mm_current;
+
+    // the first touch of a region that is only reserved maps it, and the
+    // access is retried: a call into the subcontext then faults again, as
+    // the transition it is
+    int mapped = map_lazy(fault_addr);
+    if (mapped)
+        return mapped > 0;
+    int verified = verify_page(fault_addr);
+    if (verified)
+        return verified > 0;
+    if (mark_dirty(fault_addr))
+        return 1;
+
+    /* a return to the caller on top of the stack: only the context being
+     * left and the one being returned to change */
+    if (mm_depth > 0) {
+        MappedSubcontext *caller = mm_stack[mm_depth - 1];
+        if (caller ? subcontext_contains(caller, fault_addr) : is_client_return(fault_addr)) {
+            mm_log("Returning to %s\n", caller ? caller->img_file : "client");
+            stack_forget(mm_stack[--mm_depth]);
+            switch_context(current, caller);
+            count_transition(current, caller, fault_addr, start, trace_start);
+            return 1;
+        }
+    }
+
     MappedSubcontext *target_subctx = find_subcontext_by_addr(fault_addr);
     if (target_subctx) {
-        disable_client_execute_permissions();
-        disable_all_subcontext_execute_permissions();
-        enable_subcontext_execute_permissions(fault_addr);
-    } else {
+        /* a fault inside the subcontext that is already executable is not a
+         * transition (e.g. a write to a read-only region) */
+        if (target_subctx->is_active) {
+            subctx_stats_add(target_subctx, faults_rejected, 1);
+            return 0;
+        }
+        mm_log("Entering subcontext %s\n", target_subctx->img_file);
+        // a chain deeper than the stack forgets its outermost caller; the
+        // return to it then takes the slow path below, and it can be
+        // replaced before then
+        if (mm_depth == SBC_MM_STACK_DEPTH) {
+            stack_forget(mm_stack[0]);
+            memmove(mm_stack, mm_stack + 1, (SBC_MM_STACK_DEPTH - 1) * sizeof(mm_stack[0]));
+            mm_depth--;
+        }
+        stack_push(current);
+        switch_context(current, target_subctx);
+        count_transition(current, target_subctx, fault_addr, start, trace_start);
+        return 1;
+    }
+
+    /* a fault on disabled client code that is not a return to the caller
+     * on top of the stack (a callback, or a return the stack lost track
+     * of): go back to the client from wherever we are */
+    if (is_client_return(fault_addr)) {
+        mm_log("Returning to client at %p\n", fault_addr);
         disable_all_subcontext_execute_permissions();
         enable_client_execute_permissions();
+        mm_current = NULL;
+        stack_clear();
+        count_transition(current, NULL, fault_addr, start, trace_start);
+        return 1;
+    }
+
+    stats_add(&stats->faults_unowned, 1);
+    return 0;
+}
+
+/* A relaxed subcontext called from the client returns without a fault,
+ * since the client's code was never made non-executable, and stays
+ * executable after the call.  The call API closes it off here once the
+ * call has returned; code calling its functions directly leaves it open
+ * until the next transition. */
+SBC_MM_TEXT void mm_leave_relaxed(void) {
+    MappedSubcontext *current = mm_current;
+    if (!current || !current->relaxed || mm_depth == 0 || mm_stack[mm_depth - 1] != NULL)
+        return;
+    unsigned long start = mm_cycles();
+    unsigned long trace_start = mm_tracing() ? mm_trace_clock() : 0;
+    mm_depth--;
+    switch_context(current, NULL);
+    count_transition(current, NULL, NULL, start, trace_start);
+}
+
+/* Mark the calling thread as a bystander (see mm_bystander).  It has to
+ * be called before the thread runs any of the client's code */
+SBC_MM_TEXT void mm_mark_bystander(void) {
+    mm_bystander = 1;
+}
+
+/* Hold off transitions until mm_replace_end, once no thread is running in
+ * subctx, is still to return into it or is in the middle of a transition.
+ * Returns -1 without holding anything off if the calling thread is itself
+ * still to return into subctx. */
+int mm_replace_begin(MappedSubcontext *subctx) {
+    // the calling thread is not running in subctx, whatever it left open
+    if (mm_current == subctx)
+        mm_leave_relaxed();
+    for (int i = 0; i < mm_depth; i++) {
+        if (mm_stack[i] == subctx)
+            return -1;
+    }
+    for (;;) {
+        __atomic_store_n(&mm_replacing, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mm_in_handler, __ATOMIC_SEQ_CST) == 0 &&
+            !__atomic_load_n(&subctx->is_active, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&subctx->on_stack, __ATOMIC_SEQ_CST) == 0)
+            return 0;
+        // a thread inside has to be able to fault its way out
+        __atomic_store_n(&mm_replacing, 0, __ATOMIC_SEQ_CST);
+        sched_yield();
     }
 }
 
+void mm_replace_end(void) {
+    __atomic_store_n(&mm_replacing, 0, __ATOMIC_RELEASE);
+}
+
+/* Hold transitions off while the client region table changes under the
+ * handler, the way mm_replace_begin does for a subcontext's mappings.
+ * mm_replace_end lets them go again. */
+static void hold_transitions(void) {
+    for (;;) {
+        __atomic_store_n(&mm_replacing, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mm_in_handler, __ATOMIC_SEQ_CST) == 0)
+            return;
+        __atomic_store_n(&mm_replacing, 0, __ATOMIC_SEQ_CST);
+        sched_yield();
+    }
+}
+
+/* a region that joins the table while a subcontext runs loses execute
+ * right away, like the rest of the client's code */
+static void protect_new_region(const ClientRegion *region) {
+    if (client_exec_enabled || region->is_library)
+        return;
+    stats_add(&stats->client_mprotect_calls, 1);
+    if (mprotect(region->start, (char *)region->end - (char *)region->start,
+                 region->original_prot & ~PROT_EXEC) == -1)
+        perror("Error disabling client execute permissions");
+}
+
+// the executable segment of a loaded object
+typedef struct loaded_segment {
+    unsigned long start, end;
+    int prot;
+    int is_library;
+} LoadedSegment;
+
+// what sync_client_regions gathers from dl_iterate_phdr
+typedef struct loaded_objects {
+    unsigned long adds, subs;
+    unsigned long client_base;  // the object sbc_dlopen loaded, or 0
+    const char *client_name;
+    LoadedSegment segs[MAX_ENTRIES];
+    size_t num_segs;
+} LoadedObjects;
+
+static int collect_segments(struct dl_phdr_info *info, size_t size, void *arg) {
+    LoadedObjects *objs = arg;
+    objs->adds = info->dlpi_adds;
+    objs->subs = info->dlpi_subs;
+    const char *name = info->dlpi_name ? info->dlpi_name : "";
+    // the main program and the vdso have been there from the start
+    if (!*name || strstr(name, "vdso"))
+        return 0;
+    // an object loaded through sbc_dlopen is the client's own code, and
+    // others are classified the way the initial scan classifies them
+    int is_library = !(objs->client_name && info->dlpi_addr == objs->client_base &&
+                       strcmp(name, objs->client_name) == 0) && is_library_line(name);
+    for (int i = 0; i < info->dlpi_phnum && objs->num_segs < MAX_ENTRIES; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X))
+            continue;
+        unsigned long start = info->dlpi_addr + ph->p_vaddr;
+        LoadedSegment *seg = &objs->segs[objs->num_segs++];
+        seg->start = start & ~(mm_page_size - 1);
+        seg->end = (start + ph->p_memsz + mm_page_size - 1) & ~(mm_page_size - 1);
+        seg->prot = PROT_EXEC | (ph->p_flags & PF_R ? PROT_READ : 0) |
+                    (ph->p_flags & PF_W ? PROT_WRITE : 0);
+        seg->is_library = is_library;
+    }
+    return 0;
+}
+
+/* Bring the client regions up to date with the objects loaded and
+ * unloaded since they last were, client_name at client_base being one
+ * sbc_dlopen has just loaded.  Nothing is read from /proc: the loader's
+ * own counts tell whether anything changed at all, and its list of
+ * objects what did.  Called with the mappings locked. */
+static int sync_client_regions(unsigned long client_base, const char *client_name) {
+    unsigned long counts[2] = { 0, 0 };
+    dl_iterate_phdr(read_load_counts, counts);
+    if (!client_name && counts[0] == loaded_adds && counts[1] == loaded_subs)
+        return 0;
+
+    LoadedObjects *objs = calloc(1, sizeof(LoadedObjects));
+    if (!objs) {
+        perror("Error tracking loaded objects");
+        return -1;
+    }
+    objs->client_base = client_base;
+    objs->client_name = client_name;
+    dl_iterate_phdr(collect_segments, objs);
+
+    int ret = 0;
+    hold_transitions();
+    // forget the segments of objects that have been unloaded
+    for (size_t i = 0; i < num_client_regions;) {
+        ClientRegion *region = &client_regions[i];
+        int loaded = region->origin != SBC_REGION_LOADED;
+        for (size_t j = 0; !loaded && j < objs->num_segs; j++)
+            loaded = objs->segs[j].start == (unsigned long)region->start &&
+                     objs->segs[j].end == (unsigned long)region->end;
+        if (loaded)
+            i++;
+        else
+            remove_client_region(i);
+    }
+    // and learn those of the new ones
+    for (size_t j = 0; j < objs->num_segs; j++) {
+        const LoadedSegment *seg = &objs->segs[j];
+        ClientRegion *region = find_client_region((void *)seg->start);
+        if (region && region->origin == SBC_REGION_LOADED &&
+            (unsigned long)region->end == seg->end) {
+            // loaded before, and now claimed by sbc_dlopen
+            if (region->is_library && !seg->is_library) {
+                region->is_library = 0;
+                protect_new_region(region);
+            }
+            continue;
+        }
+        if (overlaps_client_region(seg->start, seg->end))
+            continue;
+        if (add_client_region(seg->start, seg->end, seg->prot, seg->is_library,
+                              SBC_REGION_LOADED) != 0) {
+            fprintf(stderr, "Warning: too many client regions, not tracking %lx-%lx\n",
+                    seg->start, seg->end);
+            ret = -1;
+            continue;
+        }
+        protect_new_region(find_client_region((void *)seg->start));
+    }
+    mm_replace_end();
+
+    loaded_adds = objs->adds;
+    loaded_subs = objs->subs;
+    free(objs);
+    return ret;
+}
+
+/*
+ * Catch up with objects the client loaded or unloaded with dlopen and
+ * dlclose since the client library started, so that the matchmaker knows
+ * all of its code.  New objects are classified the way the initial scan
+ * classifies everything: shared libraries stay executable while
+ * subcontexts run.  Cheap when nothing changed.  Returns 0, or -1 if not
+ * all of them could be tracked.
+ */
+int sbc_sync_client_regions(void) {
+    mm_lock_mappings();
+    int ret = sync_client_regions(0, NULL);
+    mm_unlock_mappings();
+    return ret;
+}
+
+/*
+ * dlopen a plugin as part of the client: its code is made non-executable
+ * while subcontexts run, like the client program's own, so that a
+ * subcontext calling into it transitions back to the client.  Other
+ * objects it pulls in are tracked as sbc_sync_client_regions would.
+ * Returns the dlopen handle, or NULL.
+ */
+void *sbc_dlopen(const char *file, int mode) {
+    void *handle = dlopen(file, mode);
+    if (!handle) {
+        fprintf(stderr, "Error loading %s: %s\n", file, dlerror());
+        return NULL;
+    }
+    struct link_map *map = NULL;
+    if (mm_initialized && dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0) {
+        mm_lock_mappings();
+        sync_client_regions(map->l_addr, map->l_name);
+        mm_unlock_mappings();
+    }
+    return handle;
+}
+
+/* dlclose a handle from sbc_dlopen, and forget the code of whatever that
+ * unloaded */
+int sbc_dlclose(void *handle) {
+    int ret = dlclose(handle);
+    if (mm_initialized)
+        sbc_sync_client_regions();
+    return ret;
+}
+
+/*
+ * Make [addr, addr + len) known to the matchmaker as client code that
+ * appeared after startup without being loaded from a file, e.g. pages a
+ * JIT compiler has filled.  They are made non-executable while
+ * subcontexts run like the rest of the client's code.  prot is their
+ * protection while the client runs.  The range is rounded out to whole
+ * pages.  Returns 0, or -1 if it overlaps a region already known or the
+ * table is full.
+ */
+int sbc_register_region(void *addr, size_t len, int prot) {
+    unsigned long start = (unsigned long)addr & ~(mm_page_size - 1);
+    unsigned long end = ((unsigned long)addr + len + mm_page_size - 1) & ~(mm_page_size - 1);
+    int ret = -1;
+    mm_lock_mappings();
+    if (start < end && !overlaps_client_region(start, end)) {
+        hold_transitions();
+        ret = add_client_region(start, end, prot, 0, SBC_REGION_REGISTERED);
+        if (ret == 0)
+            protect_new_region(find_client_region((void *)start));
+        mm_replace_end();
+    }
+    mm_unlock_mappings();
+    return ret;
+}
+
+/* Forget a range given to sbc_register_region, e.g. before its pages are
+ * unmapped, giving it back its protection if a subcontext is running.
+ * Returns 0, or -1 if no such range was registered. */
+int sbc_unregister_region(void *addr, size_t len) {
+    unsigned long start = (unsigned long)addr & ~(mm_page_size - 1);
+    unsigned long end = ((unsigned long)addr + len + mm_page_size - 1) & ~(mm_page_size - 1);
+    int ret = -1;
+    mm_lock_mappings();
+    ClientRegion *region = find_client_region((void *)start);
+    if (region && region->origin == SBC_REGION_REGISTERED &&
+        (unsigned long)region->start == start && (unsigned long)region->end == end) {
+        hold_transitions();
+        if (!client_exec_enabled)
+            mprotect(region->start, end - start, region->original_prot);
+        remove_client_region(region - client_regions);
+        mm_replace_end();
+        ret = 0;
+    }
+    mm_unlock_mappings();
+    return ret;
+}
+
+/* whether sbc_reset tracks writes to an entry rather than discarding all
+ * of it: private, writable, and never executable, so that transitions
+ * leave its protection alone */
+static int reset_tracked(const Entry *entry) {
+    return entry->sharing == SBC_SHARE_PRIVATE && entry->perms[1] == 'w' && entry->perms[2] != 'x';
+}
+
+/* discard the pages of [start, start + len) the subcontext has written,
+ * so the image's contents show through again */
+static int discard(ulong start, size_t len) {
+    if (madvise((void *)start, len, MADV_DONTNEED) == -1) {
+        perror("Error discarding subcontext pages");
+        return -1;
+    }
+    return 0;
+}
+
+/* count the pages of entry j that sbc_reset_untracked covers as written,
+ * so that they stay writable until the next reset and it discards them */
+static int open_untracked(MappedSubcontext *subctx, size_t j) {
+    Entry *entry = &subctx->entries[j];
+    DirtyMap *map = &subctx->dirty[j];
+    if (!map->bits)
+        return 0;
+    for (size_t r = 0; r < subctx->num_untracked; r++) {
+        ulong start = subctx->untracked[r].start, end = subctx->untracked[r].end;
+        if (start < entry->start)
+            start = entry->start;
+        if (end > entry->end)
+            end = entry->end;
+        for (ulong addr = start; addr < end; addr += mm_page_size) {
+            size_t page = (addr - entry->start) / mm_page_size;
+            unsigned char bit = 1 << (page % 8);
+            if (__atomic_fetch_or(&map->bits[page / 8], bit, __ATOMIC_RELAXED) & bit)
+                continue;
+            __atomic_fetch_add(&map->num_dirty, 1, __ATOMIC_RELAXED);
+            // a page still to be verified is made writable once it is, and
+            // a region only reserved gets its protection once it is mapped
+            if ((subctx->checks && page_pending(&subctx->checks[j], page)) ||
+                (subctx->lazy &&
+                 __atomic_load_n(&subctx->lazy->state[j], __ATOMIC_ACQUIRE) != SBC_LAZY_MAPPED))
+                continue;
+            if (mprotect((void *)addr, mm_page_size, PROT_READ | PROT_WRITE) == -1) {
+                perror("Error opening untracked subcontext pages");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Put the writable private regions of subctx back the way the image has
+ * them, once no thread is running in it.  The first reset discards the
+ * regions whole and starts tracking writes to them; after that only the
+ * pages written since are discarded, so a reset costs what was dirtied
+ * rather than the size of the image.  Writable executable regions are not
+ * tracked and are discarded whole every time.
+ *
+ * Clean pages are kept read-only to catch the first write to them, and the
+ * kernel does not fault on a write it makes for a system call: read(2) or
+ * recv(2) into one fails with EFAULT instead.  Pages system calls write
+ * into have to be left out of tracking with sbc_reset_untracked. */
+int mm_reset(MappedSubcontext *subctx) {
+    int ret = 0;
+    if (mm_replace_begin(subctx) != 0)
+        return -1;
+
+    int first = subctx->dirty == NULL;
+    if (first) {
+        subctx->dirty = calloc(subctx->num_entries, sizeof(DirtyMap));
+        if (!subctx->dirty) {
+            mm_replace_end();
+            return -1;
+        }
+    }
+
+    for (size_t j = 0; ret == 0 && j < subctx->num_entries; j++) {
+        Entry *entry = &subctx->entries[j];
+        DirtyMap *map = &subctx->dirty[j];
+        size_t pages = (entry->end - entry->start) / mm_page_size;
+        if (entry->sharing != SBC_SHARE_PRIVATE || entry->perms[1] != 'w')
+            continue;
+        if (!reset_tracked(entry)) {
+            ret = discard(entry->start, entry->end - entry->start);
+            continue;
+        }
+
+        if (first) {
+            map->bits = calloc((pages + 63) / 64, sizeof(ulong));
+            if (!map->bits || discard(entry->start, entry->end - entry->start) != 0 ||
+                protect_entry(subctx, j, PROT_READ) != 0 || open_untracked(subctx, j) != 0)
+                ret = -1;
+            continue;
+        }
+
+        // discard the dirty runs, skipping clean stretches a word of the
+        // map at a time
+        const ulong *words = (const ulong *)map->bits;
+        size_t p = 0;
+        while (map->num_dirty && p < pages) {
+            if (p % 64 == 0 && !words[p / 64]) {
+                p += 64;
+                continue;
+            }
+            if (!page_dirty(map, p)) {
+                p++;
+                continue;
+            }
+            size_t run = p;
+            while (p < pages && page_dirty(map, p))
+                p++;
+            ulong addr = entry->start + run * mm_page_size;
+            size_t len = (p - run) * mm_page_size;
+            if (discard(addr, len) != 0 || mprotect((void *)addr, len, PROT_READ) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+        memset(map->bits, 0, (pages + 63) / 64 * sizeof(ulong));
+        map->num_dirty = 0;
+        if (ret == 0)
+            ret = open_untracked(subctx, j);
+    }
+
+    mm_replace_end();
+    return ret;
+}
+
+/* leave the pages of [start, end) in subctx out of write tracking, from
+ * the next reset on or straight away if writes are tracked already */
+int mm_reset_untracked(MappedSubcontext *subctx, ulong start, ulong end) {
+    if (subctx->num_untracked >= SBC_UNTRACKED_MAX) {
+        fprintf(stderr, "Too many untracked ranges in %s\n", subctx->img_file);
+        return -1;
+    }
+    subctx->untracked[subctx->num_untracked].start = start;
+    subctx->untracked[subctx->num_untracked].end = end;
+    subctx->num_untracked++;
+    for (size_t j = 0; subctx->dirty && j < subctx->num_entries; j++) {
+        if (open_untracked(subctx, j) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* stop tracking writes to subctx, whose regions are going away */
+void mm_reset_release(MappedSubcontext *subctx) {
+    if (subctx->dirty) {
+        for (size_t j = 0; j < subctx->num_entries; j++)
+            free(subctx->dirty[j].bits);
+        free(subctx->dirty);
+    }
+    subctx->dirty = NULL;
+}
+
 /* Finalize matchmaker */
 void finalize() {
     disable_all_subcontext_execute_permissions();
     enable_client_execute_permissions();
+    mm_current = NULL;
+    stack_clear();
 }
 
+/*
+ * Carry the matchmaker over into a child created with fork() that keeps
+ * using the subcontexts it inherited, such as a zygote's worker.  Mapped
+ * subcontexts, client regions, the handler and the calling thread's
+ * transition stack all stay valid as they are; only the stats page and
+ * trace buffer, which are published per process, are created afresh,
+ * with the same subcontexts in the same slots and the counters at zero.
+ * Images that were still being mapped in the background are settled.
+ */
+void sbc_after_fork(void) {
+    static StatsPage inherited;
+    if (!mm_initialized)
+        return;
+    memcpy(&inherited, stats, sizeof(inherited));
+    int tracing = *trace_enabled;
+
+    // only the thread that forked exists in the child, so nothing else
+    // can hold the lock or be sweeping
+    mm_replacing = 0;
+    mm_in_handler = 0;
+    mm_mappings_lock = (pthread_mutex_t)MM_LOCK_INITIALIZER;
+    reclaim_running = 0;
+    mm_pending_after_fork();
+    // nor is any other thread still to return into a subcontext
+    for (size_t i = 0; i < num_mapped_subcontexts; i++)
+        mapped_subcontexts[i].on_stack = 0;
+    for (int i = 0; i < mm_depth; i++) {
+        if (mm_stack[i])
+            mm_stack[i]->on_stack++;
+    }
+
+    stats_page_init();
+    for (int i = 0; i < MAX_IMG_FILES; i++) {
+        if (!inherited.subctx[i].in_use)
+            continue;
+        SubcontextStats *st = &stats->subctx[i];
+        memcpy(st->name, inherited.subctx[i].name, SBC_NAME_LEN);
+        st->fd = inherited.subctx[i].fd;
+        st->in_use = 1;
+    }
+    trace_buffer_init();
+    sbc_trace_enable(tracing);
+}
+
+/* the mappings lock.  The reclaim sweeper takes it while client code may
+ * not be executable, so these live in SBC_MM_TEXT */
+SBC_MM_TEXT void mm_lock_mappings(void) {
+    pthread_mutex_lock(&mm_mappings_lock);
+}
+
+SBC_MM_TEXT void mm_unlock_mappings(void) {
+    pthread_mutex_unlock(&mm_mappings_lock);
+}
+
+/*
+ * Idle reclaim
+ *
+ * The sweeper runs alongside threads that may be inside a subcontext, when
+ * client code is not executable, so its own code lives with the
+ * matchmaker's in SBC_MM_TEXT and it only calls into libc.
+ */
+
+/* memory pressure from the kernel's PSI ("some avg10", percent), or 0
+ * where that is not available */
+static SBC_MM_TEXT double memory_pressure(void) {
+    double avg10 = 0;
+    FILE *f = fopen("/proc/pressure/memory", "r");
+    if (f) {
+        if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+            avg10 = 0;
+        fclose(f);
+    }
+    return avg10;
+}
+
+/*
+ * Apply advice (MADV_COLD or MADV_PAGEOUT) to every region of each
+ * subcontext that has not been entered or left for idle_ms and was not
+ * reclaimed since.  With prefetch, the next entry into a reclaimed
+ * subcontext asks for its pages back with MADV_WILLNEED.
+ * Returns the number of subcontexts reclaimed.
+ */
+SBC_MM_TEXT int sbc_reclaim_idle(unsigned long idle_ms, int advice, int prefetch) {
+    unsigned long now = mm_coarse_clock();
+    int reclaimed = 0;
+    mm_lock_mappings();
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        MappedSubcontext *subctx = &mapped_subcontexts[i];
+        if (subctx->is_active || subctx->reclaimed ||
+            now - subctx->last_transition_ns < idle_ms * 1000000UL)
+            continue;
+        for (size_t j = 0; j < subctx->num_entries; j++) {
+            Entry *entry = &subctx->entries[j];
+            madvise((void *)entry->start, entry->end - entry->start, advice);
+        }
+        subctx->prefetch_on_entry = prefetch;
+        __atomic_store_n(&subctx->reclaimed, 1, __ATOMIC_RELAXED);
+        subctx_stats_add(subctx, reclaims, 1);
+        reclaimed++;
+    }
+    mm_unlock_mappings();
+    return reclaimed;
+}
+
+static SBC_MM_TEXT void *reclaim_sweeper(void *arg) {
+    (void)arg;
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    struct timespec interval = {
+        .tv_sec = reclaim_config.interval_ms / 1000,
+        .tv_nsec = (reclaim_config.interval_ms % 1000) * 1000000L,
+    };
+    while (reclaim_running) {
+        nanosleep(&interval, NULL);
+        int pageout = reclaim_config.pageout_pressure >= 0 &&
+                      memory_pressure() >= reclaim_config.pageout_pressure;
+        sbc_reclaim_idle(reclaim_config.idle_ms, pageout ? MADV_PAGEOUT : MADV_COLD,
+                         reclaim_config.prefetch);
+    }
+    return NULL;
+}
+
+/*
+ * Start a low-priority thread that calls sbc_reclaim_idle every
+ * config->interval_ms, with MADV_PAGEOUT while memory pressure is at or
+ * above config->pageout_pressure and MADV_COLD otherwise.
+ * Returns 0, or -1 if a sweeper is already running or cannot be started.
+ */
+int sbc_reclaim_start(const SbcReclaimConfig *config) {
+    if (reclaim_running && reclaim_pid == getpid())
+        return -1;
+    if (config->interval_ms == 0)
+        return -1;
+    reclaim_config = *config;
+    reclaim_running = 1;
+    reclaim_pid = getpid();
+    if (pthread_create(&reclaim_thread, NULL, reclaim_sweeper, NULL) != 0) {
+        perror("Error starting reclaim thread");
+        reclaim_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* stop the sweeper started by sbc_reclaim_start and wait for it */
+void sbc_reclaim_stop(void) {
+    if (!reclaim_running || reclaim_pid != getpid())
+        return;
+    reclaim_running = 0;
+    pthread_join(reclaim_thread, NULL);
+}
+
+/*
+ * Stats page management
+ */
+
+/* name of the shared memory object holding the stats of process pid */
+int sbc_stats_name(pid_t pid, char *buf, size_t len) {
+    return snprintf(buf, len, "/sbcstat.%d", (int)pid) < (int)len ? 0 : -1;
+}
+
+static void stats_page_cleanup(void) {
+    char name[SMLBUFSZ];
+    // a child that never called sbc_after_fork must not remove its parent's
+    if (stats != &local_stats && stats->pid == getpid() &&
+        sbc_stats_name(stats->pid, name, sizeof(name)) == 0)
+        shm_unlink(name);
+}
+
+/* create the shared stats page for this process. failure is not fatal,
+ * counters are then only kept locally */
+static void stats_page_init(void) {
+    static int cleanup_registered = 0;
+    char name[SMLBUFSZ];
+    pid_t pid = getpid();
+
+    if (stats != &local_stats) {
+        if (stats->pid == pid)
+            return;
+        // inherited from a parent process: leave its page alone
+        munmap(stats, sizeof(StatsPage));
+        stats = &local_stats;
+    }
+    memset(&local_stats, 0, sizeof(local_stats));
+    local_stats.magic = SBC_STATS_MAGIC;
+    local_stats.version = SBC_STATS_VERSION;
+    local_stats.pid = pid;
+
+    if (sbc_stats_name(pid, name, sizeof(name)) != 0)
+        return;
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Warning: could not create stats page");
+        return;
+    }
+    void *page = MAP_FAILED;
+    if (ftruncate(fd, sizeof(StatsPage)) == 0)
+        page = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("Warning: could not map stats page");
+        shm_unlink(name);
+        return;
+    }
+
+    memcpy(page, &local_stats, sizeof(StatsPage));
+    stats = page;
+    if (!cleanup_registered) {
+        atexit(stats_page_cleanup);
+        cleanup_registered = 1;
+    }
+}
+
+/*
+ * Transition trace
+ */
+
+/* name of the shared memory object holding the trace of process pid */
+int sbc_trace_name(pid_t pid, char *buf, size_t len) {
+    return snprintf(buf, len, "/sbctrace.%d", (int)pid) < (int)len ? 0 : -1;
+}
+
+SBC_MM_TEXT unsigned long mm_trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* the id trace events give subctx, the client's for NULL */
+SBC_MM_TEXT int mm_trace_ctx(const MappedSubcontext *subctx) {
+    if (!subctx)
+        return SBC_CTX_CLIENT;
+    return subctx->stats_idx >= 0 ? subctx->stats_idx : SBC_CTX_UNKNOWN;
+}
+
+/* record one event in the calling thread's ring.  Each thread has its own
+ * ring, so the only concurrent writer is a signal handler interrupting us
+ * on the same thread: slots are reserved with an atomic increment and an
+ * event only counts once its seq has been stored. */
+SBC_MM_TEXT void mm_trace(int type, int from_ctx, int to_ctx, void *addr,
+                          unsigned long start_ns) {
+    if (!mm_tracing() || !trace)
+        return;
+
+    if (trace_ring_idx < 0) {
+        if (trace_ring_idx == -2)
+            return;  // out of rings, this thread is not traced
+        int idx = __atomic_fetch_add(&trace->num_rings, 1, __ATOMIC_RELAXED);
+        if (idx >= SBC_TRACE_THREADS) {
+            trace_ring_idx = -2;
+            return;
+        }
+        trace->rings[idx].tid = gettid();
+        trace_ring_idx = idx;
+    }
+
+    TraceRing *ring = &trace->rings[trace_ring_idx];
+    ulong seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    TraceEvent *ev = &ring->events[seq & (SBC_TRACE_EVENTS - 1)];
+    ev->seq = 0;
+    ev->timestamp_ns = start_ns;
+    ev->duration_ns = mm_trace_clock() - start_ns;
+    ev->fault_addr = (ulong)addr;
+    ev->from_ctx = from_ctx;
+    ev->to_ctx = to_ctx;
+    ev->type = type;
+    __atomic_store_n(&ev->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* switch lazy verification of images mapped from now on on or off; also
+ * settable with SBC_VERIFY=0 in the environment */
+void sbc_verify_enable(int enabled) {
+    verify_images = enabled;
+}
+
+/* whether images mapped now should be verified.  Verification needs the
+ * SIGSEGV handler to see the first touch of every page */
+int mm_verify_enabled(void) {
+    return verify_images && segv_handler_installed;
+}
+
+/* switch tracing on or off; also settable with SBC_TRACE=1 in the
+ * environment or from outside with sbctrace */
+void sbc_trace_enable(int enabled) {
+    if (trace)
+        trace->enabled = enabled;
+}
+
+#if SBC_TRACE
+static void trace_buffer_cleanup(void) {
+    char name[SMLBUFSZ];
+    if (trace && trace->pid == getpid() && sbc_trace_name(trace->pid, name, sizeof(name)) == 0)
+        shm_unlink(name);
+}
+#endif
+
+/* create the shared trace buffer for this process.  Without it tracing
+ * stays off. */
+static void trace_buffer_init(void) {
+#if SBC_TRACE
+    static int cleanup_registered = 0;
+    char name[SMLBUFSZ];
+    pid_t pid = getpid();
+
+    if (trace) {
+        if (trace->pid == pid)
+            return;
+        // inherited from a parent process: leave its buffer alone
+        munmap(trace, sizeof(TraceBuffer));
+        trace = NULL;
+        trace_enabled = &trace_never;
+        trace_ring_idx = -1;
+    }
+
+    if (sbc_trace_name(pid, name, sizeof(name)) != 0)
+        return;
+    int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("Warning: could not create trace buffer");
+        return;
+    }
+    void *buf = MAP_FAILED;
+    if (ftruncate(fd, sizeof(TraceBuffer)) == 0)
+        buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        perror("Warning: could not map trace buffer");
+        shm_unlink(name);
+        return;
+    }
+
+    trace = buf;
+    trace->magic = SBC_TRACE_MAGIC;
+    trace->version = SBC_TRACE_VERSION;
+    trace->pid = pid;
+    const char *env = getenv("SBC_TRACE");
+    trace->enabled = env && atoi(env) != 0;
+    trace_enabled = &trace->enabled;
+    if (!cleanup_registered) {
+        atexit(trace_buffer_cleanup);
+        cleanup_registered = 1;
+    }
+#endif
+}
+
+/* claim a stats slot for a newly mapped subcontext.  Returns -1 if all
+ * of them are taken, and the subcontext goes uncounted */
+int mm_stats_attach(const char *name, int fd) {
+    for (int i = 0; i < MAX_IMG_FILES; i++) {
+        SubcontextStats *st = &stats->subctx[i];
+        if (!st->in_use) {
+            memset(st, 0, sizeof(*st));
+            strncpy(st->name, name, SBC_NAME_LEN - 1);
+            st->fd = fd;
+            st->in_use = 1;
+            return i;
+        }
+    }
+    fprintf(stderr, "No stats slot left for %s, its counters are not kept\n", name);
+    return -1;
+}
+
+/* release the stats slot of an unmapped subcontext */
+void mm_stats_detach(int idx) {
+    if (idx >= 0)
+        stats->subctx[idx].in_use = 0;
+}
@@ -1,11 +1,67 @@
+#define _GNU_SOURCE
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "vm_sbc.h"
 
+// an image laid out by plan_image, for fill_image to write
+typedef struct image_plan {
+    Header *header;           // header and entries, page aligned, as they go at offset 0
+    size_t header_size;
+    ulong *checksums;         // one per page of every region, filled in by fill_image
+    size_t num_blocks;
+    size_t checksum_offset;
+    ulong  zero_hash;         // the hash of a page of zeroes
+    char  *page_buf;          // one page, for the short last page of a region
+    size_t file_size;
+    long   page_size;
+} ImagePlan;
+
+// an image file's path: its base name under img_files/
+#define IMAGE_PATH_LEN (sizeof("img_files/.img") + SMLBUFSZ)
+
+static int image_base_name(const char *filename, char *out, size_t out_len);
+static int open_image_file(const char *filename, char path[IMAGE_PATH_LEN]);
+static int write_image_to_fd(int w_fd, void (**func_list)(int), size_t num_funcs);
+static int snapshot_regions(ImageRegion *regions, size_t *num_regions);
+static int plan_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                      void (**func_list)(int), size_t num_funcs, ImagePlan *plan);
+static int fill_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                      const ImagePlan *plan);
+static void free_plan(ImagePlan *plan);
+
+// address ranges given a sharing policy other than the default
+typedef struct sharing_range {
+    ulong start, end;
+    int policy;
+} SharingRange;
+
+static SharingRange sharing_ranges[SBC_SHARE_MAX];
+static size_t num_sharing_ranges = 0;
+
+// address ranges left out of images, and the ranges images are limited to
+// once sbc_include_only has been called
+typedef struct snapshot_range {
+    ulong start, end;
+} SnapshotRange;
+
+static SnapshotRange excluded_ranges[SBC_RANGES_MAX];
+static size_t num_excluded_ranges = 0;
+static SnapshotRange included_ranges[SBC_RANGES_MAX];
+static size_t num_included_ranges = 0;
+
+// give free heap memory back before every snapshot
+static int trim_heap = 1;
+
 
 /**
  * creates a snapshot of the current program's memory and stores it in an image file.
@@ -18,11 +74,193 @@
  */
 int create_image_file(const char *filename, void (**func_list)(int), size_t num_funcs) {
 
+    char output_filename[IMAGE_PATH_LEN];
+    int w_fd = open_image_file(filename, output_filename);
+    if (w_fd == -1)
+        return EXIT_FAILURE;
+
+    if (write_image_to_fd(w_fd, func_list, num_funcs) != EXIT_SUCCESS) {
+        close(w_fd);
+        return EXIT_FAILURE;
+    }
+
+    close(w_fd);
+    
+    printf("Memory snapshot created successfully in %s\n", output_filename);
+    return EXIT_SUCCESS;
+}
+
+/* open the image file for filename, img_files/<base name>.img, for
+ * writing, and put its name in path.  It is only truncated once the
+ * image is written over it */
+static int open_image_file(const char *filename, char path[IMAGE_PATH_LEN]) {
+
+    char base_name[SMLBUFSZ];
+    if (image_base_name(filename, base_name, sizeof(base_name)) != 0)
+        return -1;
+
+    snprintf(path, IMAGE_PATH_LEN, "img_files/%s.img", base_name);
+    
+    printf("Creating memory snapshot in file: %s\n", path);
+
+    // create output file
+    int w_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (w_fd == -1)
+        perror("Error opening output file");
+    return w_fd;
+}
+
+/**
+ * creates a snapshot of the current program's memory in an anonymous, sealed
+ * memfd instead of a file under img_files/. The snapshot never touches the
+ * filesystem; the returned descriptor can be handed to other processes with
+ * sbc_broker_publish() or sbc_send_fd() and mapped with map_subcontext_fd().
+ *
+ * @param filename the name of the C file to be associated with the image (used to name the memfd)
+ * @param func_list array of function pointers to store in the header
+ * @param num_funcs number of function pointers in the array
+ * @return the sealed memfd on success, -1 on failure
+ */
+int create_image_memfd(const char *filename, void (**func_list)(int), size_t num_funcs) {
+
+    char base_name[SMLBUFSZ];
+    if (image_base_name(filename, base_name, sizeof(base_name)) != 0)
+        return -1;
+
+    printf("Creating memory snapshot in memfd: %s\n", base_name);
+
+    int w_fd = memfd_create(base_name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (w_fd == -1) {
+        perror("Error creating memfd");
+        return -1;
+    }
+
+    if (write_image_to_fd(w_fd, func_list, num_funcs) != EXIT_SUCCESS) {
+        close(w_fd);
+        return -1;
+    }
+
+    // the image is immutable from here on. sealing lets receivers trust
+    // that the contents and size cannot change underneath their mappings
+    if (fcntl(w_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                 F_SEAL_WRITE  | F_SEAL_SEAL) == -1) {
+        perror("Error sealing memfd");
+        close(w_fd);
+        return -1;
+    }
+
+    printf("Memory snapshot created successfully in memfd %d\n", w_fd);
+    return w_fd;
+}
+
+/**
+ * starts a snapshot of the current program's memory without pausing the caller
+ * for the copy. The image is laid out as create_image_file would, then the
+ * process forks and the child writes the regions' contents from its
+ * copy-on-write view of memory, so the parent only pays for the layout and
+ * the fork and can keep serving while the image is written. The child
+ * never looks at the parent again: whatever the parent maps, unmaps or
+ * writes after the fork is not part of the image. Regions the parent maps
+ * MAP_SHARED are the exception, since they are not copied on write.
+ *
+ * Other threads of the parent may hold locks at the fork, so the child
+ * only writes the file and exits (see fill_image): binding, trimming the
+ * heap and reading the memory map all happen before the fork.
+ *
+ * @param filename the name of the C file to be associated with the image (output will be filename.img)
+ * @param func_list array of function pointers to store in the header
+ * @param num_funcs number of function pointers in the array
+ * @param job filled in with the writer's pid and a completion descriptor that
+ *            becomes readable when the image is complete; pass it to sbc_snapshot_wait
+ * @return 0 on success, -1 on failure
+ */
+int sbc_snapshot_async(const char *filename, void (**func_list)(int), size_t num_funcs,
+                       SnapshotJob *job) {
+    char output_filename[IMAGE_PATH_LEN];
+    int w_fd = open_image_file(filename, output_filename);
+    if (w_fd == -1)
+        return -1;
+
+    ImageRegion regions[MAX_ENTRIES];
+    size_t num_regions;
+    ImagePlan plan;
+    if (snapshot_regions(regions, &num_regions) != EXIT_SUCCESS ||
+        plan_image(w_fd, regions, num_regions, func_list, num_funcs, &plan) != EXIT_SUCCESS) {
+        close(w_fd);
+        return -1;
+    }
+    plan.header->callArgs = &sbc_call_args;
+
+    int done_pipe[2];
+    if (pipe2(done_pipe, O_CLOEXEC) == -1) {
+        perror("Error creating snapshot completion pipe");
+        free_plan(&plan);
+        close(w_fd);
+        return -1;
+    }
+
+    // buffered output would otherwise be duplicated by the child
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking snapshot writer");
+        close(done_pipe[0]);
+        close(done_pipe[1]);
+        free_plan(&plan);
+        close(w_fd);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char status = (char)fill_image(w_fd, regions, num_regions, &plan);
+        if (write(done_pipe[1], &status, 1) != 1)
+            _exit(EXIT_FAILURE);
+        _exit(status);
+    }
+
+    close(done_pipe[1]);
+    free_plan(&plan);
+    close(w_fd);
+    job->pid = pid;
+    job->done_fd = done_pipe[0];
+    return 0;
+}
+
+/**
+ * waits for a snapshot started by sbc_snapshot_async to finish and reaps the
+ * writer. job->done_fd is closed.
+ *
+ * @return 0 if the image was written successfully, non-zero otherwise
+ */
+int sbc_snapshot_wait(SnapshotJob *job) {
+    char status = EXIT_FAILURE;
+    ssize_t n;
+    do {
+        n = read(job->done_fd, &status, 1);
+    } while (n == -1 && errno == EINTR);
+    if (n != 1)
+        status = EXIT_FAILURE;
+    close(job->done_fd);
+    job->done_fd = -1;
+
+    int wstatus;
+    while (waitpid(job->pid, &wstatus, 0) == -1 && errno == EINTR)
+        ;
+    return status;
+}
+
+/*
+ * derive the image name from a source file name: "server_test1.c" becomes
+ * "test1" (everything after the first underscore, up to the last dot)
+ */
+static int image_base_name(const char *filename, char *out, size_t out_len) {
+
     // get a pointer to the dot
     char *dot = strrchr(filename, '.');
     if (dot == NULL) {
         perror("strchr returned NULL!\n");
-        return EXIT_FAILURE;
+        return -1;
     }
     size_t base_len;
     char *underscore = strchr(filename, '_');
@@ -31,17 +269,267 @@ int create_image_file(const char *filename, void (**func_list)(int), size_t num_
     else
         base_len = dot - filename;
 
-    char output_filename[256];
-    assert(base_len < sizeof(output_filename) - 10);
-    memcpy(output_filename, "img_files/", 11);
+    assert(base_len < out_len);
     if (underscore)
-        memcpy(output_filename + 10, underscore + 1, base_len);
+        memcpy(out, underscore + 1, base_len);
     else
-        memcpy(output_filename + 10, filename, base_len);
-    memcpy(output_filename + 10 + base_len, ".img", 5);
-    
-    printf("Creating memory snapshot in file: %s\n", output_filename);
-    
+        memcpy(out, filename, base_len);
+    out[base_len] = '\0';
+    return 0;
+}
+
+/**
+ * chooses how the memory in [addr, addr + len) is shared between the
+ * clients that map images taken from now on. Every mapping that overlaps
+ * the range gets the policy, so shared state is best kept in mappings of
+ * its own. Regions are private copy-on-write unless set otherwise.
+ *
+ * @param addr start of the range
+ * @param len length of the range
+ * @param policy one of SBC_SHARE_PRIVATE, SBC_SHARE_PERSISTENT or SBC_SHARE_ANONYMOUS
+ * @return 0 on success, -1 on failure
+ */
+int sbc_set_sharing(void *addr, size_t len, int policy) {
+    if (policy != SBC_SHARE_PRIVATE && policy != SBC_SHARE_PERSISTENT &&
+        policy != SBC_SHARE_ANONYMOUS) {
+        fprintf(stderr, "Unknown sharing policy %d\n", policy);
+        return -1;
+    }
+
+    // a range set before is updated in place
+    ulong start = (ulong)addr, end = start + len;
+    size_t i;
+    for (i = 0; i < num_sharing_ranges; i++) {
+        if (sharing_ranges[i].start == start && sharing_ranges[i].end == end)
+            break;
+    }
+    if (i == num_sharing_ranges) {
+        if (num_sharing_ranges >= SBC_SHARE_MAX) {
+            fprintf(stderr, "Too many sharing ranges\n");
+            return -1;
+        }
+        num_sharing_ranges++;
+    }
+    sharing_ranges[i].start = start;
+    sharing_ranges[i].end = end;
+    sharing_ranges[i].policy = policy;
+    return 0;
+}
+
+/* the signatures sbc_export_signature gave the exports */
+static char export_sigs[MAX_FUNC_PTRS][SBC_SIG_LEN];
+
+/**
+ * gives export func_idx of the images written from now on a signature
+ * (see SBC_SIG_LEN), so that clients can look it up with
+ * sbc_export_address and call it with its real parameters, which then
+ * travel in registers as in any native call. Exports without one can
+ * only be called through call_subcontext_function.
+ *
+ * @param func_idx index of the export in the function list
+ * @param sig its signature, or NULL to leave it untyped again
+ * @return 0 on success, -1 if the index or the signature is invalid
+ */
+int sbc_export_signature(int func_idx, const char *sig) {
+    if (func_idx < 0 || func_idx >= MAX_FUNC_PTRS) {
+        fprintf(stderr, "Invalid function index %d\n", func_idx);
+        return -1;
+    }
+    if (!sig) {
+        export_sigs[func_idx][0] = '\0';
+        return 0;
+    }
+    size_t len = strlen(sig);
+    int valid = len > 0 && len < SBC_SIG_LEN && strchr("vilpfd", sig[0]) &&
+                strspn(sig + 1, "ilpfd") == len - 1;
+    if (!valid) {
+        fprintf(stderr, "Invalid signature \"%s\" for function %d\n", sig, func_idx);
+        return -1;
+    }
+    memcpy(export_sigs[func_idx], sig, len + 1);
+    return 0;
+}
+
+/* the sharing policy of the mapping [start, end) */
+static int region_sharing(ulong start, ulong end) {
+    for (size_t i = 0; i < num_sharing_ranges; i++) {
+        if (start < sharing_ranges[i].end && end > sharing_ranges[i].start)
+            return sharing_ranges[i].policy;
+    }
+    return SBC_SHARE_PRIVATE;
+}
+
+/* add [start, end) to a range list, unless it is there already */
+static int add_snapshot_range(SnapshotRange *ranges, size_t *num_ranges, ulong start, ulong end) {
+    for (size_t i = 0; i < *num_ranges; i++) {
+        if (ranges[i].start == start && ranges[i].end == end)
+            return 0;
+    }
+    if (*num_ranges >= SBC_RANGES_MAX) {
+        fprintf(stderr, "Too many snapshot ranges\n");
+        return -1;
+    }
+    ranges[*num_ranges].start = start;
+    ranges[*num_ranges].end = end;
+    (*num_ranges)++;
+    return 0;
+}
+
+/**
+ * leaves the memory in [addr, addr + len) out of the images taken from now
+ * on, for scratch buffers, caches and other state clients never use. Only
+ * the whole pages in the range are left out, so data sharing a page with
+ * it is kept. Clients see no mapping there at all.
+ *
+ * @param addr start of the range
+ * @param len length of the range
+ * @return 0 on success, -1 on failure
+ */
+int sbc_exclude(void *addr, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong start = ((ulong)addr + page_size - 1) & ~(page_size - 1);
+    ulong end = ((ulong)addr + len) & ~(page_size - 1);
+    if (start >= end)
+        return 0;
+    return add_snapshot_range(excluded_ranges, &num_excluded_ranges, start, end);
+}
+
+/**
+ * limits the images taken from now on to the memory in [addr, addr + len)
+ * and whatever other ranges are given in further calls. Everything the
+ * subcontext's functions touch has to be included, their code and the
+ * libraries it calls among it; the pages around the range are included
+ * whole. The slot clients pass call arguments through is always kept.
+ * sbc_exclude still applies inside included ranges.
+ *
+ * @param addr start of the range
+ * @param len length of the range
+ * @return 0 on success, -1 on failure
+ */
+int sbc_include_only(void *addr, size_t len) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong start = (ulong)addr & ~(page_size - 1);
+    ulong end = ((ulong)addr + len + page_size - 1) & ~(page_size - 1);
+    if (start >= end)
+        return 0;
+    return add_snapshot_range(included_ranges, &num_included_ranges, start, end);
+}
+
+/**
+ * forgets every range given to sbc_exclude and sbc_include_only, so that
+ * images cover the whole process again.
+ */
+void sbc_snapshot_ranges_clear(void) {
+    num_excluded_ranges = 0;
+    num_included_ranges = 0;
+}
+
+/**
+ * chooses whether free heap memory is handed back with malloc_trim() before
+ * every snapshot (the default). The heap then ends at the allocator's
+ * high-water mark, and free pages inside it are left as holes in the image.
+ *
+ * @param enabled non-zero to trim the heap
+ */
+void sbc_trim_heap(int enabled) {
+    trim_heap = enabled;
+}
+
+static int in_ranges(const SnapshotRange *ranges, size_t num_ranges, ulong addr) {
+    for (size_t i = 0; i < num_ranges; i++) {
+        if (addr >= ranges[i].start && addr < ranges[i].end)
+            return 1;
+    }
+    return 0;
+}
+
+/* the first range boundary after addr, or end */
+static ulong next_boundary(const SnapshotRange *ranges, size_t num_ranges, ulong addr, ulong end) {
+    for (size_t i = 0; i < num_ranges; i++) {
+        if (ranges[i].start > addr && ranges[i].start < end)
+            end = ranges[i].start;
+        if (ranges[i].end > addr && ranges[i].end < end)
+            end = ranges[i].end;
+    }
+    return end;
+}
+
+/*
+ * whether the page-aligned range starting at addr goes into the image,
+ * and where that stops being so (at most end). keep_page is the page
+ * that is always kept.
+ */
+static int snapshot_keeps(ulong addr, ulong end, ulong keep_page, ulong *next) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (addr == keep_page) {
+        *next = addr + page_size < end ? addr + page_size : end;
+        return 1;
+    }
+    *next = next_boundary(excluded_ranges, num_excluded_ranges, addr, end);
+    *next = next_boundary(included_ranges, num_included_ranges, addr, *next);
+    if (addr < keep_page && keep_page < *next)
+        *next = keep_page;
+    if (in_ranges(excluded_ranges, num_excluded_ranges, addr))
+        return 0;
+    return num_included_ranges == 0 || in_ranges(included_ranges, num_included_ranges, addr);
+}
+
+// the call argument slot of this image, filled in by the client that maps it
+SbcCallArgs sbc_call_args;
+
+/**
+ * resolves a slice of the call buffer, for subcontext functions called with
+ * call_subcontext_slice. The input of the current call is
+ * sbc_slice(sbc_call_args.in).
+ *
+ * @param slice the slice to resolve
+ * @return a pointer to the slice's first byte, or NULL if there is no call
+ *         buffer or the slice does not fit in it
+ */
+void *sbc_slice(SbcSlice slice) {
+    if (!sbc_call_args.buffer || slice.offset > sbc_call_args.size ||
+        slice.len > sbc_call_args.size - slice.offset)
+        return NULL;
+    return sbc_call_args.buffer + slice.offset;
+}
+
+/**
+ * hands a slice of the call buffer back to the client as the result of the
+ * current call. The data is not copied; the client reads it in place.
+ *
+ * @param offset start of the result in the call buffer
+ * @param len length of the result
+ * @return 0 on success, -1 if the slice does not fit in the call buffer
+ */
+int sbc_return_slice(size_t offset, size_t len) {
+    SbcSlice out = { offset, len };
+    if (!sbc_slice(out))
+        return -1;
+    sbc_call_args.out = out;
+    return 0;
+}
+
+/*
+ * snapshot the current process into w_fd, which must be open for reading
+ * and writing. the descriptor is resized to fit the image.
+ */
+/* the regions of the current process an image of it is made of; their
+ * contents are read from the process itself when the image is written */
+static int snapshot_regions(ImageRegion *regions, size_t *num_regions) {
+
+    // resolve lazily bound functions now, so the image never runs the
+    // dynamic linker's resolver in the client
+    int bound = sbc_bind_now();
+    if (bound == -1)
+        fprintf(stderr, "Some functions could not be bound, they will fail in the client\n");
+    else
+        printf("Bound %d lazily resolved functions\n", bound);
+
+    // hand free heap memory back, before the maps are read: the heap
+    // shrinks to its high-water mark and free pages inside it read as zero
+    if (trim_heap)
+        malloc_trim(0);
+
     // Open /proc/self/maps to read current memory mappings
     int maps_fd = open("/proc/self/maps", O_RDONLY);
     if (maps_fd == -1) {
@@ -49,19 +537,22 @@ int create_image_file(const char *filename, void (**func_list)(int), size_t num_
         return EXIT_FAILURE;
     }
 
-    // perform read
-    char buf[BUFSZ];
-    ssize_t bytes_read = read(maps_fd, buf, BUFSZ - 1);
+    // perform read. the kernel returns the maps file a page at a time, so
+    // keep reading until end of file
+    char buf[MAPS_BUFSZ];
+    ssize_t bytes_read = 0, n;
+    while ((n = read(maps_fd, buf + bytes_read, MAPS_BUFSZ - 1 - bytes_read)) > 0)
+        bytes_read += n;
     
     // error checking for read
-    if (bytes_read == -1) {
+    if (n == -1) {
         perror("Error reading maps file");
         close(maps_fd);
         return EXIT_FAILURE;
     }
     
     // error checking for buffer
-    if (bytes_read >= BUFSZ - 1) {
+    if (bytes_read >= MAPS_BUFSZ - 1) {
         fprintf(stderr, "Buffer too small for maps file\n");
         close(maps_fd);
         return EXIT_FAILURE;
@@ -71,15 +562,14 @@ int create_image_file(const char *filename, void (**func_list)(int), size_t num_
     buf[bytes_read] = '\0';
     close(maps_fd);
 
-    // arrays for memory region information
-    ulong starts[MAX_ENTRIES];
-    ulong ends[MAX_ENTRIES];
-    char perms[MAX_ENTRIES][5];
-    size_t num_regions = 0;
+    // memory region information
+    *num_regions = 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong keep_page = (ulong)&sbc_call_args & ~(page_size - 1);
 
     // parse the buffer line by line
     char *line = strtok(buf, "\n");
-    while (line && num_regions < MAX_ENTRIES) {
+    while (line && *num_regions < MAX_ENTRIES) {
 
         // skip excluded regions
         if (!should_exclude_region(line)) {
@@ -88,11 +578,26 @@ int create_image_file(const char *filename, void (**func_list)(int), size_t num_
             
             if (parse_maps_line(line, &start, &end, perm_buf)) {
 
-                // store information about the valid region
-                starts[num_regions] = start;
-                ends[num_regions] = end;
-                strcpy(perms[num_regions], perm_buf);
-                num_regions++;
+                // the unused part of an arena stays a hole in the image
+                ulong data_end = start + sbc_arena_used(start, end);
+                int sharing = region_sharing(start, end);
+
+                // store the parts of the region that are kept. only
+                // regions with read permission can be copied
+                ulong next;
+                for (ulong part = start; part < end && *num_regions < MAX_ENTRIES; part = next) {
+                    if (!snapshot_keeps(part, end, keep_page, &next))
+                        continue;
+                    ImageRegion *region = &regions[*num_regions];
+                    region->start = part;
+                    region->end = next;
+                    region->src = (perm_buf[0] == 'r') ? (const void *)part : NULL;
+                    region->src_len = data_end <= part ? 0 :
+                                      (data_end < next ? data_end : next) - part;
+                    strcpy(region->perms, perm_buf);
+                    region->sharing = sharing;
+                    (*num_regions)++;
+                }
             }
         }
 
@@ -100,113 +605,230 @@ int create_image_file(const char *filename, void (**func_list)(int), size_t num_
         line = strtok(NULL, "\n");
     }
 
-    printf("Found %zu memory regions to include in image\n", num_regions);
-    
+    printf("Found %zu memory regions to include in image\n", *num_regions);
+    return EXIT_SUCCESS;
+}
+
+static int write_image_to_fd(int w_fd, void (**func_list)(int), size_t num_funcs) {
+    ImageRegion regions[MAX_ENTRIES];
+    size_t num_regions;
+    ImagePlan plan;
+    if (snapshot_regions(regions, &num_regions) != EXIT_SUCCESS ||
+        plan_image(w_fd, regions, num_regions, func_list, num_funcs, &plan) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    // tell clients where this process keeps its call arguments
+    plan.header->callArgs = &sbc_call_args;
+    int ret = fill_image(w_fd, regions, num_regions, &plan);
+    free_plan(&plan);
+    return ret;
+}
+
+/* lay out an image of the given regions: its header, entries and file
+ * size are settled, leaving the file itself, the regions' contents and
+ * their checksums to fill_image */
+static int plan_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                      void (**func_list)(int), size_t num_funcs, ImagePlan *plan) {
+
+    if (num_regions > MAX_ENTRIES) {
+        fprintf(stderr, "Too many regions for one image: %zu\n", num_regions);
+        return EXIT_FAILURE;
+    }
+
     long page_size = sysconf(_SC_PAGESIZE);
 
     // calculate total virtual space size (page aligned)
     size_t VIRTUAL_SPACE_SIZE = 0;
     for (size_t i = 0; i < num_regions; i++) {
-        size_t region_size = ends[i] - starts[i];
+        size_t region_size = regions[i].end - regions[i].start;
         VIRTUAL_SPACE_SIZE += region_size;
         printf("Region %zu: %lx-%lx (%s) Size: %zu bytes\n",
-               i, starts[i], ends[i], perms[i], region_size);
+               i, regions[i].start, regions[i].end, regions[i].perms, region_size);
         VIRTUAL_SPACE_SIZE = (VIRTUAL_SPACE_SIZE + page_size - 1) & ~(page_size - 1);
     }
 
     printf("Total size of memory regions: %zu bytes\n", VIRTUAL_SPACE_SIZE);
 
-    // create output file
-    int w_fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (w_fd == -1) {
-        perror("Error opening output file");
-        return EXIT_FAILURE;
-    }
-
     // calculate header size and align it to page boundary
     size_t header_size = sizeof(Header) + num_regions * sizeof(Entry);
     size_t aligned_header_size = (header_size + page_size - 1) & ~(page_size - 1);
 
-    // compute total file size with per-region alignment
+    // compute total file size with per-region alignment, followed by the
+    // checksum table with one hash per page of every region
     size_t total_file_size = aligned_header_size;
+    size_t num_blocks = 0;
     for (size_t i = 0; i < num_regions; i++) {
-        size_t region_size = ends[i] - starts[i];
+        size_t region_size = regions[i].end - regions[i].start;
         total_file_size += region_size;
         total_file_size = (total_file_size + page_size - 1) & ~(page_size - 1);
+        num_blocks += (region_size + page_size - 1) / page_size;
     }
+    size_t checksum_offset = total_file_size;
+    total_file_size += (num_blocks * sizeof(ulong) + page_size - 1) & ~(page_size - 1);
 
-    // set the file size
-    if (ftruncate(w_fd, total_file_size) == -1) {
-        perror("Error truncating file");
-        close(w_fd);
-        return EXIT_FAILURE;
-    }
-
-    // map the file into memory
-    void *map = mmap(NULL, total_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, w_fd, 0);
-    if (map == MAP_FAILED) {
-        perror("Error mapping file");
-        close(w_fd);
+    plan->page_size = page_size;
+    plan->header_size = aligned_header_size;
+    plan->checksum_offset = checksum_offset;
+    plan->num_blocks = num_blocks;
+    plan->file_size = total_file_size;
+    plan->header = calloc(1, aligned_header_size);
+    plan->checksums = calloc(num_blocks + 1, sizeof(ulong));
+    plan->page_buf = calloc(1, page_size);
+    if (!plan->header || !plan->checksums || !plan->page_buf) {
+        perror("Error allocating image header");
+        free_plan(plan);
         return EXIT_FAILURE;
     }
+    plan->zero_hash = sbc_page_hash(plan->page_buf, page_size);
 
     // fill in the header
-    Header *header = (Header *)map;
+    Header *header = plan->header;
+    header->magic = SBC_IMAGE_MAGIC;
+    header->version = SBC_IMAGE_VERSION;
     header->numEntries = num_regions;
+    header->checksumOffset = checksum_offset;
+    header->checksumBlock = page_size;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->snapshotId = now.tv_sec * 1000000000UL + now.tv_nsec;
     
     // store function pointers in header
     size_t funcs_to_store = (num_funcs > MAX_FUNC_PTRS) ? MAX_FUNC_PTRS : num_funcs;
     printf("Storing %zu function pointers in image header\n", funcs_to_store);
     
-    // zero out the function pointers first
-    for (int i = 0; i < MAX_FUNC_PTRS; i++) {
-        header->func_ptr[i] = NULL;
-    }
-    
-    // copy the provided function pointers
+    // copy the provided function pointers, and the signatures of those
+    // that have one. the rest of the header is zero
     for (size_t i = 0; i < funcs_to_store; i++) {
         header->func_ptr[i] = func_list[i];
+        memcpy(header->funcSig[i], export_sigs[i], SBC_SIG_LEN);
         printf("Stored function pointer %zu at address %p\n", i, (void*)func_list[i]);
     }
     
-    // initialize the current offset for data after the header
+    // fill in entries, each region following the last on a page boundary
     size_t current_offset = aligned_header_size;
-
-    // fill in entries and copy memory regions
     for (size_t i = 0; i < num_regions; i++) {
-
-        // fill in metadata for this region
-        header->entries[i].start = starts[i];
-        header->entries[i].end = ends[i];
+        header->entries[i].start = regions[i].start;
+        header->entries[i].end = regions[i].end;
         header->entries[i].offsetIntoFile = current_offset;
-        strcpy(header->entries[i].perms, perms[i]);
+        strcpy(header->entries[i].perms, regions[i].perms);
+        header->entries[i].sharing = regions[i].sharing;
+        current_offset += regions[i].end - regions[i].start;
+        current_offset = (current_offset + page_size - 1) & ~(page_size - 1);
+    }
+    return EXIT_SUCCESS;
+}
 
-        size_t region_size = ends[i] - starts[i];
+/* pwrite all of buf, however many calls it takes */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
-        // copy memory region if it has read permission
-        if (perms[i][0] == 'r') {
-            void *src_addr = (void *)starts[i];
-            void *dest_addr = (void *)((char *)map + current_offset);
+/* write the regions' contents, their checksums and the header planned by
+ * plan_image, over whatever the file held.  Nothing here allocates, locks
+ * or prints, and it only calls ftruncate and pwrite, so it can run in a
+ * child forked from a threaded process (see sbc_snapshot_async) */
+static int fill_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                      const ImagePlan *plan) {
+    size_t page_size = plan->page_size;
+    size_t block = 0;
 
-            memcpy(dest_addr, src_addr, region_size);
-        }
+    // the pages left out read back as zeroes
+    if (ftruncate(w_fd, 0) == -1 || ftruncate(w_fd, plan->file_size) == -1)
+        return EXIT_FAILURE;
 
-        // update offset for next region
-        current_offset += region_size;
-        current_offset = (current_offset + page_size - 1) & ~(page_size - 1);
+    for (size_t i = 0; i < num_regions; i++) {
+        const ImageRegion *region = &regions[i];
+        size_t region_size = region->end - region->start;
+        off_t offset = plan->header->entries[i].offsetIntoFile;
+
+        // copy the region's contents a page at a time, and hash every
+        // page. anything past src_len, and every page that is all zero
+        // (untouched or trimmed memory), is left as a hole in the file and
+        // reads back as zeroes. pages with data are written a run at a time
+        size_t data_len = region->src ? region->src_len : 0;
+        if (data_len > region_size)
+            data_len = region_size;
+        size_t run_start = 0, run = 0;
+        for (size_t off = 0; off < region_size; off += page_size) {
+            const char *src = (const char *)region->src + off;
+            size_t len = off < data_len ? data_len - off : 0;
+            if (len > page_size)
+                len = page_size;
+            if (len && (src[0] != 0 || memcmp(src, src + 1, len - 1) != 0)) {
+                // a short last page is hashed as it reads back, zero padded
+                const char *page = src;
+                if (len < page_size) {
+                    memcpy(plan->page_buf, src, len);
+                    memset(plan->page_buf + len, 0, page_size - len);
+                    page = plan->page_buf;
+                }
+                plan->checksums[block++] = sbc_page_hash(page, page_size);
+                if (!run)
+                    run_start = off;
+                run = off + len - run_start;
+                continue;
+            }
+            if (run && pwrite_all(w_fd, (const char *)region->src + run_start, run,
+                                  offset + run_start) != 0)
+                return EXIT_FAILURE;
+            run = 0;
+            plan->checksums[block++] = plan->zero_hash;
+        }
+        if (run && pwrite_all(w_fd, (const char *)region->src + run_start, run,
+                              offset + run_start) != 0)
+            return EXIT_FAILURE;
     }
 
-    // final file size after all regions
-    total_file_size = current_offset;
+    if (pwrite_all(w_fd, plan->checksums, plan->num_blocks * sizeof(ulong),
+                   plan->checksum_offset) != 0 ||
+        pwrite_all(w_fd, plan->header, plan->header_size, 0) != 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
 
-    // unmap/close the file
-    if (munmap(map, total_file_size) == -1) {
-        perror("Error unmapping file");
+static void free_plan(ImagePlan *plan) {
+    free(plan->header);
+    free(plan->checksums);
+    free(plan->page_buf);
+    plan->header = NULL;
+    plan->checksums = NULL;
+    plan->page_buf = NULL;
+}
+
+/**
+ * writes an image made of the given regions to w_fd, which must be open for
+ * reading and writing and is resized to fit the image. This is the image
+ * writer behind create_image_file; it can also be used to build images
+ * whose contents do not come from the calling process.
+ *
+ * @param w_fd descriptor to write the image to
+ * @param regions the regions to record, in address order
+ * @param num_regions number of regions
+ * @param func_list array of function pointers to store in the header
+ * @param num_funcs number of function pointers in the array
+ * @return 0 on success, non-zero on failure
+ */
+int sbc_write_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                    void (**func_list)(int), size_t num_funcs) {
+    ImagePlan plan;
+    if (plan_image(w_fd, regions, num_regions, func_list, num_funcs, &plan) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if (fill_image(w_fd, regions, num_regions, &plan) != EXIT_SUCCESS) {
+        perror("Error writing image");
+        free_plan(&plan);
+        return EXIT_FAILURE;
     }
-    
-    close(w_fd);
-    
-    printf("Memory snapshot created successfully in %s\n", output_filename);
+    free_plan(&plan);
     return EXIT_SUCCESS;
 }
 
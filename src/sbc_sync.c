@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "vm_sbc.h"
+
+/*
+ * Synchronization for subcontext state in shared regions.  Every client
+ * that maps an image runs its functions in a process of its own, so state
+ * in a SBC_SHARE_ANONYMOUS or SBC_SHARE_PERSISTENT region is shared by
+ * processes that know nothing of each other.  The primitives here keep all
+ * of their state in the shared word itself, and only make a system call
+ * when a thread has to sleep or wake another.  The futexes are not
+ * process-private, since the same word is mapped by every client.
+ */
+
+static long futex(unsigned int *word, int op, unsigned int val) {
+    return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+/* tell the CPU this is a spin-wait loop */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * Take the mutex, sleeping while someone else has it.  An uncontended lock
+ * is a single compare-and-swap.
+ */
+void sbc_mutex_lock(SbcMutex *mutex) {
+    unsigned int c = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    // mark the mutex contended before sleeping, so that the holder knows
+    // to wake someone
+    if (c != 2)
+        c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex(&mutex->state, FUTEX_WAIT, 2);
+        c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+/* Take the mutex if it is free.  Returns 1 if it was taken, 0 if not */
+int sbc_mutex_trylock(SbcMutex *mutex) {
+    unsigned int c = 0;
+    return __atomic_compare_exchange_n(&mutex->state, &c, 1, 0, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+/* Release the mutex, waking one waiter if there are any */
+void sbc_mutex_unlock(SbcMutex *mutex) {
+    if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+        futex(&mutex->state, FUTEX_WAKE, 1);
+    }
+}
+
+/*
+ * Start reading state protected by a seqlock.  Readers never write to the
+ * lock: they copy the state out, and start over if sbc_seq_read_retry
+ * says a writer got in meanwhile.
+ */
+unsigned int sbc_seq_read_begin(const SbcSeqlock *lock) {
+    unsigned int seq;
+    while ((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1)
+        cpu_relax();
+    return seq;
+}
+
+/* Whether what was read since sbc_seq_read_begin returned seq has to be
+ * read again */
+int sbc_seq_read_retry(const SbcSeqlock *lock, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Start changing state protected by a seqlock.  Writers exclude each other
+ * on the lock itself, so they need no mutex of their own; they should only
+ * hold it briefly, since a waiting writer spins.
+ */
+void sbc_seq_write_begin(SbcSeqlock *lock) {
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&lock->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) && __atomic_compare_exchange_n(&lock->seq, &seq, seq + 1, 0,
+                                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        sched_yield();
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Finish the change started by sbc_seq_write_begin */
+void sbc_seq_write_end(SbcSeqlock *lock) {
+    __atomic_fetch_add(&lock->seq, 1, __ATOMIC_RELEASE);
+}
+
+/* Add n to the counter.  Returns the value before the addition */
+ulong sbc_counter_add(SbcCounter *counter, ulong n) {
+    return __atomic_fetch_add(&counter->value, n, __ATOMIC_RELAXED);
+}
+
+ulong sbc_counter_read(const SbcCounter *counter) {
+    return __atomic_load_n(&counter->value, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "vm_sbc.h"
+
+/*
+ * Prefork workers.  Starting a client process from scratch means init(),
+ * which scans the client's memory map, and request_map() for every image,
+ * with its overlap checks and then cold faults (and page verification) on
+ * the first calls.  A zygote pays for all of that once: it maps its images,
+ * verifies and prefaults them, and then forks a worker for each client
+ * that connects to its AF_UNIX socket.  The workers inherit the mappings
+ * and the matchmaker's state as they are and are ready to call into a
+ * subcontext as soon as they exist.
+ */
+
+/* zygote protocol operations */
+#define ZYGOTE_SPAWN 1
+#define ZYGOTE_STOP  2
+#define ZYGOTE_OK    3
+#define ZYGOTE_ERR   4
+
+typedef struct zygote_msg {
+    int   op;
+    pid_t pid;  // the worker, in the reply to ZYGOTE_SPAWN
+} ZygoteMsg;
+
+static int send_zygote_msg(int sock, int op, pid_t pid) {
+    ZygoteMsg msg = { op, pid };
+    ssize_t n;
+    do {
+        n = send(sock, &msg, sizeof(msg), MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == (ssize_t)sizeof(msg) ? 0 : -1;
+}
+
+static int recv_zygote_msg(int sock, ZygoteMsg *msg) {
+    ssize_t n;
+    do {
+        n = recv(sock, msg, sizeof(*msg), MSG_WAITALL);
+    } while (n == -1 && errno == EINTR);
+    return n == (ssize_t)sizeof(*msg) ? 0 : -1;
+}
+
+/* the forked worker: it takes over conn and never returns */
+static void run_worker(int lsock, int conn, const int *fds, size_t num_fds,
+                       SbcWorker worker, void *arg) {
+    close(lsock);
+    sbc_after_fork();
+    if (send_zygote_msg(conn, ZYGOTE_OK, getpid()) != 0)
+        exit(EXIT_FAILURE);
+    int status = worker(conn, fds, num_fds, arg);
+    close(conn);
+    exit(status);
+}
+
+/*
+ * Run a zygote on the AF_UNIX socket path until it receives a stop request.
+ * The images are mapped, verified and prefaulted first; then every spawn
+ * request forks a worker, which replies with its pid and runs
+ * worker(conn, fds, num_images, arg) on the requesting connection, fds
+ * being the images' descriptors in the order given.  Requests are served
+ * one at a time, and workers that have exited are reaped between them.
+ * Returns 0 once stopped, or -1 if an image could not be set up.
+ */
+int sbc_zygote_run(const char *path, const char **images, size_t num_images,
+                   SbcWorker worker, void *arg) {
+    int fds[MAX_IMG_FILES];
+    if (num_images > MAX_IMG_FILES) {
+        fprintf(stderr, "A zygote can hold at most %d images\n", MAX_IMG_FILES);
+        return -1;
+    }
+
+    init();
+    for (size_t i = 0; i < num_images; i++) {
+        fds[i] = map_subcontext(images[i]);
+        if (fds[i] < 0 || fds[i] == EXIT_FAILURE || sbc_prefault(fds[i]) != 0) {
+            fprintf(stderr, "Zygote could not set up %s\n", images[i]);
+            return -1;
+        }
+    }
+
+    int lsock = sbc_ipc_listen(path);
+    if (lsock == -1)
+        return -1;
+
+    int running = 1;
+    while (running) {
+        int conn = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error accepting zygote connection");
+            break;
+        }
+
+        ZygoteMsg msg;
+        if (recv_zygote_msg(conn, &msg) != 0) {
+            close(conn);
+            continue;
+        }
+
+        switch (msg.op) {
+        case ZYGOTE_SPAWN: {
+            // whatever is still buffered would be written again by every worker
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid == 0)
+                run_worker(lsock, conn, fds, num_images, worker, arg);
+            if (pid == -1) {
+                perror("Error forking worker");
+                send_zygote_msg(conn, ZYGOTE_ERR, 0);
+            }
+            break;
+        }
+        case ZYGOTE_STOP:
+            running = 0;
+            send_zygote_msg(conn, ZYGOTE_OK, 0);
+            break;
+        default:
+            send_zygote_msg(conn, ZYGOTE_ERR, 0);
+            break;
+        }
+        close(conn);
+    }
+
+    close(lsock);
+    unlink(path);
+    return 0;
+}
+
+/*
+ * Ask the zygote listening on path for a worker.  Returns a socket
+ * connected to the new worker, whose pid is stored in *pid if that is
+ * non-NULL, or -1.
+ */
+int sbc_zygote_spawn(const char *path, pid_t *pid) {
+    int sock = sbc_ipc_connect(path);
+    if (sock == -1) {
+        perror("Error connecting to zygote");
+        return -1;
+    }
+
+    ZygoteMsg msg;
+    if (send_zygote_msg(sock, ZYGOTE_SPAWN, 0) != 0 || recv_zygote_msg(sock, &msg) != 0 ||
+        msg.op != ZYGOTE_OK) {
+        close(sock);
+        return -1;
+    }
+    if (pid)
+        *pid = msg.pid;
+    return sock;
+}
+
+/*
+ * Ask the zygote listening on path to exit.  Workers already running are
+ * left to finish.
+ */
+int sbc_zygote_stop(const char *path) {
+    int sock = sbc_ipc_connect(path);
+    if (sock == -1) {
+        perror("Error connecting to zygote");
+        return -1;
+    }
+    ZygoteMsg msg;
+    int ret = send_zygote_msg(sock, ZYGOTE_STOP, 0) == 0 && recv_zygote_msg(sock, &msg) == 0 &&
+              msg.op == ZYGOTE_OK ? 0 : -1;
+    close(sock);
+    return ret;
+}
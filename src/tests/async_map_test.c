@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Images mapped with request_map_async can be called through their handles
+ * straight away, the calls waiting for the mappings to finish.  An image
+ * that overlaps another one mapped at the same time fails on its own, and
+ * so do the calls through its handle.  A call into a mapped image can run
+ * while another is mapping in the background, and the mapping thread's
+ * faults on the client's code are not taken for transitions.  A child
+ * forked while an image is mapping does not wait for it forever.
+ */
+
+#define IMAGES 8
+#define BASE   0x11500000000UL
+#define STRIDE 0x10000000UL
+#define SPIN_BASE (BASE + IMAGES * STRIDE)
+#define BIG_BASE  (BASE + (IMAGES + 1) * STRIDE)
+#define SPIN_IMG  "img_files/async_spin.img"
+#define BIG_IMG   "img_files/async_big.img"
+#define FORK_BASE (BASE + (IMAGES + 2) * STRIDE)
+#define FORK_IMG  "img_files/async_fork.img"
+#define BIG_REGIONS 256
+
+static const unsigned char ret_insn[] = { 0xc3 };
+
+// pause a few million times, long enough for an image to be mapped
+static const unsigned char spin[] = {
+    0xb9, 0x00, 0x2d, 0x31, 0x01,  // mov ecx, 20000000
+    0xf3, 0x90,                    // 1: pause
+    0xff, 0xc9,                    // dec ecx
+    0x75, 0xfa,                    // jnz 1b
+    0xc3,                          // ret
+};
+
+/* an image whose only function runs code, and num_regions - 1 data
+ * regions so that mapping it takes a while */
+static int write_image_code(const char *path, ulong base, long page_size,
+                            const unsigned char *code, size_t code_len, int num_regions) {
+    ImageRegion regions[BIG_REGIONS] = { { .start = base, .end = base + page_size,
+                                           .src = code, .src_len = code_len,
+                                           .perms = "r-xp" } };
+    for (int i = 1; i < num_regions; i++) {
+        regions[i].start = base + 2 * i * page_size;
+        regions[i].end = regions[i].start + page_size;
+        strcpy(regions[i].perms, "rw-p");
+    }
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, regions, num_regions, &entry, 1);
+}
+
+/* an image whose only function returns straight away, and four data
+ * regions */
+static int write_image(const char *path, ulong base, long page_size) {
+    return write_image_code(path, base, page_size, ret_insn, sizeof(ret_insn), 5);
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    char paths[IMAGES + 1][SMLBUFSZ];
+    for (int i = 0; i < IMAGES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "img_files/async%d.img", i);
+        if (write_image(paths[i], BASE + i * STRIDE, page_size) != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed to write test images\n");
+            return EXIT_FAILURE;
+        }
+    }
+    // the last one again, at the same addresses
+    snprintf(paths[IMAGES], sizeof(paths[IMAGES]), "img_files/async_overlap.img");
+    if (write_image(paths[IMAGES], BASE + (IMAGES - 1) * STRIDE, page_size) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    int fds[IMAGES + 1];
+    init();
+    fflush(stdout);
+    for (int i = 0; i <= IMAGES; i++)
+        fds[i] = request_map_async(paths[i], 0);
+    for (int i = 0; i <= IMAGES; i++)
+        unlink(paths[i]);
+    int failed = check(request_map_async("img_files/missing.img", 0) == EXIT_FAILURE,
+                       "A missing image fails before any mapping starts");
+
+    int calls = 0;
+    for (int i = 0; i < IMAGES - 1; i++)
+        calls += call_subcontext_function(0, fds[i]) == EXIT_SUCCESS;
+    failed |= check(calls == IMAGES - 1,
+                    "Calls through the handles wait for their images to be mapped");
+
+    // one of the two images at the same addresses got there first
+    int first = sbc_map_wait(fds[IMAGES - 1]), second = sbc_map_wait(fds[IMAGES]);
+    int loser = first == 0 ? fds[IMAGES] : fds[IMAGES - 1];
+    failed |= check((first == 0) != (second == 0) && num_mapped_subcontexts == IMAGES &&
+                    call_subcontext_function(0, loser) == EXIT_FAILURE,
+                    "Only one of two overlapping images is mapped");
+
+    // a call that is still running when another image starts mapping
+    if (write_image_code(SPIN_IMG, SPIN_BASE, page_size, spin, sizeof(spin), 1) != EXIT_SUCCESS ||
+        write_image_code(BIG_IMG, BIG_BASE, page_size, ret_insn, sizeof(ret_insn),
+                         BIG_REGIONS) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    int spinner = map_subcontext(SPIN_IMG);
+    const MappedSubcontext *spin_ctx = subcontext_of(spinner);
+    const StatsPage *stats = open_stats();
+    if (!spin_ctx || !stats) {
+        fprintf(stderr, "Failed to map %s\n", SPIN_IMG);
+        return EXIT_FAILURE;
+    }
+    const SubcontextStats *spin_st = &stats->subctx[spin_ctx->stats_idx];
+    int big = request_map_async(BIG_IMG, 0);
+    int ok = call_subcontext_function(0, spinner) == EXIT_SUCCESS;
+    failed |= check(ok && sbc_map_wait(big) == 0 && call_subcontext_function(0, big) == EXIT_SUCCESS &&
+                    spin_st->transitions_in == 1 && spin_st->transitions_out == 1 &&
+                    !spin_ctx->is_active,
+                    "A call runs alongside an image mapping in the background");
+    unlink(SPIN_IMG);
+    unlink(BIG_IMG);
+
+    // the mapping thread does not exist in a child forked meanwhile
+    if (write_image_code(FORK_IMG, FORK_BASE, page_size, ret_insn, sizeof(ret_insn),
+                         BIG_REGIONS) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    int forked = request_map_async(FORK_IMG, 0);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        alarm(5);
+        sbc_after_fork();
+        int status = sbc_map_wait(forked);
+        _exit(status == 0 || status == -1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wstatus;
+    ok = child > 0 && waitpid(child, &wstatus, 0) == child && WIFEXITED(wstatus) &&
+         WEXITSTATUS(wstatus) == EXIT_SUCCESS;
+    failed |= check(ok && sbc_map_wait(forked) == 0,
+                    "A child forked during a background mapping does not wait for it");
+    unlink(FORK_IMG);
+
+    finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * Hand a multi-megabyte payload to the server_test8 image through the
+ * call buffer and check the result it hands back in place.
+ */
+
+#define PAYLOAD (4UL << 20)
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <img_file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    init();
+    int fd = map_subcontext(argv[1]);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    size_t size;
+    char *buf = sbc_call_buffer(fd, &size);
+    if (!buf || size < 2 * PAYLOAD) {
+        printf("✗ Image has no usable call buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    // the payload is written straight into the buffer, at an offset to
+    // check that slices are honoured
+    size_t offset = 4096;
+    for (size_t i = 0; i < PAYLOAD; i++)
+        buf[offset + i] = 'a' + i % 26;
+
+    SbcSlice out;
+    SbcSlice in = { offset, PAYLOAD };
+    if (call_subcontext_slice(0, fd, in, &out) != EXIT_SUCCESS) {
+        printf("✗ Call with a slice failed\n");
+        return EXIT_FAILURE;
+    }
+    finalize();
+
+    int ok = out.offset == offset + PAYLOAD && out.len == PAYLOAD;
+    for (size_t i = 0; ok && i < PAYLOAD; i++)
+        ok = buf[out.offset + i] == 'A' + i % 26;
+    if (!ok) {
+        printf("✗ Subcontext result in the call buffer is wrong\n");
+        return EXIT_FAILURE;
+    }
+
+    // a slice past the end of the buffer must be refused
+    SbcSlice bad = { size - 1, 2 };
+    if (call_subcontext_slice(0, fd, bad, &out) == EXIT_SUCCESS) {
+        printf("✗ Out of bounds slice was accepted\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("✓ %lu MB passed to and from the subcontext without copies\n", PAYLOAD >> 20);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Snapshot annotations: ranges given to sbc_exclude are not in the image,
+ * sbc_include_only limits the image to the given ranges (and the call
+ * argument slot), and trimming the heap leaves its free memory out of the
+ * image file.
+ */
+
+void function1(int arg) {
+    printf("Hello from the exclude test!\n");
+}
+
+typedef struct image {
+    int fd;
+    Header *header;
+    size_t size;
+    long blocks;  // allocated 512-byte blocks
+} Image;
+
+static int snapshot(Image *img) {
+    void (*funcs[1])(int) = { function1 };
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    freopen("/dev/null", "w", stdout);
+    img->fd = create_image_memfd(__FILE_NAME__, funcs, 1);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    struct stat st;
+    if (img->fd == -1 || fstat(img->fd, &st) == -1)
+        return -1;
+    img->size = st.st_size;
+    img->blocks = st.st_blocks;
+    img->header = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+    return img->header == MAP_FAILED ? -1 : 0;
+}
+
+static void release(Image *img) {
+    munmap(img->header, img->size);
+    close(img->fd);
+}
+
+/* the number of image pages in [start, end) */
+static size_t pages_in(const Image *img, ulong start, ulong end) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = 0;
+    for (size_t i = 0; i < img->header->numEntries; i++) {
+        const Entry *e = &img->header->entries[i];
+        ulong lo = e->start > start ? e->start : start;
+        ulong hi = e->end < end ? e->end : end;
+        if (lo < hi)
+            pages += (hi - lo) / page_size;
+    }
+    return pages;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    int failed = 0;
+    Image img;
+
+    char *area = mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memset(area, 0x5a, 4 * page_size);
+    ulong lo = (ulong)area, hi = lo + 4 * page_size;
+
+    // the two middle pages are left out, the partial range changes nothing
+    if (sbc_exclude(area + page_size, 2 * page_size) != 0 || sbc_exclude(area + 16, 64) != 0 ||
+        snapshot(&img) != 0)
+        return EXIT_FAILURE;
+    failed |= check(pages_in(&img, lo, hi) == 2 &&
+                    pages_in(&img, lo + page_size, lo + 3 * page_size) == 0,
+                    "Excluded pages are not in the image");
+    release(&img);
+
+    // only the area and the call argument slot remain
+    ulong keep = (ulong)&sbc_call_args & ~(page_size - 1);
+    if (sbc_include_only(area, 4 * page_size) != 0 || snapshot(&img) != 0)
+        return EXIT_FAILURE;
+    size_t pages = 0;
+    for (size_t i = 0; i < img.header->numEntries; i++)
+        pages += (img.header->entries[i].end - img.header->entries[i].start) / page_size;
+    failed |= check(pages == 3 && pages_in(&img, lo, hi) == 2 &&
+                    pages_in(&img, keep, keep + page_size) == 1,
+                    "Only included ranges and the call argument slot are in the image");
+    release(&img);
+
+    sbc_snapshot_ranges_clear();
+    if (snapshot(&img) != 0)
+        return EXIT_FAILURE;
+    failed |= check(img.header->numEntries > 3 && pages_in(&img, lo, hi) == 4,
+                    "Clearing the ranges snapshots everything again");
+    release(&img);
+
+    // 8 MB of freed heap, kept from the top of the heap by one live chunk
+    enum { CHUNKS = 2048 };
+    static char *chunks[CHUNKS];
+    for (int i = 0; i < CHUNKS; i++) {
+        chunks[i] = malloc(4096);
+        memset(chunks[i], 0x5a, 4096);
+    }
+    for (int i = 0; i < CHUNKS - 1; i++)
+        free(chunks[i]);
+
+    // each image is released before the next snapshot, which would
+    // otherwise include its mapping
+    sbc_trim_heap(0);
+    if (snapshot(&img) != 0)
+        return EXIT_FAILURE;
+    long untrimmed = img.blocks;
+    release(&img);
+    sbc_trim_heap(1);
+    if (snapshot(&img) != 0)
+        return EXIT_FAILURE;
+    long trimmed = img.blocks;
+    release(&img);
+    printf("image with freed heap: %ld KB untrimmed, %ld KB trimmed\n", untrimmed / 2,
+           trimmed / 2);
+    failed |= check(untrimmed - trimmed >= (7L << 20) / 512,
+                    "Free heap memory is left out of trimmed images");
+    free(chunks[CHUNKS - 1]);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
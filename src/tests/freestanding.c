@@ -0,0 +1,44 @@
+/*
+ * a subcontext with no libc and no startup code, turned into an image by
+ * tools/sbc_mkimage without ever running. it talks to the outside world
+ * with raw system calls
+ */
+
+static long sys_write(int fd, const void *buf, unsigned long len) {
+    long ret;
+    __asm__ volatile ("syscall"
+                      : "=a"(ret)
+                      : "a"(1), "D"(fd), "S"(buf), "d"(len)
+                      : "rcx", "r11", "memory");
+    return ret;
+}
+
+static void say(const char *msg) {
+    unsigned long len = 0;
+    while (msg[len])
+        len++;
+    sys_write(1, msg, len);
+}
+
+// initialised data and .bss must both come out of the ELF file right
+static int calls = 41;
+static char scratch[65536];
+
+void function1(int arg) {
+    say("✓ Function from an image built offline ran\n");
+}
+
+void function2(int arg) {
+    if (calls == 41 && scratch[sizeof(scratch) - 1] == 0)
+        say("✓ Offline image has its data and zeroed .bss\n");
+    else
+        say("✗ Offline image data is wrong\n");
+    calls++;
+    scratch[sizeof(scratch) - 1] = 1;
+}
+
+// never runs; the linker wants an entry point
+void _start(void) {
+    for (;;)
+        ;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * An image mapped SBC_MAP_LAZY starts out as one inaccessible reservation
+ * over its regions.  A call maps only the code region, a read of a data
+ * region maps that one with the image's contents, sbc_prefault maps the
+ * rest and gives back the gaps, and unmapping gives back everything.  An
+ * image with something else in one of its gaps has each region reserved
+ * on its own.
+ */
+
+#define LAZY_IMG  "img_files/lazy.img"
+#define LAZY_BASE 0x11600000000UL
+#define REGIONS   5
+
+/* an image whose only function returns straight away, and four data
+ * regions a page apart holding their index */
+static int write_image(const char *path, ulong base, long page_size) {
+    unsigned char ret = 0xc3;
+    static char data[REGIONS][64];
+    ImageRegion regions[REGIONS] = { { .start = base, .end = base + page_size, .src = &ret,
+                                       .src_len = 1, .perms = "r-xp" } };
+    for (int i = 1; i < REGIONS; i++) {
+        regions[i].start = base + 2 * i * page_size;
+        regions[i].end = regions[i].start + page_size;
+        snprintf(data[i], sizeof(data[i]), "region %d", i);
+        regions[i].src = data[i];
+        regions[i].src_len = strlen(data[i]) + 1;
+        strcpy(regions[i].perms, "rw-p");
+    }
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, regions, REGIONS, &entry, 1);
+}
+
+/* the number of mappings of this process that intersect [start, end) */
+static int mappings_in(ulong start, ulong end) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    char line[256];
+    int n = 0;
+    while (maps && fgets(line, sizeof(line), maps)) {
+        ulong lo, hi;
+        if (sscanf(line, "%lx-%lx", &lo, &hi) == 2 && lo < end && hi > start)
+            n++;
+    }
+    if (maps)
+        fclose(maps);
+    return n;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong end = LAZY_BASE + (2 * REGIONS - 1) * page_size;
+    if (write_image(LAZY_IMG, LAZY_BASE, page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    int fd = request_map_ex(LAZY_IMG, SBC_MAP_LAZY);
+    const MappedSubcontext *subctx = subcontext_of(fd);
+    if (fd < 0 || fd == EXIT_FAILURE || !subctx) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+    int failed = 0;
+    failed |= check(subctx->lazy && subctx->lazy->num_reserved == REGIONS &&
+                    subctx->lazy->span_end == end && mappings_in(LAZY_BASE, end) == 1,
+                    "Mapping lazily only reserves the image's addresses");
+
+    int ok = call_subcontext_function(0, fd) == EXIT_SUCCESS;
+    failed |= check(ok && subctx->lazy->num_reserved == REGIONS - 1 && !subctx->is_active,
+                    "A call maps only the code region");
+
+    const char *region3 = (const char *)(LAZY_BASE + 6 * page_size);
+    ok = strcmp(region3, "region 3") == 0;
+    failed |= check(ok && subctx->lazy->num_reserved == REGIONS - 2,
+                    "The first read of a data region maps it with the image's contents");
+
+    failed |= check(sbc_prefault(fd) == 0 && subctx->lazy->num_reserved == 0 &&
+                    subctx->lazy->span_end == 0 &&
+                    strcmp((const char *)(LAZY_BASE + 8 * page_size), "region 4") == 0 &&
+                    mprotect((void *)(LAZY_BASE + page_size), page_size, PROT_READ) == -1,
+                    "sbc_prefault maps the remaining regions and gives back the gaps");
+
+    ok = unmap_subcontext(fd) == 0;
+    failed |= check(ok && mappings_in(LAZY_BASE, end) == 0,
+                    "Unmapping gives back the whole reservation");
+
+    // something of the client's own in the gap between the first two regions
+    void *gap = mmap((void *)(LAZY_BASE + page_size), page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    fd = request_map_ex(LAZY_IMG, SBC_MAP_LAZY);
+    subctx = subcontext_of(fd);
+    ok = gap != MAP_FAILED && subctx && subctx->lazy && subctx->lazy->span_end == 0 &&
+         call_subcontext_function(0, fd) == EXIT_SUCCESS &&
+         strcmp((const char *)(LAZY_BASE + 2 * page_size), "region 1") == 0 &&
+         subctx->lazy->num_reserved == REGIONS - 2;
+    failed |= check(ok && unmap_subcontext(fd) == 0 && mappings_in(LAZY_BASE, end) == 1,
+                    "Regions around other memory are reserved one by one");
+    unlink(LAZY_IMG);
+
+    finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Client code that appears after the client library has started: a
+ * plugin loaded with dlopen and picked up by sbc_sync_client_regions is a
+ * shared library like any other, one loaded with sbc_dlopen is client code
+ * that a subcontext calling into it has to transition back to, and it is
+ * forgotten once unloaded.  So are JIT pages given to sbc_register_region.
+ */
+
+#define LOADER_IMG  "img_files/loader.img"
+#define LOADER_BASE 0x11700000000UL
+#define PLUGIN      "./libsbc_plugin.so"
+
+/* an image whose function calls the function whose address is in the
+ * first quadword of its data page, two pages above the code, unless that
+ * is NULL */
+static int write_image(const char *path, ulong base, long page_size) {
+    ulong data = base + 2 * page_size;
+    unsigned char code[] = {
+        0x48, 0x83, 0xec, 0x08,                          // sub $8, %rsp
+        0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,              // movabs $data, %rax
+        0x48, 0x8b, 0x00,                                // mov (%rax), %rax
+        0x48, 0x85, 0xc0,                                // test %rax, %rax
+        0x74, 0x02,                                      // jz 1f
+        0xff, 0xd0,                                      // call *%rax
+        0x48, 0x83, 0xc4, 0x08,                          // 1: add $8, %rsp
+        0xc3,                                            // ret
+    };
+    memcpy(code + 6, &data, sizeof(data));
+    ImageRegion regions[2] = {
+        { .start = base, .end = base + page_size, .src = code, .src_len = sizeof(code),
+          .perms = "r-xp" },
+        { .start = data, .end = data + page_size, .perms = "rw-p" },
+    };
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, regions, 2, &entry, 1);
+}
+
+static int fd;
+static const SubcontextStats *st;
+static void **callback;
+
+/* the transitions out of the subcontext a call with callback f takes */
+static ulong transitions_out(void *f) {
+    *callback = f;
+    ulong before = st->transitions_out;
+    if (call_subcontext_function(0, fd) != EXIT_SUCCESS)
+        return 0;
+    return st->transitions_out - before;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (write_image(LOADER_IMG, LOADER_BASE, page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    fd = request_map(LOADER_IMG);
+    unlink(LOADER_IMG);
+    const StatsPage *stats = open_stats();
+    if (fd < 0 || fd == EXIT_FAILURE || !stats) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+    st = &stats->subctx[mapped_subcontexts[0].stats_idx];
+    callback = (void **)(LOADER_BASE + 2 * page_size);
+    size_t initial = num_client_regions;
+    int failed = 0;
+
+    void *handle = dlopen(PLUGIN, RTLD_NOW);
+    void (*plugin_function)(void) = handle ? (void (*)(void))dlsym(handle, "plugin_function") : NULL;
+    int *plugin_calls = handle ? dlsym(handle, "plugin_calls") : NULL;
+    if (!plugin_function || !plugin_calls) {
+        fprintf(stderr, "Failed to load %s\n", PLUGIN);
+        return EXIT_FAILURE;
+    }
+    int ok = sbc_sync_client_regions() == 0 && num_client_regions > initial &&
+             is_library_address((void *)plugin_function);
+    failed |= check(ok && transitions_out(plugin_function) == 1 && *plugin_calls == 1,
+                    "A plugin picked up by a sync is a library the subcontext calls directly");
+    size_t synced = num_client_regions;
+    failed |= check(sbc_sync_client_regions() == 0 && num_client_regions == synced,
+                    "Syncing again with nothing loaded changes nothing");
+
+    void *client_handle = sbc_dlopen(PLUGIN, RTLD_NOW);
+    ok = client_handle && !is_library_address((void *)plugin_function);
+    failed |= check(ok && transitions_out(plugin_function) == 2 && *plugin_calls == 2,
+                    "Calling into a plugin loaded with sbc_dlopen transitions to the client");
+
+    dlclose(handle);
+    ok = sbc_dlclose(client_handle) == 0 && num_client_regions == initial;
+    failed |= check(ok && transitions_out(NULL) == 1,
+                    "An unloaded plugin is forgotten and transitions carry on");
+
+    // a JIT page holding a ret
+    unsigned char *jit = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit[0] = 0xc3;
+    mprotect(jit, page_size, PROT_READ | PROT_EXEC);
+    ok = sbc_register_region(jit, 1, PROT_READ | PROT_EXEC) == 0 &&
+         sbc_register_region(jit, page_size, PROT_READ | PROT_EXEC) == -1;
+    failed |= check(ok && transitions_out(jit) == 2,
+                    "Calling into a registered JIT page transitions to the client");
+    ok = sbc_unregister_region(jit, page_size) == 0 && sbc_unregister_region(jit, page_size) == -1;
+    failed |= check(ok && num_client_regions == initial && transitions_out(jit) == 1,
+                    "An unregistered page is called directly again");
+
+    finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "vm_sbc.h"
+
+/*
+ * End-to-end test for in-memory images: start a broker, run the memfd
+ * server (server_test4) against it, fetch the sealed image by name, map it
+ * with map_subcontext_fd() and call into it.  No image file is written at
+ * any point.  Reports snapshot-to-mapped latency.
+ */
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <memfd_server_binary>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char sock_path[SMLBUFSZ];
+    snprintf(sock_path, sizeof(sock_path), "/tmp/sbc_broker_test.%d", getpid());
+
+    init();
+
+    // broker
+    pid_t broker = fork();
+    if (broker == 0)
+        _exit(sbc_broker_run(sock_path) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    // server; it reports when its snapshot started through a pipe
+    int ts_pipe[2];
+    if (pipe(ts_pipe) == -1) {
+        perror("Error creating pipe");
+        return EXIT_FAILURE;
+    }
+    pid_t server = fork();
+    if (server == 0) {
+        close(ts_pipe[0]);
+        char fd_arg[16];
+        snprintf(fd_arg, sizeof(fd_arg), "%d", ts_pipe[1]);
+        execl(argv[1], argv[1], sock_path, fd_arg, (char *)NULL);
+        perror("Error executing server");
+        _exit(EXIT_FAILURE);
+    }
+    close(ts_pipe[1]);
+
+    int status;
+    waitpid(server, &status, 0);
+    unsigned long long snapshot_start = 0;
+    if (read(ts_pipe[0], &snapshot_start, sizeof(snapshot_start)) != sizeof(snapshot_start) ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Server failed to publish its image\n");
+        sbc_broker_stop(sock_path);
+        waitpid(broker, NULL, 0);
+        return EXIT_FAILURE;
+    }
+    close(ts_pipe[0]);
+
+    // client
+    unsigned long long fetch_start = now_ns();
+    int img_fd = sbc_broker_fetch(sock_path, "test4");
+    if (img_fd == -1) {
+        fprintf(stderr, "Failed to fetch image from broker\n");
+        sbc_broker_stop(sock_path);
+        waitpid(broker, NULL, 0);
+        return EXIT_FAILURE;
+    }
+    int handle = map_subcontext_fd(img_fd, "test4");
+    unsigned long long mapped = now_ns();
+
+    sbc_broker_stop(sock_path);
+    waitpid(broker, NULL, 0);
+
+    if (handle != img_fd) {
+        fprintf(stderr, "Failed to map in-memory image\n");
+        return EXIT_FAILURE;
+    }
+
+    int idx = 0;
+    while (call_subcontext_function(idx, handle) == EXIT_SUCCESS)
+        idx++;
+    finalize();
+
+    printf("Fetch+map latency: %llu us\n", (mapped - fetch_start) / 1000);
+    printf("Snapshot-to-mapped latency: %llu us\n", (mapped - snapshot_start) / 1000);
+
+    if (idx != 2) {
+        printf("✗ Expected 2 functions in the in-memory image, called %d\n", idx);
+        return EXIT_FAILURE;
+    }
+    printf("✓ In-memory image mapped and called without touching the filesystem\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Call through a chain of three subcontexts, each calling the next, and
+ * check that the returns from one subcontext into another go straight back
+ * to the caller: the client's permissions must change only when the chain
+ * is entered and left, as for a call into a single subcontext.
+ */
+
+#define DEPTH 3
+#define CALLS 10
+#define BASE  0x10c00000000UL
+#define STRIDE 0x10000000UL
+
+typedef void (*entry_fn)(int);
+
+/* an image whose entry point counts its calls in the second quadword of
+ * its data page and then calls the function in the first, if any */
+static int gen_chain_image(const char *path, unsigned long base) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long data = base + 2 * page_size;
+    int counter_disp = (int)(data + 8 - (base + 7));
+    int next_disp = (int)(data - (base + 14));
+    unsigned char code[] = {
+        0x48, 0xff, 0x05, 0, 0, 0, 0,  // inc qword [rip + counter]
+        0x48, 0x8b, 0x05, 0, 0, 0, 0,  // mov rax, [rip + next]
+        0x48, 0x85, 0xc0,              // test rax, rax
+        0x74, 0x02,                    // jz ret
+        0xff, 0xd0,                    // call rax
+        0xc3,                          // ret
+    };
+    memcpy(code + 3, &counter_disp, 4);
+    memcpy(code + 10, &next_disp, 4);
+
+    ImageRegion regions[2] = {
+        { .start = base, .end = base + page_size, .src = code, .src_len = sizeof(code),
+          .perms = "r-xp" },
+        { .start = data, .end = data + page_size, .perms = "rw-p" },
+    };
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    void (*entry)(int) = (void (*)(int))base;
+    int ret = sbc_write_image(fd, regions, 2, &entry, 1);
+    close(fd);
+    return ret;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    ulong *data[DEPTH];
+
+    init();
+    for (int i = 0; i < DEPTH; i++) {
+        char path[SMLBUFSZ];
+        unsigned long base = BASE + i * STRIDE;
+        snprintf(path, sizeof(path), "img_files/nested%d.img", i);
+        int fd = -1;
+        if (gen_chain_image(path, base) == 0)
+            fd = map_subcontext(path);
+        unlink(path);
+        if (fd < 0 || fd == EXIT_FAILURE) {
+            fprintf(stderr, "Failed to map generated image %d\n", i);
+            return EXIT_FAILURE;
+        }
+        data[i] = (ulong *)(base + 2 * page_size);
+    }
+
+    char name[SMLBUFSZ];
+    sbc_stats_name(getpid(), name, sizeof(name));
+    int stats_fd = shm_open(name, O_RDONLY, 0);
+    const StatsPage *page = stats_fd == -1 ? MAP_FAILED :
+        mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, stats_fd, 0);
+    if (page == MAP_FAILED) {
+        perror("Error mapping stats page");
+        return EXIT_FAILURE;
+    }
+    close(stats_fd);
+
+    // a call into the first subcontext alone, for reference
+    entry_fn first = (entry_fn)BASE;
+    ulong before = page->client_mprotect_calls;
+    first(0);
+    ulong single = page->client_mprotect_calls - before;
+
+    for (int i = 0; i + 1 < DEPTH; i++)
+        data[i][0] = BASE + (i + 1) * STRIDE;
+    before = page->client_mprotect_calls;
+    for (int i = 0; i < CALLS; i++)
+        first(0);
+    ulong chained = page->client_mprotect_calls - before;
+    finalize();
+
+    for (int i = 0; i < DEPTH; i++) {
+        if (data[i][1] != (ulong)CALLS + (i == 0)) {
+            printf("✗ Subcontext %d of the chain ran %lu times\n", i, data[i][1]);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("client mprotect calls: %lu per single call, %lu per chained call\n",
+           single, chained / CALLS);
+    if (chained != CALLS * single) {
+        printf("✗ Returns within the chain went through the client\n");
+        return EXIT_FAILURE;
+    }
+    printf("✓ %d-deep chain of subcontext calls returned without leaving the chain\n", DEPTH);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Subcontexts that have been idle long enough are reclaimed, once, by a
+ * direct sweep or by the background sweeper; ones in use are not, and a
+ * reclaimed subcontext works as before when it is entered again.  A sweep
+ * can run on another thread while a call is inside a subcontext.
+ */
+
+#define IMG_PATH   "img_files/reclaim.img"
+#define BASE       0x10e00000000UL
+#define DATA_PAGES 16
+
+// two flags after the data pages: the subcontext sets the first when it
+// is entered, and spins until the second is set
+#define FLAGS (BASE + (3 + DATA_PAGES) * 4096)
+
+/* function 0 returns straight away; function 1 sets the first flag and
+ * waits for the second */
+static unsigned char code[] = {
+    0xc3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,  // movabs rax, FLAGS
+    0xc6, 0x00, 0x01,                    // mov byte [rax], 1
+    0xf3, 0x90,                          // 1: pause
+    0x80, 0x78, 0x01, 0x00,              // cmp byte [rax + 1], 0
+    0x74, 0xf8,                          // je 1b
+    0xc3,                                // ret
+};
+
+static int write_image(long page_size) {
+    static char data[DATA_PAGES * 4096];
+    static const char flags[2];
+    memset(data, 'r', sizeof(data));
+    ulong flags_addr = FLAGS;
+    memcpy(&code[18], &flags_addr, sizeof(flags_addr));
+    ImageRegion regions[3] = {
+        { .start = BASE, .end = BASE + page_size, .src = code,
+          .src_len = sizeof(code), .perms = "r-xp" },
+        { .start = BASE + 2 * page_size, .end = BASE + (2 + DATA_PAGES) * page_size,
+          .src = data, .src_len = sizeof(data), .perms = "rw-p" },
+        { .start = FLAGS, .end = FLAGS + page_size, .src = flags,
+          .src_len = sizeof(flags), .perms = "rw-p" },
+    };
+    void (*entries[2])(int) = { (void (*)(int))BASE, (void (*)(int))(BASE + 16) };
+    return write_image_file(IMG_PATH, regions, 3, entries, 2);
+}
+
+static int reclaimed_during_call = -1;
+
+/* sweep once the main thread is inside the subcontext, and let it return.
+ * Client code is not executable meanwhile, so this lives in SBC_MM_TEXT
+ * like the sweeper does */
+static SBC_MM_TEXT void *reclaim_during_call(void *arg) {
+    volatile unsigned char *flags = arg;
+    while (!__atomic_load_n(&flags[0], __ATOMIC_ACQUIRE))
+        ;
+    reclaimed_during_call = sbc_reclaim_idle(0, MADV_PAGEOUT, 1);
+    __atomic_store_n(&flags[1], 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int data_intact(long page_size) {
+    const char *data = (const char *)BASE + 2 * page_size;
+    for (long i = 0; i < DATA_PAGES * page_size; i++) {
+        if (data[i] != 'r')
+            return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size != 4096 || write_image(page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    unlink(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+    MappedSubcontext *subctx = &mapped_subcontexts[0];
+
+    ((void (*)(int))BASE)(0);
+    if (!data_intact(page_size) || sbc_reclaim_idle(1000, MADV_PAGEOUT, 1) != 0) {
+        printf("✗ Subcontext in use was reclaimed\n");
+        return EXIT_FAILURE;
+    }
+
+    usleep(100000);
+    if (sbc_reclaim_idle(50, MADV_PAGEOUT, 1) != 1 || !subctx->reclaimed ||
+        sbc_reclaim_idle(50, MADV_PAGEOUT, 1) != 0) {
+        printf("✗ Idle subcontext was not reclaimed exactly once\n");
+        return EXIT_FAILURE;
+    }
+
+    ((void (*)(int))BASE)(0);
+    if (subctx->reclaimed || !data_intact(page_size)) {
+        printf("✗ Reclaimed subcontext did not come back intact\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t sweeper;
+    if (pthread_create(&sweeper, NULL, reclaim_during_call, (void *)FLAGS) != 0) {
+        perror("Error creating sweep thread");
+        return EXIT_FAILURE;
+    }
+    ((void (*)(int))(BASE + 16))(0);
+    pthread_join(sweeper, NULL);
+    if (reclaimed_during_call != 0 || subctx->reclaimed || !data_intact(page_size)) {
+        printf("✗ Sweep during a subcontext call did not leave it alone\n");
+        return EXIT_FAILURE;
+    }
+
+    SbcReclaimConfig config = { .idle_ms = 20, .interval_ms = 10, .pageout_pressure = -1 };
+    if (sbc_reclaim_start(&config) != 0 || sbc_reclaim_start(&config) == 0) {
+        printf("✗ Reclaim sweeper did not start exactly once\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < 100 && !subctx->reclaimed; i++)
+        usleep(10000);
+    sbc_reclaim_stop();
+    if (!subctx->reclaimed) {
+        printf("✗ Reclaim sweeper did not reclaim an idle subcontext\n");
+        return EXIT_FAILURE;
+    }
+    ((void (*)(int))BASE)(0);
+    finalize();
+
+    printf("✓ Idle subcontexts reclaimed once and re-entered intact\n");
+    printf("✓ A sweep on another thread leaves a subcontext call in progress alone\n");
+    return EXIT_SUCCESS;
+}
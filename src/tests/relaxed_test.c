@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Calls into a subcontext mapped SBC_MAP_RELAXED leave the client's code
+ * alone and only change the subcontext's protections, while a subcontext
+ * mapped as usual still takes execute away from the client.  A relaxed
+ * subcontext called directly stays executable after the call until the
+ * next transition, and that does not get in the way of other calls or of
+ * sbc_reset.
+ */
+
+#define RELAXED_IMG  "img_files/relaxed.img"
+#define STRICT_IMG   "img_files/strict.img"
+#define RELAXED_BASE 0x11200000000UL
+#define STRICT_BASE  0x11300000000UL
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (write_ret_image(RELAXED_IMG, RELAXED_BASE, page_size) != EXIT_SUCCESS ||
+        write_ret_image(STRICT_IMG, STRICT_BASE, page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test images\n");
+        return EXIT_FAILURE;
+    }
+    int relaxed = request_map_ex(RELAXED_IMG, SBC_MAP_RELAXED);
+    int strict = request_map_ex(STRICT_IMG, 0);
+    unlink(RELAXED_IMG);
+    unlink(STRICT_IMG);
+    const StatsPage *stats = open_stats();
+    if (relaxed < 0 || relaxed == EXIT_FAILURE || strict < 0 || strict == EXIT_FAILURE ||
+        !stats) {
+        fprintf(stderr, "Failed to map test images\n");
+        return EXIT_FAILURE;
+    }
+    const MappedSubcontext *relaxed_ctx = subcontext_of(relaxed);
+    const SubcontextStats *relaxed_st = &stats->subctx[relaxed_ctx->stats_idx];
+    int failed = 0;
+
+    ulong client_calls = stats->client_mprotect_calls;
+    int ok = call_subcontext_function(0, relaxed) == EXIT_SUCCESS &&
+             call_subcontext_function(0, relaxed) == EXIT_SUCCESS;
+    failed |= check(ok && stats->client_mprotect_calls == client_calls &&
+                    relaxed_st->transitions_in == 2 && relaxed_st->transitions_out == 2 &&
+                    !relaxed_ctx->is_active,
+                    "Relaxed calls leave the client's protections alone");
+
+    ok = call_subcontext_function(0, strict) == EXIT_SUCCESS;
+    failed |= check(ok && stats->client_mprotect_calls > client_calls,
+                    "Other subcontexts still take execute away from the client");
+
+    // a direct call returns without a fault and leaves the subcontext open
+    ((void (*)(int))RELAXED_BASE)(0);
+    ((void (*)(int))RELAXED_BASE)(0);
+    failed |= check(relaxed_ctx->is_active && relaxed_st->transitions_in == 3,
+                    "A direct call leaves the relaxed subcontext executable");
+    ok = call_subcontext_function(0, strict) == EXIT_SUCCESS;
+    failed |= check(ok && !relaxed_ctx->is_active && relaxed_st->transitions_out == 3,
+                    "The next transition closes the relaxed subcontext");
+
+    ((void (*)(int))RELAXED_BASE)(0);
+    failed |= check(sbc_reset(relaxed) == 0 && !relaxed_ctx->is_active,
+                    "sbc_reset closes a relaxed subcontext left open by its caller");
+
+    finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Replace a mapped subcontext with another version of its image and back,
+ * through the same handle, checking that calls reach the new version each
+ * time and that the call buffer survives.  A replacement that cannot be
+ * loaded must leave the running version alone.  A subcontext that called
+ * into another one is not replaced until the call has come back through
+ * it.
+ */
+
+#define OUTER_IMG    "img_files/replace_outer.img"
+#define OUTER_V2_IMG "img_files/replace_outer_v2.img"
+#define INNER_IMG    "img_files/replace_inner.img"
+#define OUTER_BASE   0x11a00000000UL
+#define INNER_BASE   0x11a10000000UL
+
+/* flags in the inner image's data page: it sets the first once it is
+ * running and spins until the second is set */
+#define INNER_FLAGS ((volatile char *)(INNER_BASE + 2 * 4096))
+
+static int write_image(const char *path, ulong base, const unsigned char *code,
+                       size_t code_len, int with_data) {
+    static const char data[2];
+    ImageRegion regions[2] = {
+        { .start = base, .end = base + 4096, .src = code, .src_len = code_len,
+          .perms = "r-xp" },
+        { .start = base + 2 * 4096, .end = base + 3 * 4096, .src = data,
+          .src_len = sizeof(data), .perms = "rw-p" },
+    };
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, regions, with_data ? 2 : 1, &entry, 1);
+}
+
+/* the outer image calls the inner one, which waits to be let go */
+static int write_nested_images(void) {
+    unsigned char outer[] = {
+        0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,  // movabs rax, INNER_BASE
+        0xff, 0xd0,                          // call rax
+        0xc3,                                // ret
+    };
+    unsigned char inner[] = {
+        0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,  // movabs rax, INNER_FLAGS
+        0xc6, 0x00, 0x01,                    // mov byte [rax], 1
+        0x80, 0x78, 0x01, 0x00,              // 1: cmp byte [rax + 1], 0
+        0x74, 0xfa,                          // je 1b
+        0xc3,                                // ret
+    };
+    ulong inner_base = INNER_BASE, inner_flags = (ulong)INNER_FLAGS;
+    memcpy(outer + 2, &inner_base, 8);
+    memcpy(inner + 2, &inner_flags, 8);
+    return write_image(OUTER_IMG, OUTER_BASE, outer, sizeof(outer), 0) != EXIT_SUCCESS ||
+           write_image(OUTER_V2_IMG, OUTER_BASE, outer, sizeof(outer), 0) != EXIT_SUCCESS ||
+           write_image(INNER_IMG, INNER_BASE, inner, sizeof(inner), 1) != EXIT_SUCCESS;
+}
+
+static int outer_fd, replaced;
+
+static void *call_outer(void *arg) {
+    (void)arg;
+    return (void *)(long)call_subcontext_function(0, outer_fd);
+}
+
+static void *replace_outer(void *arg) {
+    (void)arg;
+    int ret = sbc_replace(outer_fd, OUTER_V2_IMG);
+    __atomic_store_n(&replaced, 1, __ATOMIC_RELEASE);
+    return (void *)(long)ret;
+}
+
+/* replace the outer subcontext while a thread it called into the inner
+ * one from is spinning there; both are relaxed, so the client's code,
+ * sbc_replace included, stays executable meanwhile */
+static int replace_under_nested_call(void) {
+    outer_fd = request_map_ex(OUTER_IMG, SBC_MAP_RELAXED);
+    int inner_fd = request_map_ex(INNER_IMG, SBC_MAP_RELAXED);
+    if (outer_fd < 0 || outer_fd == EXIT_FAILURE || inner_fd < 0 || inner_fd == EXIT_FAILURE)
+        return 0;
+    pthread_t caller, replacer;
+    pthread_create(&caller, NULL, call_outer, NULL);
+    while (!INNER_FLAGS[0])
+        sched_yield();
+    pthread_create(&replacer, NULL, replace_outer, NULL);
+    usleep(100000);
+    int waited = !__atomic_load_n(&replaced, __ATOMIC_ACQUIRE);
+    INNER_FLAGS[1] = 1;
+    void *called, *replace_ret;
+    pthread_join(caller, &called);
+    pthread_join(replacer, &replace_ret);
+    return waited && (long)called == EXIT_SUCCESS && (long)replace_ret == EXIT_SUCCESS &&
+           call_subcontext_function(0, outer_fd) == EXIT_SUCCESS;
+}
+
+static int call(int fd, char *result) {
+    size_t size;
+    char *buf = sbc_call_buffer(fd, &size);
+    SbcSlice out;
+    if (!buf || call_subcontext_slice(0, fd, (SbcSlice){ 0, 0 }, &out) != EXIT_SUCCESS ||
+        out.len != 3)
+        return -1;
+    memcpy(result, buf + out.offset, 3);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <v1_img_file> <v2_img_file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (write_nested_images() != 0) {
+        fprintf(stderr, "Failed to write test images\n");
+        return EXIT_FAILURE;
+    }
+    init();
+    int fd = map_subcontext(argv[1]);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    char *buf = sbc_call_buffer(fd, NULL);
+
+    char r[3];
+    int ok = call(fd, r) == 0 && call(fd, r) == 0 && r[0] == 1 && r[1] == 2 && r[2] == 'b';
+    if (!ok) {
+        printf("✗ Version 1 did not run\n");
+        return EXIT_FAILURE;
+    }
+
+    // state comes from the new image, not from the one it replaces
+    ok = sbc_replace(fd, argv[2]) == EXIT_SUCCESS && call(fd, r) == 0 &&
+         r[0] == 2 && r[1] == 1 && r[2] == 'c' && sbc_call_buffer(fd, NULL) == buf;
+    if (!ok) {
+        printf("✗ Calls after replacing with version 2 did not reach it\n");
+        return EXIT_FAILURE;
+    }
+
+    ok = sbc_replace(fd, "img_files/does_not_exist.img") != EXIT_SUCCESS &&
+         call(fd, r) == 0 && r[0] == 2 && r[1] == 2;
+    if (!ok) {
+        printf("✗ A failed replacement disturbed the running version\n");
+        return EXIT_FAILURE;
+    }
+
+    // back to the smaller image: the regions only version 2 has go away
+    ok = sbc_replace(fd, argv[1]) == EXIT_SUCCESS && call(fd, r) == 0 &&
+         r[0] == 1 && r[1] == 1 && call_subcontext_function(0, fd) == EXIT_SUCCESS;
+    finalize();
+    if (!ok) {
+        printf("✗ Replacing back with version 1 failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("✓ Subcontext replaced in place through the same handle\n");
+
+    ok = replace_under_nested_call();
+    unlink(OUTER_IMG);
+    unlink(OUTER_V2_IMG);
+    unlink(INNER_IMG);
+    if (!ok) {
+        printf("✗ A subcontext was replaced while a call from it was still to return\n");
+        return EXIT_FAILURE;
+    }
+    printf("✓ Replacing waits for nested calls to return through the subcontext\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * sbc_reset puts a subcontext's data back the way the image has it, both
+ * what the subcontext wrote itself and what the client wrote into it, and
+ * after the first reset it only has the pages written since to undo.
+ * System calls can only write into the pages left out of that tracking.
+ */
+
+#define IMG_PATH   "img_files/reset.img"
+#define BASE       0x10f00000000UL
+#define DATA_PAGES 8
+
+static int write_image(long page_size) {
+    // movabs rax, <first data byte>; mov byte [rax], 'S'; ret
+    unsigned char code[14] = { 0x48, 0xb8 };
+    unsigned long data_addr = BASE + 2 * page_size;
+    memcpy(code + 2, &data_addr, sizeof(data_addr));
+    memcpy(code + 10, "\xc6\x00\x53\xc3", 4);
+
+    static char data[DATA_PAGES * 4096];
+    memset(data, 'a', sizeof(data));
+    ImageRegion regions[2] = {
+        { .start = BASE, .end = BASE + page_size, .src = code,
+          .src_len = sizeof(code), .perms = "r-xp" },
+        { .start = data_addr, .end = data_addr + DATA_PAGES * page_size, .src = data,
+          .src_len = sizeof(data), .perms = "rw-p" },
+    };
+    void (*entry)(int) = (void (*)(int))BASE;
+    return write_image_file(IMG_PATH, regions, 2, &entry, 1);
+}
+
+static int pristine(const char *data, long page_size) {
+    for (long i = 0; i < DATA_PAGES * page_size; i++) {
+        if (data[i] != 'a')
+            return 0;
+    }
+    return 1;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size != 4096 || write_image(page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    unlink(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+    MappedSubcontext *subctx = &mapped_subcontexts[0];
+    void (*fn)(int) = (void (*)(int))BASE;
+    char *data = (char *)BASE + 2 * page_size;
+
+    // before the first reset nothing is tracked
+    fn(0);
+    data[3 * page_size] = 'X';
+    if (data[0] != 'S' || sbc_reset(fd) != 0 || !pristine(data, page_size)) {
+        printf("✗ First reset did not restore the image's data\n");
+        return EXIT_FAILURE;
+    }
+
+    // after it, exactly the pages written are
+    fn(0);
+    data[5 * page_size + 17] = 'Y';
+    data[5 * page_size + 18] = 'Y';
+    if (!subctx->dirty || subctx->dirty[1].num_dirty != 2) {
+        printf("✗ Writes since the last reset were not tracked\n");
+        return EXIT_FAILURE;
+    }
+    if (sbc_reset(fd) != 0 || !pristine(data, page_size) || subctx->dirty[1].num_dirty != 0) {
+        printf("✗ Tracked reset did not restore the image's data\n");
+        return EXIT_FAILURE;
+    }
+
+    fn(0);
+    data[5 * page_size] = 'Z';
+    if (data[0] != 'S' || data[5 * page_size] != 'Z' || sbc_reset(-1) != -1) {
+        printf("✗ Subcontext did not work normally after a reset\n");
+        return EXIT_FAILURE;
+    }
+
+    // a clean page is read-only to the kernel too, until it is untracked
+    int zero = open("/dev/zero", O_RDONLY);
+    char *buf = data + 6 * page_size;
+    if (read(zero, buf, 16) != -1 || errno != EFAULT) {
+        printf("✗ A system call wrote into a tracked page\n");
+        return EXIT_FAILURE;
+    }
+    if (sbc_reset_untracked(fd, buf, 16) != 0 || read(zero, buf, 16) != 16 || buf[0] != 0 ||
+        sbc_reset(fd) != 0 || !pristine(data, page_size) || read(zero, buf, 16) != 16 ||
+        buf[15] != 0 || buf[16] != 'a' || data[7 * page_size] != 'a' ||
+        sbc_reset(fd) != 0 || !pristine(data, page_size)) {
+        printf("✗ System calls could not write into untracked pages across resets\n");
+        return EXIT_FAILURE;
+    }
+    close(zero);
+    finalize();
+
+    printf("✓ Subcontext reset to its image, tracking only dirtied pages\n");
+    printf("✓ System calls write into pages left out of tracking\n");
+    return EXIT_SUCCESS;
+}
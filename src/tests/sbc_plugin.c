@@ -0,0 +1,7 @@
+/* a plugin for loader_test to load after the client library has started */
+
+int plugin_calls = 0;
+
+void plugin_function(void) {
+    plugin_calls++;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "vm_sbc.h"
+
+/*
+ * In-memory variant of the server tests: the image is written to a sealed
+ * memfd and handed to the broker listening on argv[1] instead of being
+ * written under img_files/.  If argv[2] names a descriptor, the
+ * CLOCK_MONOTONIC time at which the snapshot started is written to it so
+ * the client can report end-to-end latency.
+ */
+
+void function1(int arg) {
+    printf("Hello from test4! arg=%d\n", arg);
+}
+
+void function2(int arg) {
+    int a = 6, b = 7;
+    printf("%d * %d = %d\n", a, b, a * b);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <broker_socket> [timestamp_fd]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    void (*funcs[2])(int) = { function1, function2 };
+
+    // print address of functions for debugging
+    printf("Function addresses:\n");
+    printf("function1: %p\n", (void*)function1);
+    printf("function2: %p\n", (void*)function2);
+
+    unsigned long long start = now_ns();
+    int fd = create_image_memfd(__FILE_NAME__, funcs, 2);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create in-memory image\n");
+        return EXIT_FAILURE;
+    }
+    unsigned long long snapped = now_ns();
+
+    if (sbc_broker_publish(argv[1], "test4", fd) != 0) {
+        fprintf(stderr, "Failed to publish image to broker\n");
+        return EXIT_FAILURE;
+    }
+    unsigned long long published = now_ns();
+    close(fd);
+
+    printf("Snapshot took %llu us, publish took %llu us\n",
+           (snapped - start) / 1000, (published - snapped) / 1000);
+
+    if (argc > 2) {
+        int ts_fd = atoi(argv[2]);
+        if (write(ts_fd, &start, sizeof(start)) != sizeof(start))
+            perror("Error reporting snapshot timestamp");
+        close(ts_fd);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * the functions below call into libc through PLT slots that are never used
+ * before the snapshot, so they only work in the client if the snapshot
+ * bound them (see sbc_bind_now)
+ */
+
+void function1(int arg) {
+    fputs("✓ First call of an unbound function reached libc\n", stdout);
+    fflush(stdout);
+}
+
+void function2(int arg) {
+    char buf[SMLBUFSZ];
+    snprintf(buf, sizeof(buf), "%d-%d", arg + 40, 2);
+    if (strstr(buf, "40-2") != NULL)
+        fputs("✓ Unbound functions returned the right result\n", stdout);
+    else
+        fputs("✗ Unbound functions returned the wrong result\n", stdout);
+    fflush(stdout);
+}
+
+int main(void) {
+    void (*funcs[2])(int) = { function1, function2 };
+
+    // print address of functions for debugging
+    printf("Function addresses:\n");
+    printf("function1: %p\n", (void*)function1);
+    printf("function2: %p\n", (void*)function2);
+
+    if (create_image_file(__FILE_NAME__, funcs, 2) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to create image file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
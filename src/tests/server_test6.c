@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * a server whose functions allocate after being mapped into a client,
+ * from the arena reserved before the snapshot (see sbc_arena.c)
+ */
+
+#define NUM_BLOCKS 1000
+
+// allocated before the snapshot, must survive into the client
+static char *greeting;
+
+void function1(int arg) {
+    if (greeting && strcmp(greeting, "allocated in the server") == 0)
+        fputs("✓ Arena allocation made before the snapshot is intact\n", stdout);
+    else
+        fputs("✗ Arena allocation made before the snapshot was lost\n", stdout);
+    fflush(stdout);
+}
+
+void function2(int arg) {
+    static char *blocks[NUM_BLOCKS];
+    int ok = 1;
+
+    // allocate blocks of varying size, fill them, check them and give them
+    // back twice over, so the second round is served from the free lists
+    for (int round = 0; round < 2 && ok; round++) {
+        for (int i = 0; i < NUM_BLOCKS; i++) {
+            size_t size = 16 + (i % 64) * 24;
+            blocks[i] = sbc_arena_alloc(size);
+            if (!blocks[i]) {
+                ok = 0;
+                break;
+            }
+            memset(blocks[i], i & 0xff, size);
+        }
+        for (int i = 0; i < NUM_BLOCKS && ok; i++) {
+            if ((unsigned char)blocks[i][0] != (i & 0xff))
+                ok = 0;
+            sbc_arena_free(blocks[i]);
+        }
+    }
+
+    if (ok)
+        fputs("✓ Subcontext allocated and freed from its arena\n", stdout);
+    else
+        fputs("✗ Subcontext arena allocation failed\n", stdout);
+    fflush(stdout);
+}
+
+int main(void) {
+    void (*funcs[2])(int) = { function1, function2 };
+
+    if (sbc_arena_init(0) != 0) {
+        fprintf(stderr, "Failed to reserve arena\n");
+        return EXIT_FAILURE;
+    }
+    greeting = sbc_arena_alloc(64);
+    strcpy(greeting, "allocated in the server");
+
+    // print address of functions for debugging
+    printf("Function addresses:\n");
+    printf("function1: %p\n", (void*)function1);
+    printf("function2: %p\n", (void*)function2);
+
+    if (create_image_file(__FILE_NAME__, funcs, 2) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to create image file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
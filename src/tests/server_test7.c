@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * a server with one region of each sharing policy. function1 counts its
+ * calls in all three; sharing_test maps the image in several clients and
+ * checks who sees whose counts
+ */
+
+static unsigned long *private_page, *persistent_page, *anonymous_page;
+
+void function1(int arg) {
+    private_page[0]++;
+    persistent_page[0]++;
+    anonymous_page[0]++;
+    // let the client see the private count too
+    anonymous_page[1] = private_page[0];
+}
+
+int main(void) {
+    void (*funcs[1])(int) = { function1 };
+
+    // three pages between inaccessible guard pages, so that each one is a
+    // mapping of its own and the policies do not spill over to neighbours
+    char *area = mmap(NULL, 7 * 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("Error mapping pages");
+        return EXIT_FAILURE;
+    }
+    private_page = (unsigned long *)(area + 1 * 4096);
+    persistent_page = (unsigned long *)(area + 3 * 4096);
+    anonymous_page = (unsigned long *)(area + 5 * 4096);
+    mprotect(private_page, 4096, PROT_READ | PROT_WRITE);
+    mprotect(persistent_page, 4096, PROT_READ | PROT_WRITE);
+    mprotect(anonymous_page, 4096, PROT_READ | PROT_WRITE);
+    if (sbc_set_sharing(persistent_page, 4096, SBC_SHARE_PERSISTENT) != 0 ||
+        sbc_set_sharing(anonymous_page, 4096, SBC_SHARE_ANONYMOUS) != 0) {
+        fprintf(stderr, "Failed to set sharing policies\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Function addresses:\n");
+    printf("function1: %p\n", (void*)function1);
+
+    if (create_image_file(__FILE_NAME__, funcs, 1) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to create image file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * a server whose function works on data handed over in the call buffer
+ * (see call_subcontext_slice): it upper-cases its input into the space
+ * right after it and returns that as its result
+ */
+
+void function1(int arg) {
+    SbcSlice in = sbc_call_args.in;
+    const char *src = sbc_slice(in);
+    char *dst = sbc_slice((SbcSlice){ in.offset + in.len, in.len });
+    if (!src || !dst)
+        return;
+    // not toupper: libc's locale tables are found through thread-local
+    // state, which belongs to the client's copy of libc
+    for (size_t i = 0; i < in.len; i++)
+        dst[i] = (src[i] >= 'a' && src[i] <= 'z') ? src[i] - 'a' + 'A' : src[i];
+    sbc_return_slice(in.offset + in.len, in.len);
+}
+
+int main(void) {
+    void (*funcs[1])(int) = { function1 };
+
+    printf("Function addresses:\n");
+    printf("function1: %p\n", (void*)function1);
+
+    if (create_image_file(__FILE_NAME__, funcs, 1) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to create image file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * two versions of one server, for replacing one with the other in a
+ * running client (see replace_test).  the version is given on the command
+ * line; version 2 carries a larger heap so the images have different
+ * regions.  function1 reports the version, how often it ran and a byte of
+ * its heap data in the call buffer
+ */
+
+static int version;
+static int calls;
+static char *payload;
+static size_t payload_size;
+
+void function1(int arg) {
+    char *out = sbc_slice((SbcSlice){ 0, 3 });
+    if (!out)
+        return;
+    calls++;
+    out[0] = version;
+    out[1] = calls;
+    out[2] = payload[payload_size - 1];
+    sbc_return_slice(0, 3);
+}
+
+int main(int argc, char **argv) {
+    version = argc > 1 && argv[1][0] == '2' ? 2 : 1;
+    payload_size = version == 2 ? 8 << 20 : 4096;
+    payload = malloc(payload_size);
+    if (!payload)
+        return EXIT_FAILURE;
+    memset(payload, 'a' + version, payload_size);
+
+    void (*funcs[1])(int) = { function1 };
+    printf("function1: %p\n", (void*)function1);
+
+    const char *name = version == 2 ? "server_test9_v2.c" : "server_test9_v1.c";
+    if (create_image_file(name, funcs, 1) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to create image file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "vm_sbc.h"
+
+/*
+ * Map the image of server_test7 in two clients, one after the other, and
+ * check that each region's sharing policy is honoured: the private region
+ * starts over in every client, the shared-anonymous region carries over
+ * between clients, and the shared-persistent region also reaches the
+ * image file.
+ */
+
+#define CLIENTS 2
+
+/* the first word of the region with the given policy */
+static unsigned long *policy_word(const MappedSubcontext *subctx, int policy) {
+    for (size_t i = 0; i < subctx->num_entries; i++) {
+        if (subctx->entries[i].sharing == policy)
+            return (unsigned long *)subctx->entries[i].start;
+    }
+    return NULL;
+}
+
+/* map the image, call into it once and check the counts it leaves */
+static int run_client(const char *img, unsigned long expected_persistent,
+                      unsigned long expected_anonymous) {
+    init();
+    int fd = map_subcontext(img);
+    if (fd < 0 || fd == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    unsigned long *persistent = policy_word(&mapped_subcontexts[0], SBC_SHARE_PERSISTENT);
+    unsigned long *anonymous = policy_word(&mapped_subcontexts[0], SBC_SHARE_ANONYMOUS);
+    if (!persistent || !anonymous) {
+        printf("✗ Image has no shared regions\n");
+        return EXIT_FAILURE;
+    }
+
+    call_subcontext_function(0, fd);
+    finalize();
+    printf("private=%lu persistent=%lu anonymous=%lu\n",
+           anonymous[1], persistent[0], anonymous[0]);
+    if (anonymous[1] != 1 || persistent[0] != expected_persistent ||
+        anonymous[0] != expected_anonymous)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/* read the persistent count from the image file and remove the object
+ * behind the shared-anonymous region, so the next clients start afresh */
+static long scan_image(const char *img) {
+    int fd = open(img, O_RDONLY);
+    Header *header = fd == -1 ? MAP_FAILED :
+                     mmap(NULL, sizeof(Header), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("Error reading image");
+        return -1;
+    }
+    unsigned long count = 0;
+    for (size_t i = 0; i < header->numEntries; i++) {
+        const Entry *entry = &header->entries[i];
+        if (entry->sharing == SBC_SHARE_PERSISTENT) {
+            pread(fd, &count, sizeof(count), entry->offsetIntoFile);
+        } else if (entry->sharing == SBC_SHARE_ANONYMOUS) {
+            char name[SMLBUFSZ];
+            if (sbc_share_name(fd, i, name, sizeof(name)) == 0)
+                shm_unlink(name);
+        }
+    }
+    munmap(header, sizeof(Header));
+    close(fd);
+    return count;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <img_file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // other tests may have called into the image already
+    long before = scan_image(argv[1]);
+    if (before == -1)
+        return EXIT_FAILURE;
+
+    int ok = 1;
+    for (int i = 0; i < CLIENTS && ok; i++) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int ret = run_client(argv[1], before + i + 1, i + 1);
+            fflush(stdout);
+            _exit(ret);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+
+    // the persistent count must also have been written back to the image
+    if (scan_image(argv[1]) != before + CLIENTS)
+        ok = 0;
+
+    if (!ok) {
+        printf("✗ Regions were not shared according to their policies\n");
+        return EXIT_FAILURE;
+    }
+    printf("✓ Private, shared-persistent and shared-anonymous regions behave as set\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "vm_sbc.h"
+
+/*
+ * Compare how long the server is paused by a synchronous create_image_file()
+ * and by sbc_snapshot_async() as the heap grows.  The async snapshot should
+ * only cost the fork, and the server must keep running (and may keep
+ * mutating its heap) while the writer produces an image of the state at
+ * the time of the call: values the server changes as soon as the call has
+ * returned are still the old ones in the image.
+ */
+
+#define IMG_PATH "img_files/async_test.img"
+
+static volatile unsigned long counter = 0;
+
+void function1(int arg) {
+    printf("Hello from the async snapshot test! counter=%lu\n", counter);
+}
+
+static volatile unsigned long generation = 1;
+
+/* read len bytes at addr as the image at path has them */
+static int image_read(const char *path, const void *addr, void *out, size_t len) {
+    static Header header;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    int ret = -1;
+    ulong at = (ulong)addr;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+        for (ulong i = 0; i < header.numEntries; i++) {
+            Entry *entry = &header.entries[i];
+            if (at >= entry->start && at + len <= entry->end) {
+                off_t offset = entry->offsetIntoFile + (at - entry->start);
+                ret = pread(fd, out, len, offset) == (ssize_t)len ? 0 : -1;
+                break;
+            }
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void) {
+    void (*funcs[1])(int) = { function1 };
+    size_t heap_mb[] = { 16, 64, 128 };
+    int failed = 0, stale = 0;
+
+    printf("%10s %10s %17s %17s\n", "heap (MB)", "sync (us)", "async pause (us)", "async total (us)");
+    for (size_t i = 0; i < sizeof(heap_mb) / sizeof(heap_mb[0]); i++) {
+        size_t size = heap_mb[i] << 20;
+        char *heap = malloc(size);
+        if (!heap) {
+            perror("Error allocating heap");
+            return EXIT_FAILURE;
+        }
+        memset(heap, 0xab, size);
+
+        double t0 = now_us();
+        if (create_image_file(__FILE_NAME__, funcs, 1) != EXIT_SUCCESS)
+            failed = 1;
+        double sync_us = now_us() - t0;
+
+        SnapshotJob job;
+        unsigned long taken_at = generation;
+        t0 = now_us();
+        if (sbc_snapshot_async(__FILE_NAME__, funcs, 1, &job) != 0) {
+            fprintf(stderr, "Failed to start async snapshot\n");
+            return EXIT_FAILURE;
+        }
+        double pause_us = now_us() - t0;
+        generation++;
+        heap[size / 2] = (char)0xcd;
+
+        // keep working until the writer reports completion
+        struct pollfd pfd = { .fd = job.done_fd, .events = POLLIN };
+        while (poll(&pfd, 1, 0) == 0) {
+            counter++;
+            heap[counter % size] = (char)counter;
+        }
+        if (sbc_snapshot_wait(&job) != 0)
+            failed = 1;
+        double total_us = now_us() - t0;
+
+        unsigned long image_generation = 0;
+        char image_byte = 0;
+        if (image_read(IMG_PATH, (const void *)&generation, &image_generation,
+                       sizeof(image_generation)) != 0 ||
+            image_read(IMG_PATH, heap + size / 2, &image_byte, 1) != 0 ||
+            image_generation != taken_at || image_byte != (char)0xab)
+            stale = 1;
+
+        printf("%10zu %10.0f %17.0f %17.0f\n", heap_mb[i], sync_us, pause_us, total_us);
+        free(heap);
+    }
+
+    unlink(IMG_PATH);
+    if (failed) {
+        printf("✗ Snapshot failed\n");
+        return EXIT_FAILURE;
+    }
+    printf("✓ Async snapshots completed while the server kept running\n");
+    if (stale) {
+        printf("✗ An async snapshot has values written after it was taken\n");
+        return EXIT_FAILURE;
+    }
+    printf("✓ Async snapshots hold the values from when they were taken\n");
+    return EXIT_SUCCESS;
+}
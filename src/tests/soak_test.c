@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Soak a client: fault-driven calls into one long-lived subcontext, mixed
+ * with map/unmap cycles over a set of generated images, a few of them
+ * mapped at any time.  The run is cut into epochs, and after each one the
+ * number of mappings, open fds and resident pages of the process and the
+ * median call latency are sampled.  None of them may grow from the first
+ * half of the run to the second: mappings and fds not at all, RSS by no
+ * more than allocator noise and latency by no more than scheduling noise.
+ *
+ *   ./soak_test [calls] [map_cycles]
+ *
+ * The defaults keep run_tests quick; a real soak is something like
+ * ./soak_test 2000000 20000, four million transitions.
+ */
+
+#define SOAK_BASE   0x11900000000UL
+#define SOAK_STRIDE 0x10000000UL
+#define IMAGES      16
+#define LIVE        4    // images mapped at a time by the map/unmap cycles
+#define EPOCHS      10
+#define SAMPLE_STEP 16   // time every this many calls
+
+#define DEFAULT_CALLS  20000
+#define DEFAULT_CYCLES 400
+
+#define RSS_SLACK_KB 512
+#define LATENCY_SLACK 2.0
+
+typedef struct soak_sample {
+    long maps;
+    long fds;
+    long rss_kb;
+    ulong call_p50_ns;
+} SoakSample;
+
+/* an image whose only function returns straight away, and two data
+ * regions a page apart so that every image is a few mappings */
+static int write_image(const char *path, ulong base, long page_size) {
+    unsigned char ret = 0xc3;
+    static const char data[] = "soak";
+    ImageRegion regions[3] = { { .start = base, .end = base + page_size, .src = &ret,
+                                 .src_len = 1, .perms = "r-xp" } };
+    for (int i = 1; i < 3; i++) {
+        regions[i].start = base + 2 * i * page_size;
+        regions[i].end = regions[i].start + page_size;
+        regions[i].src = data;
+        regions[i].src_len = sizeof(data);
+        strcpy(regions[i].perms, "rw-p");
+    }
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, regions, 3, &entry, 1);
+}
+
+static long count_maps(void) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (!maps)
+        return -1;
+    long n = 0;
+    int c;
+    while ((c = fgetc(maps)) != EOF)
+        n += c == '\n';
+    fclose(maps);
+    return n;
+}
+
+static long count_fds(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    long n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+        n += ent->d_name[0] != '.';
+    closedir(dir);
+    return n - 1;    // the directory's own fd
+}
+
+static long rss_kb(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long size, resident = -1;
+    if (!statm)
+        return -1;
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(statm);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static ulong now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+    ulong x = *(const ulong *)a, y = *(const ulong *)b;
+    return (x > y) - (x < y);
+}
+
+/* sorts samples in place */
+static ulong median(ulong *samples, size_t n) {
+    qsort(samples, n, sizeof(*samples), cmp_ulong);
+    return n ? samples[n / 2] : 0;
+}
+
+/* the largest value of field over epochs [from, to) */
+#define MAX_OF(samples, field, from, to) ({                          \
+    __typeof__((samples)[0].field) _max = (samples)[from].field;     \
+    for (int _i = (from) + 1; _i < (to); _i++)                       \
+        if ((samples)[_i].field > _max)                              \
+            _max = (samples)[_i].field;                              \
+    _max; })
+
+/* the library reports every call on stdout, so the soak sends stdout to
+ * /dev/null and reports on a copy of it */
+static FILE *report;
+
+static int quiet_stdout(void) {
+    int saved = dup(STDOUT_FILENO), devnull = open("/dev/null", O_WRONLY);
+    if (saved == -1 || devnull == -1 || !(report = fdopen(saved, "w")))
+        return -1;
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long calls = argc > 1 ? atol(argv[1]) : DEFAULT_CALLS;
+    long cycles = argc > 2 ? atol(argv[2]) : DEFAULT_CYCLES;
+    if (calls < EPOCHS * SAMPLE_STEP || cycles < EPOCHS || cycles > calls) {
+        fprintf(stderr, "Usage: %s [calls >= %d] [map_cycles >= %d, <= calls]\n", argv[0],
+                EPOCHS * SAMPLE_STEP, EPOCHS);
+        return EXIT_FAILURE;
+    }
+    if (quiet_stdout() != 0) {
+        perror("Error redirecting stdout");
+        return EXIT_FAILURE;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    char paths[IMAGES + 1][SMLBUFSZ];
+    for (int i = 0; i <= IMAGES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "img_files/soak%d.img", i);
+        if (write_image(paths[i], SOAK_BASE + i * SOAK_STRIDE, page_size) != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed to write test images\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the long-lived subcontext the calls go to is the last image
+    init();
+    long baseline_fds = count_fds();
+    int hot = map_subcontext(paths[IMAGES]);
+    if (hot < 0 || hot == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map %s\n", paths[IMAGES]);
+        return EXIT_FAILURE;
+    }
+
+    long calls_per_epoch = calls / EPOCHS, cycles_per_epoch = cycles / EPOCHS;
+    ulong *latency = malloc((calls_per_epoch / SAMPLE_STEP + 1) * sizeof(ulong));
+    SoakSample samples[EPOCHS];
+    int live[LIVE];
+    long next_image = 0, failures = 0;
+    for (int k = 0; k < LIVE; k++)
+        live[k] = -1;
+
+    for (int epoch = 0; epoch < EPOCHS; epoch++) {
+        size_t timed = 0;
+        // spread the map/unmap cycles evenly between the calls
+        long calls_per_cycle = calls_per_epoch / cycles_per_epoch;
+        for (long i = 0, cycle = 0; i < calls_per_epoch; i++) {
+            if (i == cycle * calls_per_cycle && cycle < cycles_per_epoch) {
+                int slot = cycle++ % LIVE;
+                if (live[slot] >= 0)
+                    failures += unmap_subcontext(live[slot]) != 0;
+                live[slot] = map_subcontext(paths[next_image++ % IMAGES]);
+                if (live[slot] == EXIT_FAILURE)
+                    live[slot] = -1;
+                failures += live[slot] < 0 ||
+                            call_subcontext_function(0, live[slot]) != EXIT_SUCCESS;
+            }
+            if (i % SAMPLE_STEP == 0) {
+                ulong start = now_ns();
+                failures += call_subcontext_function(0, hot) != EXIT_SUCCESS;
+                latency[timed++] = now_ns() - start;
+            } else {
+                failures += call_subcontext_function(0, hot) != EXIT_SUCCESS;
+            }
+        }
+        samples[epoch] = (SoakSample){ .maps = count_maps(), .fds = count_fds(),
+                                       .rss_kb = rss_kb(),
+                                       .call_p50_ns = median(latency, timed) };
+        fprintf(report, "epoch %d: maps=%ld fds=%ld rss=%ldkB call_p50=%luns\n", epoch,
+               samples[epoch].maps, samples[epoch].fds, samples[epoch].rss_kb,
+               samples[epoch].call_p50_ns);
+        fflush(report);
+    }
+    free(latency);
+
+    // the first epoch is warm-up: stats slots, trace rings and the like
+    // are set up the first time round
+    int half = EPOCHS / 2, failed = 0;
+    long first_maps = MAX_OF(samples, maps, 1, half);
+    long first_fds = MAX_OF(samples, fds, 1, half);
+    long first_rss = MAX_OF(samples, rss_kb, 1, half);
+    ulong first_p50s[EPOCHS], second_p50s[EPOCHS];
+    for (int epoch = 1; epoch < EPOCHS; epoch++) {
+        if (epoch < half)
+            first_p50s[epoch - 1] = samples[epoch].call_p50_ns;
+        else
+            second_p50s[epoch - half] = samples[epoch].call_p50_ns;
+    }
+    ulong first_p50 = median(first_p50s, half - 1);
+    ulong second_p50 = median(second_p50s, EPOCHS - half);
+    failed |= check_to(report, failures == 0 && samples[0].maps > 0 && samples[0].fds > 0 &&
+                               samples[0].rss_kb > 0, "Every call and map/unmap cycle succeeds");
+    failed |= check_to(report, MAX_OF(samples, maps, half, EPOCHS) <= first_maps,
+                               "The number of mappings does not grow");
+    failed |= check_to(report, MAX_OF(samples, fds, half, EPOCHS) <= first_fds,
+                               "The number of open fds does not grow");
+    failed |= check_to(report, MAX_OF(samples, rss_kb, half, EPOCHS) <= first_rss + RSS_SLACK_KB,
+                               "RSS does not grow");
+    failed |= check_to(report, second_p50 <= LATENCY_SLACK * first_p50, "Call latency does not grow");
+
+    for (int k = 0; k < LIVE; k++) {
+        if (live[k] >= 0)
+            unmap_subcontext(live[k]);
+    }
+    failed |= check_to(report, unmap_subcontext(hot) == 0 && num_mapped_subcontexts == 0 &&
+                               count_fds() <= baseline_fds,
+                               "Unmapping everything gives back the images' fds");
+    for (int i = 0; i <= IMAGES; i++)
+        unlink(paths[i]);
+    finalize();
+    fclose(report);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
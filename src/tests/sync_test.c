@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * The shared-region synchronization primitives across processes, on a
+ * MAP_SHARED page like the ones clients map for an image's shared
+ * regions: mutex-protected plain increments and counter additions from
+ * every process all add up, and seqlock readers never see a half-written
+ * update.
+ */
+
+#define PROCS 4
+#define ITERS 200000
+
+typedef struct shared {
+    SbcMutex   mutex;
+    ulong      locked_count;  // only changed with mutex held
+    SbcCounter counter;
+    SbcSeqlock seq;
+    ulong      a, b;          // always equal outside a write
+} Shared;
+
+static int worker(Shared *sh, int idx) {
+    for (int i = 0; i < ITERS; i++) {
+        sbc_mutex_lock(&sh->mutex);
+        sh->locked_count++;
+        sbc_mutex_unlock(&sh->mutex);
+        sbc_counter_add(&sh->counter, 1);
+    }
+
+    // the first process writes, the others read
+    for (int i = 0; i < ITERS; i++) {
+        if (idx == 0) {
+            sbc_seq_write_begin(&sh->seq);
+            sh->a++;
+            sh->b++;
+            sbc_seq_write_end(&sh->seq);
+            continue;
+        }
+        ulong a, b;
+        unsigned int seq;
+        do {
+            seq = sbc_seq_read_begin(&sh->seq);
+            a = *(volatile ulong *)&sh->a;
+            b = *(volatile ulong *)&sh->b;
+        } while (sbc_seq_read_retry(&sh->seq, seq));
+        if (a != b)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(void) {
+    Shared *sh = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) {
+        perror("Error mapping shared page");
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    sbc_mutex_lock(&sh->mutex);
+    failed |= check(!sbc_mutex_trylock(&sh->mutex), "A held mutex cannot be taken again");
+    sbc_mutex_unlock(&sh->mutex);
+
+    fflush(stdout);
+    pid_t pids[PROCS];
+    for (int p = 0; p < PROCS; p++) {
+        if ((pids[p] = fork()) == 0)
+            _exit(worker(sh, p));
+    }
+    int readers_ok = 1;
+    for (int p = 0; p < PROCS; p++) {
+        int status;
+        if (waitpid(pids[p], &status, 0) != pids[p] || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS)
+            readers_ok = 0;
+    }
+
+    failed |= check(sh->locked_count == PROCS * ITERS && sh->mutex.state == 0,
+                    "Mutex-protected increments from every process add up");
+    failed |= check(sbc_counter_read(&sh->counter) == PROCS * ITERS,
+                    "Counter additions from every process add up");
+    failed |= check(readers_ok && sh->a == ITERS && sh->b == ITERS && !(sh->seq.seq & 1),
+                    "Seqlock readers only see whole updates");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
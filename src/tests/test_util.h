@@ -0,0 +1,67 @@
+#ifndef _SBC_TEST_UTIL_H
+#define _SBC_TEST_UTIL_H
+
+/*
+ * Helpers shared by the tests that write their own images: writing an
+ * image file, opening the process's stats page, finding a subcontext by
+ * its handle and reporting a check.  Every test is a single file, so they
+ * are defined here.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/* write an image of the given regions to path, replacing what is there */
+static inline int write_image_file(const char *path, const ImageRegion *regions,
+                                   size_t num_regions, void (**funcs)(int), size_t num_funcs) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    int status = sbc_write_image(fd, regions, num_regions, funcs, num_funcs);
+    close(fd);
+    return status;
+}
+
+/* an image whose only function, at base, returns straight away */
+static inline int write_ret_image(const char *path, ulong base, long page_size) {
+    static const unsigned char ret = 0xc3;
+    ImageRegion region = { .start = base, .end = base + page_size, .src = &ret,
+                           .src_len = 1, .perms = "r-xp" };
+    void (*entry)(int) = (void (*)(int))base;
+    return write_image_file(path, &region, 1, &entry, 1);
+}
+
+/* this process's stats page, read-only, or NULL */
+static inline const StatsPage *open_stats(void) {
+    char name[SMLBUFSZ];
+    sbc_stats_name(getpid(), name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+    const StatsPage *page = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return page == MAP_FAILED ? NULL : page;
+}
+
+static inline const MappedSubcontext *subcontext_of(int fd) {
+    for (size_t i = 0; i < num_mapped_subcontexts; i++) {
+        if (mapped_subcontexts[i].fd == fd)
+            return &mapped_subcontexts[i];
+    }
+    return NULL;
+}
+
+/* report a check on out; returns 1 if it failed */
+static inline int check_to(FILE *out, int ok, const char *what) {
+    fprintf(out, "%s %s\n", ok ? "✓" : "✗", what);
+    return ok ? 0 : 1;
+}
+
+static inline int check(int ok, const char *what) {
+    return check_to(stdout, ok, what);
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Trace calls into a subcontext whose name has to be escaped in JSON,
+ * save the trace with sbctrace dump, convert the dump with sbctrace json
+ * and check that the result parses as JSON and holds the transitions
+ * under the subcontext's escaped name.
+ */
+
+#define IMG_PATH  "img_files/trace\"quoted\\name.img"
+#define DUMP_PATH "img_files/trace_test.dump"
+#define JSON_PATH "img_files/trace_test.json"
+#define BASE      0x11b00000000UL
+#define CALLS     4
+
+/* a small JSON parser: each returns the end of the value at p, or NULL if
+ * there is not a well-formed one there */
+static const char *json_value(const char *p);
+
+static const char *skip_ws(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+    return p;
+}
+
+static const char *json_string(const char *p) {
+    if (*p++ != '"')
+        return NULL;
+    for (; *p != '"'; p++) {
+        if ((unsigned char)*p < 0x20)
+            return NULL;
+        if (*p != '\\')
+            continue;
+        p++;
+        if (*p == 'u') {
+            for (int i = 1; i <= 4; i++) {
+                if (!strchr("0123456789abcdefABCDEF", p[i]) || !p[i])
+                    return NULL;
+            }
+            p += 4;
+        } else if (!*p || !strchr("\"\\/bfnrt", *p)) {
+            return NULL;
+        }
+    }
+    return p + 1;
+}
+
+static const char *json_number(const char *p) {
+    const char *start = p += *p == '-';
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (p == start)
+        return NULL;
+    if (*p == '.') {
+        start = ++p;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (p == start)
+            return NULL;
+    }
+    return p;
+}
+
+/* the members of an object or the elements of an array, up to close */
+static const char *json_members(const char *p, char close, int named) {
+    p = skip_ws(p + 1);
+    if (*p == close)
+        return p + 1;
+    for (;;) {
+        if (named) {
+            if (!(p = json_string(p)))
+                return NULL;
+            p = skip_ws(p);
+            if (*p++ != ':')
+                return NULL;
+        }
+        if (!(p = json_value(p)))
+            return NULL;
+        p = skip_ws(p);
+        if (*p == close)
+            return p + 1;
+        if (*p++ != ',')
+            return NULL;
+        p = skip_ws(p);
+    }
+}
+
+static const char *json_value(const char *p) {
+    p = skip_ws(p);
+    if (*p == '{')
+        return json_members(p, '}', 1);
+    if (*p == '[')
+        return json_members(p, ']', 0);
+    if (*p == '"')
+        return json_string(p);
+    return json_number(p);
+}
+
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *buf = malloc(size + 1);
+    if (buf && fread(buf, 1, size, f) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf)
+        buf[size] = '\0';
+    fclose(f);
+    return buf;
+}
+
+int main(void) {
+#if !SBC_TRACE
+    printf("Tracing is compiled out (TRACE=0), nothing to check\n");
+    return EXIT_SUCCESS;
+#endif
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (write_ret_image(IMG_PATH, BASE, page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    init();
+    int fd = map_subcontext(IMG_PATH);
+    unlink(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+
+    sbc_trace_enable(1);
+    for (int i = 0; i < CALLS; i++)
+        ((void (*)(int))BASE)(0);
+    sbc_trace_enable(0);
+
+    char cmd[SMLBUFSZ];
+    snprintf(cmd, sizeof(cmd), "../tools/sbctrace %d dump " DUMP_PATH, getpid());
+    fflush(stdout);
+    int dumped = system(cmd) == 0 &&
+                 system("../tools/sbctrace " DUMP_PATH " json " JSON_PATH) == 0;
+    char *json = dumped ? read_file(JSON_PATH) : NULL;
+    unlink(DUMP_PATH);
+    unlink(JSON_PATH);
+    finalize();
+
+    int failed = 0;
+    failed |= check(json != NULL, "A trace is dumped and converted with sbctrace");
+    const char *end = json ? json_value(json) : NULL;
+    failed |= check(end && *skip_ws(end) == '\0', "The converted trace is well-formed JSON");
+
+    // every call and every return is a transition
+    int transitions = 0;
+    for (const char *p = json; p && (p = strstr(p, "\"cat\":\"transition\"")); p++)
+        transitions++;
+    failed |= check(json && transitions >= 2 * CALLS &&
+                    strstr(json, "\"client -> img_files/trace\\\"quoted\\\\name.img\""),
+                    "The trace holds the calls under the escaped subcontext name");
+    free(json);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
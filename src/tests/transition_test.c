@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Drive fault-driven calls into a mapped image and check that every call
+ * is one transition in and one transition out, as seen through the stats
+ * page that sbcstat reads.
+ */
+
+#define CALLS 100
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <img_file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    init();
+    int fd = map_subcontext(argv[1]);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < CALLS; i++)
+        call_subcontext_function(0, fd);
+    finalize();
+
+    char name[SMLBUFSZ];
+    sbc_stats_name(getpid(), name, sizeof(name));
+    int stats_fd = shm_open(name, O_RDONLY, 0);
+    if (stats_fd == -1) {
+        perror("Error opening stats page");
+        return EXIT_FAILURE;
+    }
+    const StatsPage *page = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, stats_fd, 0);
+    close(stats_fd);
+    if (page == MAP_FAILED) {
+        perror("Error mapping stats page");
+        return EXIT_FAILURE;
+    }
+
+    const SubcontextStats *st = &page->subctx[mapped_subcontexts[0].stats_idx];
+    ulong hist_total = 0;
+    for (int i = 0; i < SBC_HIST_BUCKETS; i++)
+        hist_total += st->cycles_hist[i];
+    printf("in=%lu out=%lu resolved=%lu rejected=%lu mprotect=%lu transitions timed=%lu\n",
+           st->transitions_in, st->transitions_out, st->faults_resolved,
+           st->faults_rejected, st->mprotect_calls, hist_total);
+
+    if (st->transitions_in != CALLS || st->transitions_out != CALLS ||
+        st->faults_resolved != 2 * CALLS || hist_total != 2 * CALLS) {
+        printf("✗ Transition counters do not match %d fault-driven calls\n", CALLS);
+        return EXIT_FAILURE;
+    }
+    printf("✓ %d fault-driven calls counted as %d transitions\n", CALLS, 2 * CALLS);
+    return EXIT_SUCCESS;
+}
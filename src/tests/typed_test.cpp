@@ -0,0 +1,120 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include "sbc.hpp"
+
+/*
+ * Typed exports: the image records a signature for each export given one,
+ * sbc_export_address hands out its address only for that signature, and
+ * the C++ API derives the signature from the function type at compile
+ * time and calls the export like a native function.
+ */
+
+#define TYPED_IMG  "img_files/typed.img"
+#define TYPED_BASE 0x11800000000UL
+
+// the exports, as a header shared by the server and its clients would declare them
+constexpr sbc::Export<long(long, long)> add{0};
+constexpr sbc::Export<double(double, long)> scale{1};
+constexpr sbc::Export<long(const long *, long)> sum{2};
+constexpr sbc::Export<void(int)> untyped{3};
+
+static_assert(sbc::Signature<long(const long *, long)>::value[0] == 'l' &&
+              sbc::Signature<long(const long *, long)>::value[1] == 'p' &&
+              sbc::Signature<long(const long *, long)>::value[2] == 'l' &&
+              sbc::Signature<void(unsigned char, float)>::value[0] == 'v' &&
+              sbc::Signature<void(unsigned char, float)>::value[1] == 'i' &&
+              sbc::Signature<void(unsigned char, float)>::value[2] == 'f',
+              "signatures are computed at compile time");
+
+/* an image exporting add, scale and sum, and a function that returns
+ * straight away after them */
+static int write_image(const char *path, unsigned long base, long page_size) {
+    static const unsigned char code[] = {
+        // long add(long a, long b)
+        0x48, 0x8d, 0x04, 0x37,                    // lea (%rdi,%rsi), %rax
+        0xc3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     // ret
+        // double scale(double x, long k)
+        0xf2, 0x48, 0x0f, 0x2a, 0xcf,              // cvtsi2sd %rdi, %xmm1
+        0xf2, 0x0f, 0x59, 0xc1,                    // mulsd %xmm1, %xmm0
+        0xc3, 0, 0, 0, 0, 0, 0,                    // ret
+        // long sum(const long *v, long n)
+        0x31, 0xc0,                                // xor %eax, %eax
+        0x48, 0x85, 0xf6,                          // test %rsi, %rsi
+        0x74, 0x0c,                                // jz 2f
+        0x48, 0x03, 0x07,                          // 1: add (%rdi), %rax
+        0x48, 0x83, 0xc7, 0x08,                    // add $8, %rdi
+        0x48, 0xff, 0xce,                          // dec %rsi
+        0x75, 0xf4,                                // jnz 1b
+        0xc3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 2: ret
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        // the untyped export
+        0xc3,
+    };
+    ImageRegion region = {};
+    region.start = base;
+    region.end = base + page_size;
+    region.src = code;
+    region.src_len = sizeof(code);
+    strcpy(region.perms, "r-xp");
+    const unsigned long offsets[4] = { 0, 16, 32, 64 };
+    void (*funcs[4])(int);
+    for (int i = 0; i < 4; i++)
+        funcs[i] = reinterpret_cast<void (*)(int)>(base + offsets[i]);
+
+    if (sbc::export_signature(add, reinterpret_cast<long (*)(long, long)>(funcs[0])) != 0 ||
+        sbc::export_signature(scale, reinterpret_cast<double (*)(double, long)>(funcs[1])) != 0 ||
+        sbc::export_signature(sum, reinterpret_cast<long (*)(const long *, long)>(funcs[2])) != 0)
+        return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    int status = sbc_write_image(fd, &region, 1, funcs, 4);
+    close(fd);
+    return status;
+}
+
+static int check(bool ok, const char *what) {
+    printf("%s %s\n", ok ? "✓" : "✗", what);
+    return ok ? 0 : 1;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    int failed = 0;
+    failed |= check(sbc_export_signature(0, "x") == -1 && sbc_export_signature(0, "lv") == -1 &&
+                    sbc_export_signature(MAX_FUNC_PTRS, "v") == -1,
+                    "Malformed signatures are rejected");
+    if (write_image(TYPED_IMG, TYPED_BASE, page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    int fd = request_map(TYPED_IMG);
+    unlink(TYPED_IMG);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        fprintf(stderr, "Failed to map test image\n");
+        return EXIT_FAILURE;
+    }
+
+    auto add_fn = reinterpret_cast<long (*)(long, long)>(sbc_export_address(fd, 0, "lll"));
+    failed |= check(add_fn && add_fn(2, 3) == 5 && !sbc_export_address(fd, 0, "lli") &&
+                    !sbc_export_address(fd, 3, "vi") && !sbc_export_address(fd, 4, "v"),
+                    "Exports are handed out for their own signature only");
+
+    auto typed_add = sbc::bind(fd, add);
+    auto typed_scale = sbc::bind(fd, scale);
+    auto typed_sum = sbc::bind(fd, sum);
+    long values[] = { 1, 2, 3, 4, 5 };
+    failed |= check(typed_add && typed_scale && typed_sum && typed_add(40, 2) == 42 &&
+                    typed_scale(1.5, 4) == 6.0 && typed_sum(values, 5) == 15,
+                    "Bound exports are called with their arguments in registers");
+
+    constexpr sbc::Export<int(int, int)> wrong{0};
+    failed |= check(!sbc::bind(fd, wrong) && !sbc::bind(fd, untyped),
+                    "Binding an export as another type fails");
+
+    finalize();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+#include "test_util.h"
+
+/*
+ * Images are verified page by page as they are touched: an intact image
+ * maps and runs, pages first touched by several threads at once are each
+ * verified once, a page corrupted on disk is caught when it is first
+ * touched (and not before), and a file that is not an image is refused.
+ */
+
+#define IMG_PATH "img_files/verify.img"
+#define BASE     0x10d00000000UL
+#define THREADS  8
+#define ROUNDS   500
+
+static const unsigned char ret_insn[] = { 0xc3 };
+
+static int write_image(long page_size) {
+    static char data[4 * 4096];
+    memset(data, 'v', sizeof(data));
+    ImageRegion regions[2] = {
+        { .start = BASE, .end = BASE + page_size, .src = ret_insn,
+          .src_len = sizeof(ret_insn), .perms = "r-xp" },
+        { .start = BASE + 2 * page_size, .end = BASE + 6 * page_size, .src = data,
+          .src_len = sizeof(data), .perms = "rw-p" },
+    };
+    void (*entry)(int) = (void (*)(int))BASE;
+    return write_image_file(IMG_PATH, regions, 2, &entry, 1);
+}
+
+/* map the image in a child and read the given pages of its data region;
+ * returns the child's wait status */
+static int touch_in_child(long page_size, int first, int last) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = map_subcontext(IMG_PATH);
+        if (fd < 0 || fd == EXIT_FAILURE)
+            _exit(2);
+        volatile char sink = 0;
+        for (int p = first; p <= last; p++)
+            sink += ((char *)BASE)[(2 + p) * page_size];
+        fflush(stdout);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
+}
+
+static pthread_barrier_t start;
+
+/* read the four data pages, each thread starting at a different one */
+static void *touch_pages(void *arg) {
+    long page_size = sysconf(_SC_PAGESIZE), first = (long)arg;
+    volatile char sink = 0;
+    pthread_barrier_wait(&start);
+    for (long p = 0; p < 4; p++)
+        sink += ((char *)BASE)[(2 + (first + p) % 4) * page_size];
+    return NULL;
+}
+
+/* map the image, have THREADS threads touch its data pages at once, and
+ * check that each page was verified exactly once */
+static int touch_concurrently(const StatsPage *stats) {
+    int fd = map_subcontext(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE)
+        return 0;
+    const MappedSubcontext *subctx = &mapped_subcontexts[num_mapped_subcontexts - 1];
+    pthread_t threads[THREADS];
+    pthread_barrier_init(&start, NULL, THREADS);
+    for (long t = 0; t < THREADS; t++)
+        pthread_create(&threads[t], NULL, touch_pages, (void *)(t % 4));
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&start);
+    int ok = subctx->pages_pending == 1 && subctx->checks[1].num_pending == 0 &&
+             (subctx->checks[1].pending[0] & 0xf) == 0 &&
+             stats->subctx[subctx->stats_idx].pages_verified == 4;
+    unmap_subcontext(fd);
+    return ok;
+}
+
+int main(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size != 4096 || write_image(page_size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to write test image\n");
+        return EXIT_FAILURE;
+    }
+    init();
+
+    // an intact image: every page touched is verified once
+    int fd = map_subcontext(IMG_PATH);
+    if (fd < 0 || fd == EXIT_FAILURE) {
+        printf("✗ Intact image was not mapped\n");
+        return EXIT_FAILURE;
+    }
+    ((void (*)(int))BASE)(0);
+    volatile char sink = 0;
+    for (int p = 0; p < 4; p++)
+        sink += ((char *)BASE)[(2 + p) * page_size];
+    ((void (*)(int))BASE)(0);
+    finalize();
+
+    const StatsPage *page = open_stats();
+    if (!page || page->subctx[mapped_subcontexts[0].stats_idx].pages_verified != 5) {
+        printf("✗ Touching 5 pages did not verify 5 pages\n");
+        return EXIT_FAILURE;
+    }
+    unmap_subcontext(fd);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        if (!touch_concurrently(page)) {
+            printf("✗ Pages touched by several threads at once were not verified once each\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // corrupt the third data page on disk
+    int img = open(IMG_PATH, O_RDWR);
+    Header header;
+    pread(img, &header, sizeof(header), 0);
+    pwrite(img, "x", 1, header.entries[1].offsetIntoFile + 2 * page_size + 100);
+
+    int status = touch_in_child(page_size, 0, 1);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("✗ Intact pages of a corrupt image could not be used\n");
+        return EXIT_FAILURE;
+    }
+    status = touch_in_child(page_size, 0, 3);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+        printf("✗ Corrupt page was not caught on first touch\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned int bad_magic = 0;
+    pwrite(img, &bad_magic, sizeof(bad_magic), offsetof(Header, magic));
+    close(img);
+    status = touch_in_child(page_size, 0, 0);
+    unlink(IMG_PATH);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 2) {
+        printf("✗ File without image magic was mapped\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("✓ Image pages verified on first touch, corruption caught\n");
+    printf("✓ Concurrent first touches verify each page once\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm_sbc.h"
+
+/*
+ * Standalone image broker.  Servers publish sealed in-memory images to it
+ * and clients fetch them by name, see sbc_ipc.c.
+ *
+ *   sbc_broker <socket_path>          run the broker
+ *   sbc_broker <socket_path> stop     ask a running broker to exit
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <socket_path> [stop]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 2 && strcmp(argv[2], "stop") == 0)
+        return sbc_broker_stop(argv[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    printf("Broker listening on %s\n", argv[1]);
+    return sbc_broker_run(argv[1]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Inspect subcontext images and the subcontexts a client has mapped.
+ *
+ *   sbc_inspect <img_file>   decode an image: header, function table,
+ *                            regions with their file offsets, how much of
+ *                            each region is zero pages, how many pages do
+ *                            not match the checksum table, and how much of
+ *                            the image is in the page cache
+ *   sbc_inspect -p <pid>     for every subcontext mapped by a running
+ *                            client, report resident, copied-on-write,
+ *                            shared, swapped and dirty memory per region
+ *
+ * Live mode joins the client's stats page (names and image descriptors)
+ * with /proc/<pid>/pagemap and /proc/<pid>/smaps.
+ */
+
+// /proc/<pid>/pagemap bits
+#define PM_PRESENT   (1ULL << 63)
+#define PM_SWAPPED   (1ULL << 62)
+#define PM_FILE      (1ULL << 61)
+#define PM_EXCLUSIVE (1ULL << 56)
+
+static long page_size;
+
+/* map a whole image read-only; returns its size through *size */
+static void *map_image(int fd, size_t *size) {
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < (off_t)sizeof(Header)) {
+        fprintf(stderr, "File is too small to be an image\n");
+        return NULL;
+    }
+    void *map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping image");
+        return NULL;
+    }
+    *size = file_size;
+    return map;
+}
+
+static const char *sharing_name(char sharing) {
+    switch (sharing) {
+    case SBC_SHARE_PERSISTENT: return "persist";
+    case SBC_SHARE_ANONYMOUS:  return "anon";
+    default:                   return "private";
+    }
+}
+
+static int page_is_zero(const unsigned char *p) {
+    const uint64_t *w = (const uint64_t *)p;
+    for (size_t i = 0; i < page_size / sizeof(uint64_t); i++) {
+        if (w[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* pages of [off, off + len) of the mapped image that are in the page cache */
+static size_t cached_pages(void *map, size_t off, size_t len) {
+    size_t pages = (len + page_size - 1) / page_size;
+    unsigned char *vec = malloc(pages);
+    size_t cached = 0;
+    if (vec && mincore((char *)map + off, len, vec) == 0) {
+        for (size_t i = 0; i < pages; i++)
+            cached += vec[i] & 1;
+    }
+    free(vec);
+    return cached;
+}
+
+static int inspect_image(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening image");
+        return EXIT_FAILURE;
+    }
+    size_t size;
+    unsigned char *map = map_image(fd, &size);
+    close(fd);
+    if (!map)
+        return EXIT_FAILURE;
+
+    Header *header = (Header *)map;
+    if (header->magic != SBC_IMAGE_MAGIC || header->version != SBC_IMAGE_VERSION) {
+        fprintf(stderr, "Not an image of version %u\n", SBC_IMAGE_VERSION);
+        return EXIT_FAILURE;
+    }
+    if (header->numEntries > MAX_ENTRIES) {
+        fprintf(stderr, "Implausible entry count %lu, not an image?\n", header->numEntries);
+        return EXIT_FAILURE;
+    }
+    const ulong *checksums = NULL;
+    if (header->checksumOffset && header->checksumBlock == (ulong)page_size &&
+        header->checksumOffset < size)
+        checksums = (const ulong *)(map + header->checksumOffset);
+
+    printf("image:    %s\n", path);
+    printf("size:     %zu bytes\n", size);
+    printf("regions:  %lu\n", header->numEntries);
+    printf("checksums: %s\n", checksums ? "yes" : "none");
+    printf("functions:\n");
+    for (int i = 0; i < MAX_FUNC_PTRS; i++) {
+        if (header->func_ptr[i])
+            printf("  [%2d] %p %.*s\n", i, (void *)header->func_ptr[i], SBC_SIG_LEN,
+                   header->funcSig[i]);
+    }
+
+    printf("\n%-4s %-33s %-5s %-7s %10s %10s %10s %8s %6s %10s\n", "idx", "range", "perms",
+           "sharing", "size KB", "offset", "zero KB", "zero %", "bad", "cached KB");
+    size_t total = 0, total_zero = 0, total_cached = 0, total_bad = 0, block = 0;
+    for (unsigned long i = 0; i < header->numEntries; i++) {
+        Entry *entry = &header->entries[i];
+        size_t len = entry->end - entry->start;
+        size_t zero = 0, bad = 0;
+        size_t first_block = block;
+        block += len / page_size;
+        size_t avail = entry->offsetIntoFile < size ? size - entry->offsetIntoFile : 0;
+        if (len > avail)
+            len = avail;
+        for (size_t off = 0; off + page_size <= len; off += page_size) {
+            const unsigned char *page = map + entry->offsetIntoFile + off;
+            zero += page_is_zero(page);
+            // shared regions are written after the image is, so they
+            // are expected to differ
+            if (checksums && entry->sharing == SBC_SHARE_PRIVATE &&
+                (const char *)&checksums[block] <= (const char *)map + size &&
+                sbc_page_hash(page, page_size) != checksums[first_block + off / page_size])
+                bad++;
+        }
+        size_t cached = cached_pages(map, entry->offsetIntoFile, len);
+        size_t pages = len / page_size;
+
+        printf("%-4lu %016lx-%016lx %-5s %-7s %10zu %10lu %10zu %7.1f%% %6zu %10zu\n",
+               i, entry->start, entry->end, entry->perms, sharing_name(entry->sharing), len >> 10,
+               entry->offsetIntoFile, zero * page_size >> 10,
+               pages ? 100.0 * zero / pages : 0.0, bad, cached * page_size >> 10);
+        total += pages;
+        total_zero += zero;
+        total_cached += cached;
+        total_bad += bad;
+    }
+    printf("\ntotal: %zu KB in regions, %zu KB zero pages (%.1f%%), %zu pages failing "
+           "their checksum, %zu KB in page cache\n",
+           total * page_size >> 10, total_zero * page_size >> 10,
+           total ? 100.0 * total_zero / total : 0.0, total_bad, total_cached * page_size >> 10);
+    munmap(map, size);
+    return EXIT_SUCCESS;
+}
+
+/* memory of one region of a live client */
+typedef struct region_usage {
+    size_t resident, cow, shared, swapped;  // pages, from pagemap
+    size_t rss_kb, private_dirty_kb, shared_dirty_kb;  // from smaps
+} RegionUsage;
+
+static void pagemap_usage(int pagemap_fd, Entry *entry, RegionUsage *u) {
+    uint64_t buf[512];
+    ulong addr = entry->start;
+    while (addr < entry->end) {
+        size_t pages = (entry->end - addr) / page_size;
+        if (pages > 512)
+            pages = 512;
+        ssize_t n = pread(pagemap_fd, buf, pages * sizeof(uint64_t),
+                          (addr / page_size) * sizeof(uint64_t));
+        if (n <= 0)
+            return;
+        for (size_t i = 0; i < (size_t)n / sizeof(uint64_t); i++) {
+            if (buf[i] & PM_PRESENT) {
+                u->resident++;
+                // a private page that is no longer backed by the image
+                // has been copied on write
+                if (!(buf[i] & PM_FILE))
+                    u->cow++;
+                if (!(buf[i] & PM_EXCLUSIVE))
+                    u->shared++;
+            } else if (buf[i] & PM_SWAPPED) {
+                u->swapped++;
+            }
+        }
+        addr += (n / sizeof(uint64_t)) * page_size;
+    }
+}
+
+/* add up the smaps counters of every VMA inside the region */
+static void smaps_usage(FILE *smaps, Entry *entry, RegionUsage *u) {
+    char line[SMLBUFSZ];
+    int inside = 0;
+    rewind(smaps);
+    while (fgets(line, sizeof(line), smaps)) {
+        unsigned long start, end;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            inside = start >= entry->start && end <= entry->end;
+        } else if (inside && sscanf(line, "Rss: %zu kB", &kb) == 1) {
+            u->rss_kb += kb;
+        } else if (inside && sscanf(line, "Private_Dirty: %zu kB", &kb) == 1) {
+            u->private_dirty_kb += kb;
+        } else if (inside && sscanf(line, "Shared_Dirty: %zu kB", &kb) == 1) {
+            u->shared_dirty_kb += kb;
+        }
+    }
+}
+
+static int inspect_pid(pid_t pid) {
+    char path[SMLBUFSZ];
+    sbc_stats_name(pid, path, sizeof(path));
+    int stats_fd = shm_open(path, O_RDONLY, 0);
+    if (stats_fd == -1) {
+        perror("Error opening stats page (is the process an SBC client?)");
+        return EXIT_FAILURE;
+    }
+    const StatsPage *stats = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, stats_fd, 0);
+    close(stats_fd);
+    if (stats == MAP_FAILED || stats->magic != SBC_STATS_MAGIC ||
+        stats->version != SBC_STATS_VERSION) {
+        fprintf(stderr, "%s is not a stats page this tool understands\n", path);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", (int)pid);
+    int pagemap_fd = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), "/proc/%d/smaps", (int)pid);
+    FILE *smaps = fopen(path, "r");
+    if (pagemap_fd == -1 || !smaps) {
+        perror("Error opening /proc/<pid>/pagemap or smaps");
+        return EXIT_FAILURE;
+    }
+
+    for (int s = 0; s < MAX_IMG_FILES; s++) {
+        const SubcontextStats *st = &stats->subctx[s];
+        if (!st->in_use)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)pid, st->fd);
+        int img_fd = open(path, O_RDONLY);
+        size_t size;
+        unsigned char *map = img_fd == -1 ? NULL : map_image(img_fd, &size);
+        if (img_fd != -1)
+            close(img_fd);
+        if (!map) {
+            fprintf(stderr, "Could not open the image of %s through %s\n", st->name, path);
+            continue;
+        }
+        Header *header = (Header *)map;
+
+        printf("subcontext %s (%lu regions)\n", st->name, header->numEntries);
+        printf("  %-33s %-5s %9s %9s %9s %9s %9s %9s %9s\n", "range", "perms", "size KB",
+               "rss KB", "cow KB", "shared KB", "swap KB", "pdirty KB", "cached KB");
+        RegionUsage total = {0};
+        size_t total_size = 0, total_cached = 0;
+        for (unsigned long i = 0; i < header->numEntries && i < MAX_ENTRIES; i++) {
+            Entry *entry = &header->entries[i];
+            RegionUsage u = {0};
+            pagemap_usage(pagemap_fd, entry, &u);
+            smaps_usage(smaps, entry, &u);
+            size_t len = entry->end - entry->start;
+            size_t cached = entry->offsetIntoFile + len <= size ?
+                            cached_pages(map, entry->offsetIntoFile, len) : 0;
+
+            printf("  %016lx-%016lx %-5s %9zu %9zu %9zu %9zu %9zu %9zu %9zu\n",
+                   entry->start, entry->end, entry->perms, len >> 10,
+                   u.resident * page_size >> 10, u.cow * page_size >> 10,
+                   u.shared * page_size >> 10, u.swapped * page_size >> 10,
+                   u.private_dirty_kb, cached * page_size >> 10);
+            total.resident += u.resident;
+            total.cow += u.cow;
+            total.shared += u.shared;
+            total.swapped += u.swapped;
+            total.private_dirty_kb += u.private_dirty_kb;
+            total.shared_dirty_kb += u.shared_dirty_kb;
+            total_size += len;
+            total_cached += cached;
+        }
+        printf("  total: %zu KB mapped, %zu KB resident, %zu KB copied on write, "
+               "%zu KB shared, %zu KB swapped, %zu KB private dirty, %zu KB shared dirty, "
+               "%zu KB of the image cached\n\n",
+               total_size >> 10, total.resident * page_size >> 10,
+               total.cow * page_size >> 10, total.shared * page_size >> 10,
+               total.swapped * page_size >> 10, total.private_dirty_kb,
+               total.shared_dirty_kb, total_cached * page_size >> 10);
+        munmap(map, size);
+    }
+
+    fclose(smaps);
+    close(pagemap_fd);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (argc == 3 && strcmp(argv[1], "-p") == 0)
+        return inspect_pid(atoi(argv[2]));
+    if (argc == 2)
+        return inspect_image(argv[1]);
+    fprintf(stderr, "Usage: %s <img_file>\n       %s -p <pid>\n", argv[0], argv[0]);
+    return EXIT_FAILURE;
+}
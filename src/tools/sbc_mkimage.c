@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Build an image straight from a statically linked, non-PIE ELF executable,
+ * without running it.  Every PT_LOAD segment becomes a region at its link
+ * address, initialised from the file and zero-filled past its file size
+ * (.bss), and the named functions become the image's exports.
+ *
+ *   sbc_mkimage <elf> <img_file> <function>[:<signature>]...
+ *
+ * A function given with a signature (see SBC_SIG_LEN), e.g. "add:lll", is
+ * a typed export that clients can look up with sbc_export_address.
+ *
+ * If the executable defines sbc_call_args, the image gets a call buffer
+ * slot as well.  Nothing in the executable runs, so its startup code
+ * (constructors, libc initialisation, TLS) never happens: exported
+ * functions must not depend on it.
+ */
+
+static long page_size;
+
+/* find a symbol's value in the executable's symbol table; 0 if absent */
+static ulong find_symbol(const unsigned char *elf, size_t elf_size, const char *name) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)elf;
+    if (eh->e_shoff == 0 || eh->e_shoff + (size_t)eh->e_shnum * sizeof(Elf64_Shdr) > elf_size)
+        return 0;
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(elf + eh->e_shoff);
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+            continue;
+        const Elf64_Shdr *strtab = &sh[sh[i].sh_link];
+        if (sh[i].sh_offset + sh[i].sh_size > elf_size ||
+            strtab->sh_offset + strtab->sh_size > elf_size)
+            return 0;
+        const Elf64_Sym *syms = (const Elf64_Sym *)(elf + sh[i].sh_offset);
+        const char *strs = (const char *)elf + strtab->sh_offset;
+        for (size_t s = 0; s < sh[i].sh_size / sizeof(Elf64_Sym); s++) {
+            if (syms[s].st_name < strtab->sh_size && syms[s].st_shndx != SHN_UNDEF &&
+                strcmp(strs + syms[s].st_name, name) == 0)
+                return syms[s].st_value;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <elf> <img_file> <function>[:<signature>]...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening executable");
+        return EXIT_FAILURE;
+    }
+    off_t elf_size = lseek(fd, 0, SEEK_END);
+    const unsigned char *elf = elf_size > (off_t)sizeof(Elf64_Ehdr) ?
+        mmap(NULL, elf_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (elf == MAP_FAILED) {
+        fprintf(stderr, "Could not read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)elf;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_machine != EM_X86_64) {
+        fprintf(stderr, "%s is not an x86-64 ELF executable\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (eh->e_type != ET_EXEC) {
+        fprintf(stderr, "%s is position independent; link it with -no-pie at the "
+                "address it should have in the client\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (eh->e_phoff + (size_t)eh->e_phnum * sizeof(Elf64_Phdr) > (size_t)elf_size) {
+        fprintf(stderr, "%s has a truncated program header table\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // one region per loadable segment, widened to whole pages
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(elf + eh->e_phoff);
+    ImageRegion regions[MAX_ENTRIES];
+    size_t num_regions = 0;
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_type == PT_INTERP || ph[i].p_type == PT_DYNAMIC) {
+            fprintf(stderr, "%s is dynamically linked; link it with -static\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (ph[i].p_type == PT_TLS)
+            fprintf(stderr, "Warning: %s uses thread-local storage, which subcontexts "
+                    "do not set up\n", argv[1]);
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0)
+            continue;
+        if (num_regions >= MAX_ENTRIES || ph[i].p_offset + ph[i].p_filesz > (size_t)elf_size) {
+            fprintf(stderr, "%s has a malformed segment %d\n", argv[1], i);
+            return EXIT_FAILURE;
+        }
+
+        ImageRegion *region = &regions[num_regions];
+        ulong lead = ph[i].p_vaddr & (page_size - 1);
+        region->start = ph[i].p_vaddr - lead;
+        region->end = (ph[i].p_vaddr + ph[i].p_memsz + page_size - 1) & ~(page_size - 1);
+        if (num_regions > 0 && region->start < regions[num_regions - 1].end) {
+            fprintf(stderr, "Segments %d and %d of %s share a page; link with "
+                    "-z separate-code or page-aligned segments\n", i - 1, i, argv[1]);
+            return EXIT_FAILURE;
+        }
+        // the file bytes in front of the segment on its first page come
+        // along, as they would when the kernel maps it
+        region->src = lead <= ph[i].p_offset ? elf + ph[i].p_offset - lead : NULL;
+        region->src_len = region->src ? ph[i].p_filesz + lead : 0;
+        region->perms[0] = (ph[i].p_flags & PF_R) ? 'r' : '-';
+        region->perms[1] = (ph[i].p_flags & PF_W) ? 'w' : '-';
+        region->perms[2] = (ph[i].p_flags & PF_X) ? 'x' : '-';
+        region->perms[3] = 'p';
+        region->perms[4] = '\0';
+        region->sharing = SBC_SHARE_PRIVATE;
+        num_regions++;
+    }
+    if (num_regions == 0) {
+        fprintf(stderr, "%s has no loadable segments\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // the export table, in command line order, each export with its
+    // signature if it is given after a colon
+    void (*funcs[MAX_FUNC_PTRS])(int);
+    size_t num_funcs = 0;
+    for (int i = 3; i < argc; i++) {
+        if (num_funcs >= MAX_FUNC_PTRS) {
+            fprintf(stderr, "At most %d functions can be exported\n", MAX_FUNC_PTRS);
+            return EXIT_FAILURE;
+        }
+        char *sig = strchr(argv[i], ':');
+        if (sig)
+            *sig++ = '\0';
+        ulong addr = find_symbol(elf, elf_size, argv[i]);
+        if (addr == 0) {
+            fprintf(stderr, "%s does not define %s\n", argv[1], argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (sbc_export_signature(num_funcs, sig) != 0)
+            return EXIT_FAILURE;
+        funcs[num_funcs++] = (void (*)(int))addr;
+    }
+
+    int img_fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img_fd == -1) {
+        perror("Error creating image file");
+        return EXIT_FAILURE;
+    }
+    if (sbc_write_image(img_fd, regions, num_regions, funcs, num_funcs) != EXIT_SUCCESS) {
+        close(img_fd);
+        return EXIT_FAILURE;
+    }
+
+    // the call buffer slot, if the executable has one
+    ulong call_args = find_symbol(elf, elf_size, "sbc_call_args");
+    if (call_args && pwrite(img_fd, &call_args, sizeof(call_args),
+                            offsetof(Header, callArgs)) != sizeof(call_args)) {
+        perror("Error recording call argument slot");
+        close(img_fd);
+        return EXIT_FAILURE;
+    }
+    close(img_fd);
+    return EXIT_SUCCESS;
+}
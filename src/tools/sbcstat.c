@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "vm_sbc.h"
+
+/*
+ * Print the matchmaker counters of a running client process.  The process
+ * publishes them in shared memory (see stats_page_init in sbc_mm.c), so it
+ * keeps running while we read.
+ *
+ *   sbcstat <pid>              print the counters once
+ *   sbcstat <pid> <interval>   print per-interval deltas every <interval> seconds
+ */
+
+/* cycles at the given percentile of a log2 histogram (bucket lower bound) */
+static unsigned long hist_percentile(const ulong *hist, double pct) {
+    ulong total = 0;
+    for (int i = 0; i < SBC_HIST_BUCKETS; i++)
+        total += hist[i];
+    if (total == 0)
+        return 0;
+    ulong target = (ulong)(total * pct);
+    ulong seen = 0;
+    for (int i = 0; i < SBC_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > target)
+            return 1UL << i;
+    }
+    return 1UL << (SBC_HIST_BUCKETS - 1);
+}
+
+static void print_stats(const StatsPage *now, const StatsPage *prev) {
+    printf("%-24s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+           "subcontext", "in", "out", "resolved", "rejected", "mprotect", "verified",
+           "reclaims", "mapped", "p50 cyc", "p99 cyc");
+    for (int i = 0; i < MAX_IMG_FILES; i++) {
+        const SubcontextStats *st = &now->subctx[i];
+        if (!st->in_use)
+            continue;
+        SubcontextStats d = *st;
+        if (prev && prev->subctx[i].in_use && strcmp(prev->subctx[i].name, st->name) == 0) {
+            const SubcontextStats *p = &prev->subctx[i];
+            d.transitions_in -= p->transitions_in;
+            d.transitions_out -= p->transitions_out;
+            d.faults_resolved -= p->faults_resolved;
+            d.faults_rejected -= p->faults_rejected;
+            d.mprotect_calls -= p->mprotect_calls;
+            d.pages_verified -= p->pages_verified;
+            d.reclaims -= p->reclaims;
+            d.regions_mapped -= p->regions_mapped;
+            for (int b = 0; b < SBC_HIST_BUCKETS; b++)
+                d.cycles_hist[b] -= p->cycles_hist[b];
+        }
+        printf("%-24.24s %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n",
+               st->name, d.transitions_in, d.transitions_out, d.faults_resolved,
+               d.faults_rejected, d.mprotect_calls, d.pages_verified, d.reclaims,
+               d.regions_mapped, hist_percentile(d.cycles_hist, 0.50),
+               hist_percentile(d.cycles_hist, 0.99));
+    }
+    printf("client mprotect calls: %lu, unowned faults: %lu\n",
+           now->client_mprotect_calls - (prev ? prev->client_mprotect_calls : 0),
+           now->faults_unowned - (prev ? prev->faults_unowned : 0));
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <pid> [interval_seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    pid_t pid = atoi(argv[1]);
+    int interval = argc > 2 ? atoi(argv[2]) : 0;
+
+    char name[SMLBUFSZ];
+    sbc_stats_name(pid, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("Error opening stats page (is the process an SBC client?)");
+        return EXIT_FAILURE;
+    }
+    const StatsPage *page = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("Error mapping stats page");
+        return EXIT_FAILURE;
+    }
+    if (page->magic != SBC_STATS_MAGIC || page->version != SBC_STATS_VERSION) {
+        fprintf(stderr, "%s is not a stats page this tool understands\n", name);
+        return EXIT_FAILURE;
+    }
+
+    StatsPage prev, now;
+    memcpy(&now, page, sizeof(now));
+    print_stats(&now, NULL);
+    while (interval > 0) {
+        prev = now;
+        sleep(interval);
+        if (kill(pid, 0) == -1)
+            break;
+        memcpy(&now, page, sizeof(now));
+        printf("\n");
+        print_stats(&now, &prev);
+    }
+    return EXIT_SUCCESS;
+}
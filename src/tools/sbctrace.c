@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vm_sbc.h"
+
+/*
+ * Read the transition trace of a running client process (see mm_trace in
+ * sbc_mm.c) and convert it to Chrome trace JSON, which chrome://tracing and
+ * Perfetto display as subcontext residency over time.
+ *
+ *   sbctrace <pid> enable|disable     switch tracing on or off
+ *   sbctrace <pid> dump <file>        save the raw trace (and subcontext names)
+ *   sbctrace <pid|file> json [out]    convert a live trace or a dump to JSON
+ */
+
+/* a dump is the trace buffer followed by the stats page, for the names */
+typedef struct trace_dump {
+    TraceBuffer trace;
+    StatsPage   stats;
+} TraceDump;
+
+static void *map_shm(const char *name, size_t size, int writable) {
+    int fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+    void *p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static TraceBuffer *open_trace(pid_t pid, int writable) {
+    char name[SMLBUFSZ];
+    sbc_trace_name(pid, name, sizeof(name));
+    TraceBuffer *trace = map_shm(name, sizeof(TraceBuffer), writable);
+    if (!trace) {
+        fprintf(stderr, "Could not open trace buffer %s (is the process an SBC client?)\n", name);
+        return NULL;
+    }
+    if (trace->magic != SBC_TRACE_MAGIC || trace->version != SBC_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace buffer this tool understands\n", name);
+        return NULL;
+    }
+    return trace;
+}
+
+/* take a copy of a live trace and the matching subcontext names */
+static int snapshot_live(pid_t pid, TraceDump *dump) {
+    TraceBuffer *trace = open_trace(pid, 0);
+    if (!trace)
+        return -1;
+    memcpy(&dump->trace, trace, sizeof(TraceBuffer));
+
+    char name[SMLBUFSZ];
+    sbc_stats_name(pid, name, sizeof(name));
+    StatsPage *stats = map_shm(name, sizeof(StatsPage), 0);
+    if (stats)
+        memcpy(&dump->stats, stats, sizeof(StatsPage));
+    else
+        memset(&dump->stats, 0, sizeof(StatsPage));
+    return 0;
+}
+
+static int load_dump(const char *path, TraceDump *dump) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("Error opening trace dump");
+        return -1;
+    }
+    size_t n = fread(dump, sizeof(*dump), 1, f);
+    fclose(f);
+    if (n != 1 || dump->trace.magic != SBC_TRACE_MAGIC ||
+        dump->trace.version != SBC_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace dump\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* room for a name once escaped for JSON, every character as \u00XX */
+#define JSON_NAME_LEN (6 * SBC_NAME_LEN + 1)
+
+/* copy s into out as the inside of a JSON string */
+static const char *json_escape(const char *s, char *out, size_t len) {
+    size_t n = 0;
+    for (; *s && n + 7 <= len; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            n += snprintf(out + n, len - n, "\\%c", c);
+        else if (c < 0x20)
+            n += snprintf(out + n, len - n, "\\u%04x", c);
+        else
+            out[n++] = c;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+/* the name of a context, escaped for JSON */
+static const char *ctx_name(const TraceDump *dump, int ctx, char *buf, size_t len) {
+    if (ctx == SBC_CTX_CLIENT)
+        return "client";
+    if (ctx == SBC_CTX_UNKNOWN)
+        return "unknown subcontext";
+    if (ctx >= 0 && ctx < MAX_IMG_FILES && dump->stats.subctx[ctx].name[0]) {
+        char name[SBC_NAME_LEN + 1];
+        snprintf(name, sizeof(name), "%.*s", SBC_NAME_LEN, dump->stats.subctx[ctx].name);
+        return json_escape(name, buf, len);
+    }
+    snprintf(buf, len, "subcontext %d", ctx);
+    return buf;
+}
+
+/* collect the committed events of a ring in order; returns their count */
+static size_t ring_events(const TraceRing *ring, TraceEvent *out) {
+    ulong head = ring->head;
+    ulong first = head > SBC_TRACE_EVENTS ? head - SBC_TRACE_EVENTS : 0;
+    size_t n = 0;
+    for (ulong seq = first; seq < head; seq++) {
+        const TraceEvent *ev = &ring->events[seq & (SBC_TRACE_EVENTS - 1)];
+        if (ev->seq == seq + 1)
+            out[n++] = *ev;
+    }
+    return n;
+}
+
+static void write_json(const TraceDump *dump, FILE *out) {
+    static TraceEvent events[SBC_TRACE_EVENTS];
+    char a[JSON_NAME_LEN], b[JSON_NAME_LEN];
+    pid_t pid = dump->trace.pid;
+    int first = 1;
+    int num_rings = dump->trace.num_rings < SBC_TRACE_THREADS ?
+                    dump->trace.num_rings : SBC_TRACE_THREADS;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int r = 0; r < num_rings; r++) {
+        const TraceRing *ring = &dump->trace.rings[r];
+        size_t n = ring_events(ring, events);
+
+        for (size_t i = 0; i < n; i++) {
+            const TraceEvent *ev = &events[i];
+            double ts = ev->timestamp_ns / 1000.0;
+            double dur = ev->duration_ns / 1000.0;
+            const char *sep = first ? "" : ",\n";
+            first = 0;
+
+            if (ev->type != SBC_TRACE_TRANSITION) {
+                const char *what = ev->type == SBC_TRACE_MAP ? "map" :
+                                   ev->type == SBC_TRACE_UNMAP ? "unmap" : "replace";
+                fprintf(out, "%s{\"name\":\"%s %s\",\"cat\":\"mapping\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"base\":\"0x%lx\"}}",
+                        sep, what,
+                        ctx_name(dump, ev->to_ctx, a, sizeof(a)),
+                        ts, dur, pid, ring->tid, ev->fault_addr);
+                continue;
+            }
+
+            // the cost of the transition itself
+            fprintf(out, "%s{\"name\":\"%s -> %s\",\"cat\":\"transition\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"fault_addr\":\"0x%lx\"}}",
+                    sep, ctx_name(dump, ev->from_ctx, a, sizeof(a)),
+                    ctx_name(dump, ev->to_ctx, b, sizeof(b)),
+                    ts, dur, pid, ring->tid, ev->fault_addr);
+
+            // residency in the target context until the next transition
+            for (size_t j = i + 1; j < n; j++) {
+                if (events[j].type != SBC_TRACE_TRANSITION)
+                    continue;
+                double end = events[j].timestamp_ns / 1000.0;
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"residency\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        ctx_name(dump, ev->to_ctx, a, sizeof(a)),
+                        ts + dur, end - (ts + dur), pid, ring->tid);
+                break;
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr,
+                "Usage: %s <pid> enable|disable\n"
+                "       %s <pid> dump <file>\n"
+                "       %s <pid|file> json [out]\n", argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *cmd = argv[2];
+
+    if (strcmp(cmd, "enable") == 0 || strcmp(cmd, "disable") == 0) {
+        TraceBuffer *trace = open_trace(atoi(argv[1]), 1);
+        if (!trace)
+            return EXIT_FAILURE;
+        trace->enabled = strcmp(cmd, "enable") == 0;
+        return EXIT_SUCCESS;
+    }
+
+    static TraceDump dump;
+
+    if (strcmp(cmd, "dump") == 0) {
+        if (argc < 4 || snapshot_live(atoi(argv[1]), &dump) != 0)
+            return EXIT_FAILURE;
+        FILE *f = fopen(argv[3], "wb");
+        if (!f || fwrite(&dump, sizeof(dump), 1, f) != 1) {
+            perror("Error writing trace dump");
+            return EXIT_FAILURE;
+        }
+        fclose(f);
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(cmd, "json") == 0) {
+        struct stat st;
+        int loaded = stat(argv[1], &st) == 0 ? load_dump(argv[1], &dump)
+                                             : snapshot_live(atoi(argv[1]), &dump);
+        if (loaded != 0)
+            return EXIT_FAILURE;
+        FILE *out = argc > 3 ? fopen(argv[3], "w") : stdout;
+        if (!out) {
+            perror("Error opening output file");
+            return EXIT_FAILURE;
+        }
+        write_json(&dump, out);
+        if (out != stdout)
+            fclose(out);
+        return EXIT_SUCCESS;
+    }
+
+    fprintf(stderr, "Unknown command: %s\n", cmd);
+    return EXIT_FAILURE;
+}
@@ -5,9 +5,30 @@
 #include <sys/types.h>
 #include <signal.h>
 
+// compile with -DSBC_VERBOSE=1 (make VERBOSE=1) to have the matchmaker
+// report every fault it handles. off by default: the signal handler path
+// should not touch stdio
+#ifndef SBC_VERBOSE
+#define SBC_VERBOSE 0
+#endif
+
+// compile with -DSBC_TRACE=0 (make TRACE=0) to leave the transition trace
+// out entirely. when compiled in it costs one load and branch per
+// transition until it is enabled
+#ifndef SBC_TRACE
+#define SBC_TRACE 1
+#endif
+
+// code that runs inside the SIGSEGV handler is kept in its own section so
+// that it stays executable while client code is disabled
+#define SBC_MM_TEXT __attribute__((section("sbc_mm_text")))
+
 // buffer size for reading /proc/self/maps
 #define BUFSZ 16000
 
+// buffer size for reading all of /proc/self/maps when snapshotting
+#define MAPS_BUFSZ 131072
+
 // for reading smaller things
 #define SMLBUFSZ 256
 
@@ -17,22 +38,127 @@
 // max num of function pointers to store
 #define MAX_FUNC_PTRS 16
 
+// the signature of an exported function, as recorded by
+// sbc_export_signature: its return type and then each parameter type, one
+// character each for how the value travels in a call: 'i' an integer of
+// up to 4 bytes, 'l' one of 8 bytes, 'p' a pointer, 'f' a float, 'd' a
+// double, and 'v' for a void return.  "lpl" is long f(void *, long), "v"
+// is void f(void).  Room for the NUL included
+#define SBC_SIG_LEN 16
+
 // max num of image files that a client process can map
 #define MAX_IMG_FILES 32
 
+// max length of an image name passed between processes
+#define SBC_NAME_LEN 64
+
+// depth of the matchmaker's per-thread stack of nested subcontext calls
+#define SBC_MM_STACK_DEPTH 16
+
+// number of log2 buckets in the per-transition cycle histograms
+#define SBC_HIST_BUCKETS 32
+
+// identifies a stats page published by a client process
+#define SBC_STATS_MAGIC   0x73626373u
+#define SBC_STATS_VERSION 5
+
+// identifies an image file, and the layout of its header
+#define SBC_IMAGE_MAGIC   0x73626369u
+#define SBC_IMAGE_VERSION 2
+
+// how a region is shared between the clients that map an image, chosen
+// by the server with sbc_set_sharing
+#define SBC_SHARE_PRIVATE    0  // copy-on-write in every client (default)
+#define SBC_SHARE_PERSISTENT 1  // writes go to the image and every client
+#define SBC_SHARE_ANONYMOUS  2  // shared by the clients on this host, never written back
+#define SBC_SHARE_MAX        8  // max number of sbc_set_sharing ranges
+
+// request_map_ex flags
+#define SBC_MAP_RELAXED 1  // trusted not to call client code: the client stays executable
+#define SBC_MAP_LAZY    2  // only reserve the regions; each is mapped on its first fault
+
+// max number of sbc_exclude ranges, and of sbc_include_only ranges
+#define SBC_RANGES_MAX 16
+
+// max number of sbc_reset_untracked ranges per subcontext
+#define SBC_UNTRACKED_MAX 16
+
 typedef struct entry {
     ulong start, end;
     ulong offsetIntoFile;
     char perms[5];  // store perms
+    char sharing;   // SBC_SHARE_*
 } Entry;
 
+// default size of the buffer shared between a client and each subcontext
+// that takes call arguments. it is committed lazily
+#define SBC_CALL_BUFFER_SIZE (64UL << 20)
+
+// part of a call buffer, by offset and length
+typedef struct sbc_slice {
+    size_t offset, len;
+} SbcSlice;
+
+// where a subcontext finds its call arguments. the server library has one
+// of these in every image; the client points it at the call buffer and
+// fills in the slices before each call
+typedef struct sbc_call_args {
+    char  *buffer;  // the call buffer, as mapped in the client
+    size_t size;
+    SbcSlice in;    // handed to the subcontext by the client
+    SbcSlice out;   // handed back by the subcontext, empty if it returned nothing
+} SbcCallArgs;
+
 // TODO: make this more flexible?
 typedef struct header {
+    unsigned int magic;    // SBC_IMAGE_MAGIC
+    unsigned int version;  // SBC_IMAGE_VERSION
     void (*func_ptr[MAX_FUNC_PTRS])(int);
+    char funcSig[MAX_FUNC_PTRS][SBC_SIG_LEN];  // each export's signature, "" if untyped
     ulong numEntries;
+    ulong snapshotId;  // when the image was written, tells rewrites of one file apart
+    SbcCallArgs *callArgs;  // the image's call argument slot, or NULL
+    // the checksum table: one sbc_page_hash per checksumBlock bytes of
+    // every region, in entry order, at checksumOffset (0 if there is none)
+    ulong checksumOffset;
+    ulong checksumBlock;
     Entry entries[MAX_ENTRIES];
 } Header;
 
+// lazy verification state of one region of a mapped subcontext: pages are
+// kept inaccessible until their first fault checks them against the
+// image's checksum table
+typedef struct region_check {
+    unsigned char *pending;  // one bit per page still to be verified
+    size_t num_pending;
+    size_t first_block;      // index of the region's first page in the table
+    int    verifying;        // held while one of its pages is verified
+} RegionCheck;
+
+// write tracking of one writable private region, for sbc_reset: clean
+// pages are kept read-only and the first write to one marks it dirty
+typedef struct dirty_map {
+    unsigned char *bits;  // one bit per page written since the last reset, or
+                          // NULL if the region is not tracked
+    size_t num_dirty;
+} DirtyMap;
+
+// states of a region of a subcontext mapped SBC_MAP_LAZY
+#define SBC_LAZY_MAPPED   0
+#define SBC_LAZY_RESERVED 1  // inaccessible until its first fault
+#define SBC_LAZY_MAPPING  2  // being mapped by a fault on another thread
+
+// the regions of a subcontext mapped SBC_MAP_LAZY: their addresses are
+// reserved up front and each one is mapped from the image when it is
+// first touched
+typedef struct lazy_map {
+    unsigned char *state;       // SBC_LAZY_* per entry
+    size_t num_reserved;        // entries not mapped yet
+    ulong span_start, span_end; // one reservation over the regions and the gaps
+                                // between them, or 0 if each has its own
+    int writable;               // the image descriptor is writable
+} LazyMap;
+
 // data structure to track mapped subcontexts
 typedef struct mapped_subcontext {
     char    img_file[256];
@@ -43,16 +169,177 @@ typedef struct mapped_subcontext {
     size_t  num_entries;
     Header *header;
     int     is_active;  // a flag indicating whether this subcontext is currently executable
+    int     on_stack;   // times it is a caller on some thread's transition stack
+    int     stats_idx;  // slot in the stats page, -1 if none was free
+    char   *call_buf;   // buffer shared with the subcontext for call arguments, or NULL
+    size_t  call_buf_size;
+    RegionCheck *checks;     // per entry, or NULL if the image is not being verified
+    const ulong *checksums;  // the image's checksum table, mapped
+    size_t  checksums_len;   // bytes mapped at checksums
+    size_t  pages_pending;   // pages of all entries still to be verified
+    ulong   last_transition_ns;  // last entered or left, on mm_coarse_clock
+    int     reclaimed;           // advised away while idle and not entered since
+    int     prefetch_on_entry;   // ask for the pages back on the next entry
+    DirtyMap *dirty;             // per entry, once sbc_reset has started tracking writes
+    struct { ulong start, end; } untracked[SBC_UNTRACKED_MAX];  // given to sbc_reset_untracked
+    size_t  num_untracked;
+    int     relaxed;             // mapped with SBC_MAP_RELAXED
+    LazyMap *lazy;               // mapped with SBC_MAP_LAZY, or NULL
 } MappedSubcontext;
 
-// client process memory regions
+// how a client region became known to the matchmaker
+#define SBC_REGION_INITIAL    0  // in the process when the client library started
+#define SBC_REGION_LOADED     1  // part of an object loaded since (sbc_sync_client_regions)
+#define SBC_REGION_REGISTERED 2  // given to sbc_register_region
+
+// client process memory regions, sorted by address
 // use for re-enabling client permissions
 typedef struct client_region {
     void *start;
     void *end;
     int original_prot;
+    int is_library;  // shared library code, left executable while subcontexts run
+    int origin;      // SBC_REGION_*
 } ClientRegion;
 
+// a region to be written into an image by sbc_write_image
+typedef struct image_region {
+    ulong start, end;
+    const void *src;  // contents to copy, or NULL to leave the region zero-filled
+    size_t src_len;   // bytes to copy from src; the rest of the region is zero
+    char perms[5];
+    char sharing;     // SBC_SHARE_*
+} ImageRegion;
+
+// matchmaker counters for one mapped subcontext. all counters only ever
+// increase; readers take differences between samples
+typedef struct subcontext_stats {
+    char  name[SBC_NAME_LEN];
+    int   in_use;
+    int   fd;               // the image descriptor, reachable as /proc/<pid>/fd/<fd>
+    ulong transitions_in;   // client or another subcontext -> this subcontext
+    ulong transitions_out;  // this subcontext -> client or another subcontext
+    ulong faults_resolved;  // faults that caused a transition in or out
+    ulong faults_rejected;  // faults inside this subcontext that were not transitions
+    ulong mprotect_calls;   // mprotect calls on this subcontext's regions
+    ulong pages_verified;   // pages checked against the image's checksums
+    ulong reclaims;         // times its memory was given back while idle
+    ulong regions_mapped;   // regions mapped on their first fault (SBC_MAP_LAZY)
+    ulong cycles_hist[SBC_HIST_BUCKETS];  // transition cost, bucket i holds [2^i, 2^(i+1)) cycles
+} SubcontextStats;
+
+// per-process stats published in shared memory as /sbcstat.<pid>, so that
+// tools/sbcstat can read them while the process runs
+typedef struct stats_page {
+    unsigned int magic;
+    unsigned int version;
+    pid_t pid;
+    ulong faults_unowned;        // faults outside every subcontext and client region
+    ulong client_mprotect_calls; // mprotect calls on client regions
+    SubcontextStats subctx[MAX_IMG_FILES];
+} StatsPage;
+
+// number of per-thread rings in the trace buffer, and events per ring
+// (must be a power of two)
+#define SBC_TRACE_THREADS 8
+#define SBC_TRACE_EVENTS  4096
+
+// identifies a trace buffer published by a client process
+#define SBC_TRACE_MAGIC   0x73626374u
+#define SBC_TRACE_VERSION 1
+
+// trace event types
+#define SBC_TRACE_TRANSITION 1
+#define SBC_TRACE_MAP        2
+#define SBC_TRACE_UNMAP      3
+#define SBC_TRACE_REPLACE    4  // duration is the pause, not the whole sbc_replace
+
+// context ids used in trace events for the client itself and for a
+// subcontext that got no stats slot; others are identified by their slot
+#define SBC_CTX_CLIENT  -1
+#define SBC_CTX_UNKNOWN -2
+
+typedef struct trace_event {
+    ulong seq;           // index of the event in its ring + 1, written last
+    ulong timestamp_ns;  // CLOCK_MONOTONIC when the event started
+    ulong duration_ns;
+    ulong fault_addr;    // faulting address, or image base for map/unmap
+    short from_ctx;
+    short to_ctx;
+    int   type;
+} TraceEvent;
+
+// events recorded by one thread. only that thread writes to it
+typedef struct trace_ring {
+    int   tid;
+    ulong head;  // number of events ever reserved in this ring
+    TraceEvent events[SBC_TRACE_EVENTS];
+} TraceRing;
+
+// per-process trace buffer published in shared memory as /sbctrace.<pid>,
+// read by tools/sbctrace
+typedef struct trace_buffer {
+    unsigned int magic;
+    unsigned int version;
+    pid_t pid;
+    int   enabled;    // may be flipped by sbctrace while the process runs
+    int   num_rings;  // rings claimed so far
+    TraceRing rings[SBC_TRACE_THREADS];
+} TraceBuffer;
+
+// an image being written in the background by sbc_snapshot_async
+typedef struct snapshot_job {
+    pid_t pid;      // the forked writer
+    int   done_fd;  // becomes readable once the image is complete
+} SnapshotJob;
+
+// the idle reclaim sweeper (sbc_reclaim_start)
+typedef struct sbc_reclaim_config {
+    unsigned long idle_ms;      // reclaim subcontexts not entered or left for this long
+    unsigned long interval_ms;  // between sweeps
+    double pageout_pressure;    // memory PSI (some avg10, %) from which to page out
+                                // rather than just mark cold; negative for never
+    int prefetch;               // MADV_WILLNEED a reclaimed subcontext on entry
+} SbcReclaimConfig;
+
+// a zygote worker: serves the client that asked for it on conn, with the
+// zygote's images mapped as fds[0..num_fds); returns the exit status
+typedef int (*SbcWorker)(int conn, const int *fds, size_t num_fds, void *arg);
+
+// the subcontext arena allocator: power-of-two size classes, the smallest
+// holding SBC_ARENA_MIN bytes including the block header
+#define SBC_ARENA_MAGIC   0x616e7261u
+#define SBC_ARENA_CLASSES 40
+#define SBC_ARENA_MIN     32
+// default reservation, and the distance kept from the server's heap
+#define SBC_ARENA_RESERVE (64UL << 20)
+#define SBC_ARENA_GAP     (1UL << 30)
+
+// arena state, kept in the first page of the arena's reservation so it is
+// snapshotted together with the memory it manages
+typedef struct sbc_arena {
+    unsigned int magic;
+    char *base;  // first block
+    char *top;   // next unused byte; memory past it has never been handed out
+    char *end;   // end of the reservation
+    void *free_lists[SBC_ARENA_CLASSES];
+} SbcArena;
+
+// synchronization for state that clients share through an image's shared
+// regions (sbc_sync.c). each is a few words, zero when unlocked or unused,
+// so they can be placed anywhere in a shared region before the snapshot
+typedef struct sbc_mutex {
+    unsigned int state;  // 0 unlocked, 1 locked, 2 locked with waiters
+} SbcMutex;
+
+typedef struct sbc_seqlock {
+    unsigned int seq;  // odd while a writer is inside
+} SbcSeqlock;
+
+typedef struct sbc_counter {
+    ulong value;
+} SbcCounter;
+
 /* global state maintained in sbc_mm.c */
 extern MappedSubcontext mapped_subcontexts[MAX_IMG_FILES];
 extern size_t          num_mapped_subcontexts;
@@ -63,11 +350,57 @@ extern size_t          num_client_regions;
 
 /* for server processes */
 int create_image_file(const char *filename, void (**func_list)(int), size_t num_funcs);
+int create_image_memfd(const char *filename, void (**func_list)(int), size_t num_funcs);
+int sbc_snapshot_async(const char *filename, void (**func_list)(int), size_t num_funcs,
+                       SnapshotJob *job);
+int sbc_snapshot_wait(SnapshotJob *job);
+int sbc_write_image(int w_fd, const ImageRegion *regions, size_t num_regions,
+                    void (**func_list)(int), size_t num_funcs);
+int sbc_bind_now(void);
+int sbc_set_sharing(void *addr, size_t len, int policy);
+int sbc_exclude(void *addr, size_t len);
+int sbc_include_only(void *addr, size_t len);
+int sbc_export_signature(int func_idx, const char *sig);
+void sbc_snapshot_ranges_clear(void);
+void sbc_trim_heap(int enabled);
+
+/* for server code running inside a subcontext */
+extern SbcCallArgs sbc_call_args;
+void *sbc_slice(SbcSlice slice);
+int sbc_return_slice(size_t offset, size_t len);
+int sbc_arena_init(size_t reserve);
+void *sbc_arena_alloc(size_t size);
+void sbc_arena_free(void *ptr);
+void sbc_mutex_lock(SbcMutex *mutex);
+int sbc_mutex_trylock(SbcMutex *mutex);
+void sbc_mutex_unlock(SbcMutex *mutex);
+unsigned int sbc_seq_read_begin(const SbcSeqlock *lock);
+int sbc_seq_read_retry(const SbcSeqlock *lock, unsigned int seq);
+void sbc_seq_write_begin(SbcSeqlock *lock);
+void sbc_seq_write_end(SbcSeqlock *lock);
+ulong sbc_counter_add(SbcCounter *counter, ulong n);
+ulong sbc_counter_read(const SbcCounter *counter);
 
 /* for client processes */
 int map_subcontext(const char *filename); // client
+int map_subcontext_ex(const char *img_file, int flags);
+int map_subcontext_fd(int fd, const char *name);
+int map_subcontext_async(const char *img_file, int flags);
+int sbc_map_wait(int fd);
+int sbc_share_name(int fd, size_t entry_idx, char *buf, size_t len);
+void *sbc_call_buffer(int fd, size_t *size);
+int call_subcontext_slice(int func_idx, int fd, SbcSlice in, SbcSlice *out);
 int call_subcontext_function(int func_idx, int fd);
+void *sbc_export_address(int fd, int func_idx, const char *sig);
 int unmap_subcontext(int fd);
+int sbc_replace(int fd, const char *new_img);
+int sbc_prefault(int fd);
+int sbc_reset(int fd);
+int sbc_reset_untracked(int fd, void *addr, size_t len);
+void sbc_after_fork(void);
+int sbc_reclaim_start(const SbcReclaimConfig *config);
+void sbc_reclaim_stop(void);
+int sbc_reclaim_idle(unsigned long idle_ms, int advice, int prefetch);
 int setup_segv_handler(void);
 int disable_client_execute_permissions(void);
 int enable_client_execute_permissions(void);
@@ -76,18 +409,68 @@ int disable_all_subcontext_execute_permissions(void);
 MappedSubcontext* find_subcontext_by_addr(void *addr);
 int record_client_memory_regions(void);
 int is_library_address(void *addr);
+int sbc_sync_client_regions(void);
+void *sbc_dlopen(const char *file, int mode);
+int sbc_dlclose(void *handle);
+int sbc_register_region(void *addr, size_t len, int prot);
+int sbc_unregister_region(void *addr, size_t len);
 void sbc_client_init(void);
+int sbc_stats_name(pid_t pid, char *buf, size_t len);
+int mm_stats_attach(const char *name, int fd);
+void mm_stats_detach(int idx);
+int sbc_trace_name(pid_t pid, char *buf, size_t len);
+void sbc_trace_enable(int enabled);
+void sbc_verify_enable(int enabled);
+int mm_verify_enabled(void);
+unsigned long mm_trace_clock(void);
+void mm_trace(int type, int from_ctx, int to_ctx, void *addr, unsigned long start_ns);
+int mm_trace_ctx(const MappedSubcontext *subctx);
 
 /* for the match maker */
 void init();
 int request_map(const char *img_fname);
+int request_map_ex(const char *img_fname, int flags);
+int request_map_async(const char *img_fname, int flags);
 void finalize();
-void mm_handle_segv(void *fault_addr);
+int mm_handle_segv(void *fault_addr);
+int mm_replace_begin(MappedSubcontext *subctx);
+void mm_replace_end(void);
+void mm_leave_relaxed(void);
+void mm_mark_bystander(void);
+void mm_pending_after_fork(void);
+int mm_verify_now(MappedSubcontext *subctx);
+int mm_map_reserved(MappedSubcontext *subctx);
+int mm_reset(MappedSubcontext *subctx);
+int mm_reset_untracked(MappedSubcontext *subctx, ulong start, ulong end);
+void mm_reset_release(MappedSubcontext *subctx);
+unsigned long mm_coarse_clock(void);
+void mm_lock_mappings(void);
+void mm_unlock_mappings(void);
+
+/* passing image descriptors between processes (sbc_ipc.c) */
+int sbc_send_fd(int sock, int fd, const char *name);
+int sbc_recv_fd(int sock, char *name, size_t name_len);
+int sbc_broker_run(const char *path);
+int sbc_broker_publish(const char *path, const char *name, int fd);
+int sbc_broker_fetch(const char *path, const char *name);
+int sbc_broker_stop(const char *path);
+
+/* prefork workers with subcontexts already mapped (sbc_zygote.c) */
+int sbc_zygote_run(const char *path, const char **images, size_t num_images,
+                   SbcWorker worker, void *arg);
+int sbc_zygote_spawn(const char *path, pid_t *pid);
+int sbc_zygote_stop(const char *path);
 
 /* for use by server/client libraries */
 int check_for_overlap(unsigned long start, unsigned long end);
+int sbc_ipc_connect(const char *path);
+int sbc_ipc_listen(const char *path);
 int perms_to_prot(const char *perm);
+void *map_image_entry(int fd, size_t entry_idx, const Entry *entry, int writable, void *at,
+                      int fixed);
+ulong sbc_page_hash(const void *data, size_t len);
 int should_exclude_region(const char *line);
 int parse_maps_line(const char *line, ulong *start, ulong *end, char *perms);
+size_t sbc_arena_used(ulong start, ulong end);
 
 #endif